@@ -0,0 +1,268 @@
+#include "binlog.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+namespace sylar {
+
+namespace binlog {
+
+static void AppendU8(std::string& out, uint8_t v)       { out.append((const char*)&v, 1); }
+static void AppendU32(std::string& out, uint32_t v)     { out.append((const char*)&v, 4); }
+static void AppendStr(std::string& out, const std::string& v)
+{
+    AppendU32(out, (uint32_t)v.size());
+    out.append(v);
+}
+
+static void WriteAll(int fd, const char* data, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+StagingBuffer::StagingBuffer(size_t capacity, uint32_t tid, const std::string& thread_name)
+    :retired(false),
+     m_ring(capacity),
+     m_threadId(tid),
+     m_threadName(thread_name)
+{
+}
+
+size_t StagingBuffer::drain(std::string& out)
+{
+    return m_ring.drain([&out](const char* data, size_t len) {
+        out.append(data, len);
+    });
+}
+
+size_t StagingBuffer::drainTo(int fd)
+{
+    return m_ring.drain([fd](const char* data, size_t len) {
+        WriteAll(fd, data, len);
+    });
+}
+
+}
+
+namespace {
+/// 线程退出时把缓冲标记为 retired, 由写文件线程写空后从列表里去掉; 缓冲由线程和 BinLog 共同持有, 哪边先没了都不会悬空
+struct ThreadBinLogBuffer {
+    std::shared_ptr<binlog::StagingBuffer> buffer;
+    uint64_t owner = 0;                                 // 所属 BinLog 的 m_id
+    ~ThreadBinLogBuffer() {
+        if(buffer) {
+            buffer->retired = true;
+        }
+    }
+};
+static thread_local ThreadBinLogBuffer t_binlog_buffer;
+static std::atomic<uint64_t> s_binlog_id(0);
+}
+
+BinLog::BinLog()
+    :m_id(++s_binlog_id),
+     m_closed(true),
+     m_stopping(false),
+     m_writeCount(0),
+     m_drainRound(0)
+{
+}
+
+BinLog::~BinLog()
+{
+    close();
+}
+
+bool BinLog::open(const std::string& filename)
+{
+    close();
+    MutexType::Lock lock(m_mutex);
+    m_file.open(filename, std::ios::binary | std::ios::trunc);
+    if(!m_file) {
+        return false;
+    }
+    m_filename = filename;
+    m_file.write(binlog::FILE_MAGIC, sizeof(binlog::FILE_MAGIC));
+    m_file.write((const char*)&binlog::FILE_VERSION, 4);
+    m_file.write(m_allSites.data(), m_allSites.size());
+    m_pendingSites.clear();
+    for(auto& i : m_buffers) {
+        i->announced = false;                           // 新文件里要重新写 THREAD 记录
+    }
+    m_file.flush();
+    m_crashFd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(m_crashFd >= 0) {
+        AddCrashHook(&BinLog::OnCrash, this);
+    }
+    m_closed = false;
+    m_thread.reset(new Thread(std::bind(&BinLog::run, this), "binlog"));
+    return true;
+}
+
+void BinLog::close()
+{
+    if(!m_thread) {
+        return;
+    }
+    m_closed = true;
+    m_stopping = true;
+    m_thread->join();
+    m_thread.reset();
+    m_stopping = false;
+    while(drainOnce());
+    m_file.close();
+    if(m_crashFd >= 0) {
+        DelCrashHook(&BinLog::OnCrash, this);
+        ::close(m_crashFd);
+        m_crashFd = -1;
+    }
+}
+
+void BinLog::flush()
+{
+    uint64_t round = m_drainRound;
+    while(m_thread && m_drainRound < round + 2) {       // 完整的一轮一定在调用之后开始, 之前提交的记录都写出去了
+        usleep(100);
+    }
+}
+
+uint32_t BinLog::registerSite(const std::string& logger_name, LogLevel::Level level, const char* file, int32_t line,
+                              const char* fmt, const std::vector<uint8_t>& arg_types)
+{
+    MutexType::Lock lock(m_mutex);
+    uint32_t id = ++m_siteCount;
+    std::string rec;
+    binlog::AppendU8(rec, binlog::SITE);
+    binlog::AppendU32(rec, id);
+    binlog::AppendU8(rec, (uint8_t)level);
+    binlog::AppendU32(rec, (uint32_t)line);
+    binlog::AppendStr(rec, file);
+    binlog::AppendStr(rec, fmt);
+    binlog::AppendStr(rec, logger_name);
+    binlog::AppendU8(rec, (uint8_t)arg_types.size());
+    rec.append((const char*)arg_types.data(), arg_types.size());
+    m_allSites += rec;
+    m_pendingSites += rec;
+    return id;
+}
+
+binlog::StagingBuffer* BinLog::getThreadBuffer()
+{
+    ThreadBinLogBuffer& t = t_binlog_buffer;
+    if(!t.buffer || t.owner != m_id) {
+        if(t.buffer) {
+            t.buffer->retired = true;                   // 别的(可能已经销毁的) BinLog 的缓冲, 这个 BinLog 不会去读它
+        }
+        std::shared_ptr<binlog::StagingBuffer> buf(new binlog::StagingBuffer(BUFFER_SIZE, GetThreadId(), Thread::GetName()));
+        {
+            MutexType::Lock lock(m_mutex);
+            m_buffers.push_back(buf);
+        }
+        t.buffer = buf;
+        t.owner = m_id;
+    }
+    return t.buffer.get();
+}
+
+size_t BinLog::drainOnce()
+{
+    m_draining = true;                                  // 和 OnCrash 里 "m_crashed = true; 再看 m_draining" 配对(都是 seq_cst)
+    if(m_crashed) {
+        m_draining = false;
+        return 0;
+    }
+    size_t count = 0;
+    std::string sites;
+    m_batch.clear();
+    {
+        // 持锁期间不会有新的调用点注册, 所以本轮读到的记录引用的 SITE 一定已经在 m_pendingSites 里
+        MutexType::Lock lock(m_mutex);
+        for(auto it = m_buffers.begin(); it != m_buffers.end();) {
+            binlog::StagingBuffer* buf = it->get();
+            bool retired = buf->retired;                // 先读标记再写空: 标记之后线程不会再写
+            size_t mark = m_batch.size();
+            size_t n = buf->drain(m_batch);
+            if(n && !buf->announced) {
+                std::string rec;
+                binlog::AppendU8(rec, binlog::THREAD);
+                binlog::AppendU32(rec, buf->getThreadId());
+                binlog::AppendStr(rec, buf->getThreadName());
+                m_batch.insert(mark, rec);
+                buf->announced = true;
+            }
+            count += n;
+            if(retired) {
+                it = m_buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        sites.swap(m_pendingSites);
+    }
+    if(!sites.empty() || count) {
+        m_file.write(sites.data(), sites.size());
+        m_file.write(m_batch.data(), m_batch.size());
+        m_file.flush();
+        m_writeCount += count;
+    }
+    m_draining = false;
+    return count;
+}
+
+void BinLog::OnCrash(void* arg)
+{
+    // 信号处理函数里调用: 不加锁(崩溃的可能就是持锁的线程), 只用 write(2)
+    BinLog* self = (BinLog*)arg;
+    self->m_crashed = true;
+    for(int i = 0; i < 100 && self->m_draining; ++i) {  // 后台线程正在写一轮, 最多等它100ms
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, nullptr);
+    }
+    if(self->m_draining) {
+        return;                                         // 后台线程卡住了, 再写会和它交错
+    }
+    int fd = self->m_crashFd;
+    binlog::WriteAll(fd, self->m_pendingSites.data(), self->m_pendingSites.size());
+    for(auto& buf : self->m_buffers) {
+        if(buf->empty()) {
+            continue;
+        }
+        if(!buf->announced) {
+            char rec[1 + 4 + 4 + 256];
+            const std::string& name = buf->getThreadName();
+            uint32_t tid = buf->getThreadId();
+            uint32_t len = (uint32_t)std::min(name.size(), (size_t)256);
+            rec[0] = (char)binlog::THREAD;
+            memcpy(rec + 1, &tid, 4);
+            memcpy(rec + 5, &len, 4);
+            memcpy(rec + 9, name.data(), len);
+            binlog::WriteAll(fd, rec, 9 + len);
+            buf->announced = true;
+        }
+        buf->drainTo(fd);
+    }
+}
+
+void BinLog::run()
+{
+    while(!m_stopping) {
+        if(!drainOnce()) {
+            usleep(1000);
+        }
+        ++m_drainRound;
+    }
+}
+
+}
@@ -0,0 +1,255 @@
+#ifndef __SYLAR_BINLOG_H__
+#define __SYLAR_BINLOG_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <fstream>
+#include <atomic>
+#include <type_traits>
+
+#include "log.h"
+#include "thread.h"
+#include "singleton.h"
+
+/* ******************** 二进制(延迟格式化)日志 ********************
+ * 参考 NanoLog: 调用点的静态信息(文件, 行号, 级别, 格式串, 参数类型)只在第一次执行时注册一次, 得到一个 site id,
+ * 之后每次只把 site id + 参数的原始值写进当前线程的缓冲, 不做任何格式化。后台线程把各线程缓冲里的记录原样写到二进制文件,
+ * 格式化留给离线工具 sylar_logdecode(tools/logdecode.cc), 它用 LogFormatter 的格式把文件还原成文本。
+ *
+ * 用法:
+ *      sylar::BinLogMgr::GetInstance()->open("app.binlog");
+ *      MYLOG_BIN_INFO(logger, "user {} login from {}, cost {}ms", uid, ip, 3.5);
+ *
+ * 格式串里每个 {} 依次替换成一个参数。支持的参数类型: 整数, bool, char, 浮点, const char*, std::string。
+ * logger 只用来判断级别, 并在注册时记下名字(%c), 一个调用点要始终用同一个 logger。
+ */
+
+// 一个调用点: 注册一次(线程安全的局部静态变量), 之后只写原始参数
+#define MYLOG_BIN(logger, level, fmt, ...) \
+    do { \
+        if((level) >= SYLAR_LOG_MIN_LEVEL && sylar::GetLoggerPtr(logger)->getLevel() <= (level)) { \
+            static const uint32_t sylar_binlog_site = sylar::BinLogMgr::GetInstance()->registerSite( \
+                    logger->getName(), level, __FILE__, __LINE__, fmt, sylar::binlog::ArgTypes(__VA_ARGS__)); \
+            sylar::BinLogMgr::GetInstance()->log(sylar_binlog_site, ##__VA_ARGS__); \
+        } \
+    } while(0)
+
+#define MYLOG_BIN_DEBUG(logger, fmt, ...) MYLOG_BIN(logger, sylar::LogLevel::DEBUG, fmt, ##__VA_ARGS__)
+#define MYLOG_BIN_INFO(logger, fmt, ...)  MYLOG_BIN(logger, sylar::LogLevel::INFO, fmt, ##__VA_ARGS__)
+#define MYLOG_BIN_WARN(logger, fmt, ...)  MYLOG_BIN(logger, sylar::LogLevel::WARN, fmt, ##__VA_ARGS__)
+#define MYLOG_BIN_ERROR(logger, fmt, ...) MYLOG_BIN(logger, sylar::LogLevel::ERROR, fmt, ##__VA_ARGS__)
+#define MYLOG_BIN_FATAL(logger, fmt, ...) MYLOG_BIN(logger, sylar::LogLevel::FATAL, fmt, ##__VA_ARGS__)
+
+namespace sylar {
+
+namespace binlog {
+
+/* 文件格式(小端, 和写入机器一致):
+ *      文件头  : "SYLARBIN" + uint32 版本
+ *      记录    : uint8 类型 + 内容, 字符串都是 uint32 长度 + 字节
+ *          SITE    : uint32 id, uint8 level, uint32 line, str file, str fmt, str logger, uint8 参数个数, 每个参数 uint8 类型
+ *          THREAD  : uint32 tid, str name              (某个线程的第一批日志之前写一次)
+ *          LOG     : uint32 site, uint32 tid, uint32 fiber, uint64 微秒时间戳, 依次是各参数
+ *      参数: INT64/UINT64/DOUBLE/CHAR 都是 8 字节, STRING 是 str
+ */
+static const char FILE_MAGIC[8] = {'S', 'Y', 'L', 'A', 'R', 'B', 'I', 'N'};
+static const uint32_t FILE_VERSION = 1;
+static const uint32_t MAX_STRING_LEN = 64 * 1024;      // 单个字符串参数最多记录这么长, 多的截断
+
+enum RecordType {
+    SITE = 1,
+    THREAD = 2,
+    LOG = 3
+};
+
+enum ArgType {
+    INT64 = 1,
+    UINT64 = 2,
+    DOUBLE = 3,
+    CHAR = 4,
+    STRING = 5
+};
+
+/// 参数类型 -> 类型标记, 编码长度, 编码方法。不支持的类型在编译期报错
+template<class T, class Enable = void>
+struct ArgTraits;
+
+template<class T>
+struct ArgTraits<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value && !std::is_same<T, char>::value>::type> {
+    static const uint8_t type = INT64;
+    static size_t size(T)                   { return 8; }
+    static void encode(char*& p, T v)       { int64_t x = v; memcpy(p, &x, 8); p += 8; }
+};
+
+template<class T>
+struct ArgTraits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value && !std::is_same<T, char>::value>::type> {
+    static const uint8_t type = UINT64;
+    static size_t size(T)                   { return 8; }
+    static void encode(char*& p, T v)       { uint64_t x = v; memcpy(p, &x, 8); p += 8; }
+};
+
+template<class T>
+struct ArgTraits<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static const uint8_t type = DOUBLE;
+    static size_t size(T)                   { return 8; }
+    static void encode(char*& p, T v)       { double x = v; memcpy(p, &x, 8); p += 8; }
+};
+
+template<>
+struct ArgTraits<char> {
+    static const uint8_t type = CHAR;
+    static size_t size(char)                { return 8; }
+    static void encode(char*& p, char v)    { int64_t x = v; memcpy(p, &x, 8); p += 8; }
+};
+
+template<>
+struct ArgTraits<const char*> {
+    static const uint8_t type = STRING;
+    static uint32_t length(const char* v)   { size_t n = v ? strlen(v) : 0; return n > MAX_STRING_LEN ? MAX_STRING_LEN : (uint32_t)n; }
+    static size_t size(const char* v)       { return 4 + length(v); }
+    static void encode(char*& p, const char* v) {
+        uint32_t n = length(v);
+        memcpy(p, &n, 4);
+        memcpy(p + 4, v, n);
+        p += 4 + n;
+    }
+};
+
+template<>
+struct ArgTraits<char*> : public ArgTraits<const char*> {};
+
+template<>
+struct ArgTraits<std::string> {
+    static const uint8_t type = STRING;
+    static uint32_t length(const std::string& v) { return v.size() > MAX_STRING_LEN ? MAX_STRING_LEN : (uint32_t)v.size(); }
+    static size_t size(const std::string& v)     { return 4 + length(v); }
+    static void encode(char*& p, const std::string& v) {
+        uint32_t n = length(v);
+        memcpy(p, &n, 4);
+        memcpy(p + 4, v.data(), n);
+        p += 4 + n;
+    }
+};
+
+template<class T>
+struct Arg : public ArgTraits<typename std::remove_cv<typename std::decay<T>::type>::type> {};
+
+template<class... Args>
+std::vector<uint8_t> ArgTypes(const Args&... args)
+{
+    return std::vector<uint8_t>{Arg<Args>::type...};
+}
+
+/// 每个线程一个的单生产者单消费者字节环形缓冲(SpscByteRing): 生产者是该线程, 消费者是后台写文件线程
+class StagingBuffer {
+public:
+    StagingBuffer(size_t capacity, uint32_t tid, const std::string& thread_name);
+
+    /// 预留 len 字节(满了就让出CPU等待), 写完后 commit; 等待时 *abort 变为 true 就放弃, 返回 nullptr
+    char* reserve(size_t len, const std::atomic<bool>* abort = nullptr)   { return m_ring.reserve(len, abort, &m_waitCount); }
+    void commit()                                       { m_ring.commit(); }
+    size_t drain(std::string& out);                     // 把已提交的记录追加到 out, 返回条数
+    size_t drainTo(int fd);                             // 崩溃时用: 已提交的记录直接 write 到 fd, 不分配内存
+
+    uint32_t getThreadId() const                        { return m_threadId; }
+    const std::string& getThreadName() const            { return m_threadName; }
+    bool empty() const                                  { return m_ring.empty(); }
+    size_t capacity() const                             { return m_ring.capacity(); }
+    uint64_t getWaitCount() const                       { return m_waitCount; }
+
+    bool announced = false;                             // THREAD 记录是否已经写过(只有写文件线程访问)
+    std::atomic<bool> retired;                          // 线程已经退出, 写空之后释放
+private:
+    SpscByteRing m_ring;
+    uint64_t m_waitCount = 0;                           // 生产者等空间的次数(只有生产者写)
+    uint32_t m_threadId;
+    std::string m_threadName;
+};
+
+}
+
+/* ******************** 二进制日志的写入器 ********************
+ * 一个进程一个(BinLogMgr), open() 之后启动后台线程, 每毫秒把各线程的缓冲写到文件一次
+ */
+class BinLog {
+public:
+    typedef Mutex MutexType;
+    enum { BUFFER_SIZE = 1 << 20 };                     // 每个线程的缓冲大小
+
+    BinLog();
+    ~BinLog();
+
+    bool open(const std::string& filename);
+    void close();                                       // 写完所有缓冲里的记录, 停止后台线程
+    void flush();                                       // 等后台线程把当前已提交的记录写到文件
+    bool isOpen() const                                 { return !m_closed; }
+
+    uint32_t registerSite(const std::string& logger_name, LogLevel::Level level, const char* file, int32_t line,
+                          const char* fmt, const std::vector<uint8_t>& arg_types);
+
+    template<class... Args>
+    void log(uint32_t site, const Args&... args)
+    {
+        if(m_closed) {
+            return;
+        }
+        size_t len = 1 + 4 + 4 + 4 + 8;                 // type, site, tid, fiber, time
+        int sizes[] = {0, (len += binlog::Arg<Args>::size(args), 0)...};
+        (void)sizes;
+        if(len > BUFFER_SIZE / 2) {                     // 放不进线程缓冲的超大记录直接丢弃
+            return;
+        }
+        binlog::StagingBuffer* buf = getThreadBuffer();
+        char* p = buf->reserve(len, &m_closed);        // 等空间时被 close() 了: 不会再有人腾空间, 丢掉这条
+        if(!p) {
+            return;
+        }
+        *p++ = (char)binlog::LOG;
+        uint32_t tid = buf->getThreadId();
+        uint32_t fiber = GetFiberId();
+        uint64_t now = GetFastUS();
+        memcpy(p, &site, 4);
+        memcpy(p + 4, &tid, 4);
+        memcpy(p + 8, &fiber, 4);
+        memcpy(p + 12, &now, 8);
+        p += 20;
+        int encodes[] = {0, (binlog::Arg<Args>::encode(p, args), 0)...};
+        (void)encodes;
+        buf->commit();
+    }
+
+    uint64_t getWriteCount() const                      { return m_writeCount; }
+private:
+    binlog::StagingBuffer* getThreadBuffer();
+    void run();
+    size_t drainOnce();                                 // 写一轮, 返回写出的记录条数
+    static void OnCrash(void* arg);                     // 崩溃钩子: 等后台线程写完手上这一轮, 把各线程缓冲里剩下的记录写到文件
+
+private:
+    std::string m_filename;
+    std::ofstream m_file;
+    MutexType m_mutex;                                  // 保护 m_buffers, m_pendingSites, m_siteCount
+    std::list<std::shared_ptr<binlog::StagingBuffer> > m_buffers;     // 和线程各持有一份: 谁后放手谁释放
+    std::string m_allSites;                             // 所有 SITE 记录, open() 新文件时先写一遍
+    std::string m_pendingSites;                         // 已注册还没写到文件的 SITE 记录
+    std::string m_batch;                                // 后台线程一轮的输出, 容量复用
+    uint32_t m_siteCount = 0;
+    uint64_t m_id;                                      // 线程局部的缓冲用它认出是不是这个 BinLog 的(不会复用)
+    std::atomic<bool> m_closed;                         // 没 open 或者已经 close()
+    std::atomic<bool> m_stopping;
+    std::atomic<uint64_t> m_writeCount;
+    std::atomic<uint64_t> m_drainRound;                 // 后台线程完成的轮数, flush() 用
+    Thread::ptr m_thread;
+    int m_crashFd = -1;                                 // 崩溃时用 write(2) 追加(ofstream 不是异步信号安全的)
+    std::atomic<bool> m_draining {false};               // 后台线程正在写一轮
+    std::atomic<bool> m_crashed {false};                // 进程崩溃了, 后台线程不再写
+};
+
+typedef sylar::Singleton<BinLog> BinLogMgr;
+
+}
+
+#endif
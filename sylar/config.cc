@@ -3,12 +3,20 @@
 #include <list>
 #include "log.h"
 #include <iostream>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <string.h>
 
 namespace sylar
 {
 // Config::ConfigVarMap Config::s_datas = std::map<std::string, ConfigVarBase::ptr>();  
 // Config::ConfigVarMap Config::s_datas = Config::ConfigVarMap();
-Config::ConfigVarMap Config::s_datas;
+// Config::ConfigVarMap Config::s_datas;           // 改成 Config::GetDatas() 里的函数内静态变量
 
 
 /*  ListAllMember 函数的作用是递归地遍历YAML节点，并将每个节点的路径和节点本身存储到一个列表中。
@@ -19,8 +27,14 @@ static void ListAllMember(const std::string& prefix,
                           const YAML::Node& node,
                           std::list<std::pair<std::string, const YAML::Node> >& output) 
 {
-    if(prefix.find_first_not_of("abcdefghikjlmnopqrstuvwxyz._012345678") != std::string::npos) 
+    if(prefix.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") != std::string::npos) 
     {
+        // map 类型配置的值里的键(比如路由表的 "/api")不是配置名, 不报错
+        for(size_t pos = prefix.find('.'); pos != std::string::npos; pos = prefix.find('.', pos + 1)) {
+            if(Config::LookupBase(prefix.substr(0, pos))) {
+                return;
+            }
+        }
         MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Config invalid name: " << prefix << " : " << node;
         return;
     }
@@ -36,8 +50,37 @@ static void ListAllMember(const std::string& prefix,
 
 ConfigVarBase::ptr Config::LookupBase(const std::string &name)
 {
-    auto it = s_datas.find(name);
-    return it == s_datas.end() ? nullptr : it->second;
+    uint64_t hash = ConfigNameHash(name);
+    RWMutexType::ReadLock lock(GetMutex());
+    ConfigVarMap& datas = GetDatas();
+    auto it = datas.find(hash);
+    return (it == datas.end() || it->second->getName() != name) ? nullptr : it->second;
+}
+
+ConfigVarBase::ptr Config::Register(const std::string& name, const std::function<ConfigVarBase::ptr ()>& create)
+{
+    uint64_t hash = ConfigNameHash(name);
+    RWMutexType::WriteLock lock(GetMutex());
+    ConfigVarMap& datas = GetDatas();
+    auto it = datas.find(hash);
+    if(it != datas.end()) {
+        if(it->second->getName() != name) {
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Config name hash collision: " << name
+                                          << " vs " << it->second->getName();
+            throw std::invalid_argument("config name hash collision: " + name);
+        }
+        return it->second;                              // 读锁查完到拿写锁之间别的线程注册了
+    }
+    ConfigVarBase::ptr var = create();
+    datas.insert(std::make_pair(hash, var));
+    RegistryHash() += ConfigNameHash(var->getName() + ":" + var->getTypeName());
+    return var;
+}
+
+uint64_t Config::GetRegistryHash()
+{
+    RWMutexType::ReadLock lock(GetMutex());
+    return RegistryHash();
 }
 
 /*  这个函数的主要作用是从'YAML配置文件'中加载配置，并将其存储到内存中
@@ -48,16 +91,16 @@ ConfigVarBase::ptr Config::LookupBase(const std::string &name)
  *  且 key 与 value的关系 已经确定（数据按照已经确定的关系去处理）
  */
 void Config:: LoadFromYaml(const YAML::Node &root)                          // 该方法 将yaml中的配置覆盖到原有配置的核心方法
+{
+    ApplyYaml(root, nullptr);
+}
+
+void Config::ApplyYaml(const YAML::Node& root, std::vector<ConfigVarBase::ptr>* vars)
 {
     std::list<std::pair<std::string, const YAML::Node> > all_nodes;         // 节点类型<string,YAML::Node>
     ListAllMember("", root, all_nodes);                                     // ListAllMember 函数将YAML文件中的嵌套结构扁平化
 
-    for (auto it = all_nodes.begin(); it != all_nodes.end(); it++){
-        std::cout << it->first << std::endl;
-    }
-    for (auto it = all_nodes.begin(); it != all_nodes.end(); it++){
-        std::cout << it->second << std::endl;
-    }
+    ConfigTransaction tx;
     for(auto& i : all_nodes) 
     {
         std::string key = i.first;
@@ -69,13 +112,613 @@ void Config:: LoadFromYaml(const YAML::Node &root)                          // 
 
         if(var) 
         {
-            if(i.second.IsScalar()) {
-                var->fromString(i.second.Scalar());
-            } else {
-                std::stringstream ss;
-                ss << i.second;
-                var->fromString(ss.str());
+            std::shared_ptr<const void> value = var->parseNode(i.second);   // 直接按节点转换, 不再 dump 成字符串重新解析
+            if(value)
+                tx.stage(var.get(), value);
+            if(vars)
+                vars->push_back(var);
+        }
+    }
+    tx.commit();                                    // 整个文件一次提交: 一个版本号, 读的一方不会看到加载了一半的配置
+}
+
+/* ******************** 二进制配置缓存 ********************
+ * 文件格式(本机字节序):
+ *      CacheHeader
+ *      count 个 { u32 名字长度, 名字, u32 值长度, 值(ConfigVarBase::toBinary) }
+ */
+namespace {
+
+const uint32_t CACHE_MAGIC = 0x43435953;                                // "SYCC"
+const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;                                               // YAML 文件内容的哈希
+    uint64_t registry_hash;                                             // 写缓存时注册表的哈希, 配置项增删或者改了类型缓存就作废
+    uint32_t count;
+    uint32_t reserved;
+};
+
+bool ReadFile(const std::string& file, std::string& content)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if(ok) {
+        content.resize(st.st_size);
+        size_t off = 0;
+        while(off < content.size()) {
+            ssize_t n = read(fd, &content[off], content.size() - off);
+            if(n <= 0) {
+                break;
+            }
+            off += n;
+        }
+        content.resize(off);
+    }
+    close(fd);
+    return ok;
+}
+
+/// 按缓存里的顺序转换出所有的值, 全部成功才一次提交
+bool ApplyCache(const char* data, size_t size, uint64_t source_hash, uint64_t registry_hash)
+{
+    CacheHeader header;
+    if(size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if(header.magic != CACHE_MAGIC || header.version != CACHE_VERSION
+            || header.source_hash != source_hash || header.registry_hash != registry_hash) {
+        return false;
+    }
+    detail::BinaryInput in(data + sizeof(header), size - sizeof(header));
+    ConfigTransaction tx;
+    std::string name;
+    for(uint32_t i = 0; i < header.count; ++i) {
+        uint32_t len = 0;
+        if(!detail::BinaryCast<std::string>::Read(in, name) || !in.read(&len, sizeof(len)) || in.remain() < len) {
+            return false;
+        }
+        ConfigVarBase::ptr var = Config::LookupBase(name);
+        std::shared_ptr<const void> value = var ? var->parseBinary(in.ptr, len) : nullptr;
+        if(!value) {
+            return false;
+        }
+        tx.stage(var.get(), value);
+        in.ptr += len;
+    }
+    tx.commit();
+    return true;
+}
+
+bool LoadCache(const std::string& path, uint64_t source_hash, uint64_t registry_hash)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        return false;
+    }
+    bool rt = ApplyCache((const char*)addr, st.st_size, source_hash, registry_hash);
+    munmap(addr, st.st_size);
+    return rt;
+}
+
+/// 先写临时文件再 rename, 别的进程不会读到写了一半的缓存
+bool SaveCache(const std::string& path, uint64_t source_hash, uint64_t registry_hash, const std::vector<ConfigVarBase::ptr>& vars)
+{
+    std::string buf(sizeof(CacheHeader), '\0');
+    std::string value;
+    try {
+        for(auto& i : vars) {
+            value.clear();
+            i->toBinary(value);
+            detail::BinaryCast<std::string>::Write(buf, i->getName());
+            detail::BinaryCast<std::string>::Write(buf, value);
+        }
+    } catch(const std::exception& e) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Config save cache " << path << " fail: " << e.what();
+        return false;
+    }
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.source_hash = source_hash;
+    header.registry_hash = registry_hash;
+    header.count = vars.size();
+    memcpy(&buf[0], &header, sizeof(header));
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Config save cache open " << tmp << " errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+    size_t off = 0;
+    while(off < buf.size()) {
+        ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+        if(n <= 0) {
+            break;
+        }
+        off += n;
+    }
+    close(fd);
+    if(off != buf.size() || rename(tmp.c_str(), path.c_str()) != 0) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Config save cache " << path << " errno=" << errno << " " << strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
+
+bool Config::LoadFromFile(const std::string& file, const std::string& cache_file, bool* from_cache)
+{
+    if(from_cache) {
+        *from_cache = false;
+    }
+    std::string content;
+    if(!ReadFile(file, content)) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Config load " << file << " errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+    std::string cache = cache_file.empty() ? file + ".cache" : cache_file;
+    uint64_t source_hash = ConfigNameHash(content);
+    uint64_t registry_hash = GetRegistryHash();
+    if(LoadCache(cache, source_hash, registry_hash)) {
+        if(from_cache) {
+            *from_cache = true;
+        }
+        return true;
+    }
+
+    YAML::Node root;
+    try {
+        root = YAML::Load(content);
+    } catch(const std::exception& e) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Config load " << file << " fail: " << e.what();
+        return false;
+    }
+    std::vector<ConfigVarBase::ptr> vars;
+    ApplyYaml(root, &vars);
+    SaveCache(cache, source_hash, registry_hash, vars);
+    return true;
+}
+
+size_t Config::LoadFromYaml(const YAML::Node& root, std::unordered_map<std::string, std::string>& applied)
+{
+    std::list<std::pair<std::string, const YAML::Node> > all_nodes;
+    ListAllMember("", root, all_nodes);
+
+    size_t count = 0;
+    ConfigTransaction tx;
+    std::unordered_map<std::string, std::string> current;
+    for(auto& i : all_nodes)
+    {
+        std::string key = i.first;
+        if(key.empty())
+            continue;
+
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        ConfigVarBase::ptr var = LookupBase(key);
+        if(!var)
+            continue;
+
+        std::string text = YAML::Dump(i.second);
+        auto it = applied.find(key);
+        if(it != applied.end() && it->second == text) {
+            current[key].swap(it->second);                              // 没变
+            continue;
+        }
+        std::shared_ptr<const void> value = var->parseNode(i.second);
+        if(value) {
+            tx.stage(var.get(), value);
+            ++count;
+            current[key].swap(text);
+        }                                                               // 转换失败的不记下来, 下次再试
+    }
+    tx.commit();
+    applied.swap(current);
+    return count;
+}
+
+/* ******************** 事务和版本 ******************** */
+namespace {
+
+typedef std::shared_ptr<const detail::ConfigState> ConfigStatePtr;
+
+struct CommitState {
+    Mutex mutex;                                                        // 提交锁: 所有配置值的替换都在这里面
+    std::atomic<const ConfigStatePtr*> state {new ConfigStatePtr(std::make_shared<const detail::ConfigState>())};   // 同 ConfigVar::m_value
+    RWMutex listenerMutex;
+    std::map<uint64_t, std::function<void (const ConfigCommit&)> > listeners;
+};
+
+/// 函数内静态变量: 别的编译单元静态初始化时就可能 setValue
+CommitState& GetCommitState()
+{
+    static CommitState s_commit;
+    return s_commit;
+}
+
+}
+
+void ConfigVarBase::deliverChange(uint64_t seq, std::shared_ptr<const void> old_value, std::shared_ptr<const void> new_value)
+{
+    {
+        Mutex::Lock lock(m_notifyMutex);
+        m_pendingChanges[seq] = std::make_pair(old_value, new_value);
+        if(m_notifying) {
+            return;                                                     // 正在通知的线程会接着调用这一次
+        }
+        m_notifying = true;
+    }
+    while(true) {
+        std::pair<std::shared_ptr<const void>, std::shared_ptr<const void> > change;
+        {
+            Mutex::Lock lock(m_notifyMutex);
+            auto it = m_pendingChanges.find(m_notifiedSeq + 1);
+            if(it == m_pendingChanges.end()) {                          // 下一次修改的提交者还没走到这里, 由它来通知
+                m_notifying = false;
+                return;
+            }
+            change.swap(it->second);
+            m_pendingChanges.erase(it);
+            ++m_notifiedSeq;
+        }
+        try {
+            notifyListeners(change.first.get(), change.second.get());
+        } catch(...) {
+            Mutex::Lock lock(m_notifyMutex);
+            m_notifying = false;                                        // 回调抛出的异常交给调用方, 排着的留给下一次提交
+            throw;
+        }
+    }
+}
+
+size_t ConfigVarBase::AllocSlot()
+{
+    static std::atomic<size_t> s_slot(0);
+    return s_slot++;
+}
+
+std::shared_ptr<const detail::ConfigState> detail::LoadConfigState()
+{
+    EpochGuard guard;
+    return *GetCommitState().state.load(std::memory_order_acquire);
+}
+
+uint64_t detail::PublishConfig(const std::vector<ConfigChange>& changes)
+{
+    CommitState& cs = GetCommitState();
+    std::vector<std::shared_ptr<const void> > old_values;
+    std::vector<uint64_t> seqs;
+    ConfigCommit commit;
+    const ConfigStatePtr* retired = nullptr;
+    {
+        Mutex::Lock lock(cs.mutex);
+        const ConfigStatePtr& cur = *cs.state.load(std::memory_order_relaxed);   // 只在提交锁里换, 这里不会被释放
+        std::shared_ptr<ConfigState> next(new ConfigState(*cur));     // 只复制块指针
+        std::map<size_t, std::shared_ptr<ConfigState::Chunk> > copied; // 这次提交复制出来(可以改)的块
+        for(auto& i : changes) {
+            std::shared_ptr<const void> value = i.second;
+            if(!i.first->exchangeValue(value)) {                        // 和当前值一样
+                continue;
+            }
+            size_t slot = i.first->getSlot();
+            size_t idx = slot / ConfigState::CHUNK_SIZE;
+            std::shared_ptr<ConfigState::Chunk>& chunk = copied[idx];
+            if(!chunk) {
+                if(idx >= next->chunks.size()) {
+                    next->chunks.resize(idx + 1);
+                }
+                chunk = next->chunks[idx] ? std::make_shared<ConfigState::Chunk>(*next->chunks[idx])
+                                          : std::make_shared<ConfigState::Chunk>();
+                next->chunks[idx] = chunk;
+            }
+            chunk->values[slot % ConfigState::CHUNK_SIZE] = i.second;
+            old_values.push_back(value);
+            seqs.push_back(i.first->nextCommitSeq());
+            commit.vars.push_back(i.first);
+        }
+        if(commit.vars.empty()) {
+            return cur->version;
+        }
+        next->version = commit.version = cur->version + 1;
+        retired = cs.state.exchange(new ConfigStatePtr(next), std::memory_order_acq_rel);
+    }
+    Epoch::Retire(retired);
+
+    size_t idx = 0;                                                     // 回调在锁外调用, 回调里可以再改配置
+    for(auto& i : changes) {
+        if(idx < commit.vars.size() && commit.vars[idx] == i.first) {
+            i.first->deliverChange(seqs[idx], old_values[idx], i.second);
+            ++idx;
+        }
+    }
+    RWMutex::ReadLock lock(cs.listenerMutex);
+    for(auto& i : cs.listeners) {
+        i.second(commit);
+    }
+    return commit.version;
+}
+
+void ConfigTransaction::stage(ConfigVarBase* var, std::shared_ptr<const void> value)
+{
+    auto rt = m_index.insert(std::make_pair(var, m_changes.size()));
+    if(!rt.second) {
+        m_changes[rt.first->second].second = value;
+        return;
+    }
+    m_changes.push_back(detail::ConfigChange(var, value));
+}
+
+uint64_t ConfigTransaction::commit()
+{
+    std::vector<detail::ConfigChange> changes;
+    changes.swap(m_changes);
+    m_index.clear();
+    return detail::PublishConfig(changes);
+}
+
+uint64_t Config::GetVersion()
+{
+    return detail::LoadConfigState()->version;
+}
+
+void Config::AddCommitListener(uint64_t key, std::function<void (const ConfigCommit&)> cb)
+{
+    CommitState& cs = GetCommitState();
+    RWMutex::WriteLock lock(cs.listenerMutex);
+    cs.listeners[key] = cb;
+}
+
+void Config::DeleteCommitListener(uint64_t key)
+{
+    CommitState& cs = GetCommitState();
+    RWMutex::WriteLock lock(cs.listenerMutex);
+    cs.listeners.erase(key);
+}
+
+/* ******************** ConfigWatcher ******************** */
+namespace {
+
+bool IsYamlFile(const std::string& name)
+{
+    auto EndsWith = [&name](const char* ext) {
+        size_t len = strlen(ext);
+        return name.size() > len && name.compare(name.size() - len, len, ext) == 0;
+    };
+    return EndsWith(".yml") || EndsWith(".yaml");
+}
+
+}
+
+ConfigWatcher::ConfigWatcher(uint32_t debounce_ms)
+    :m_debounceMs(debounce_ms)
+{
+    m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_inotifyFd < 0 || m_wakeFd < 0) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigWatcher init fail errno=" << errno << " " << strerror(errno);
+        return;
+    }
+    m_thread.reset(new Thread(std::bind(&ConfigWatcher::run, this), "config_watch"));
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+    stop();
+    if(m_inotifyFd >= 0) {
+        close(m_inotifyFd);
+    }
+    if(m_wakeFd >= 0) {
+        close(m_wakeFd);
+    }
+}
+
+bool ConfigWatcher::addPath(const std::string& path)
+{
+    if(m_inotifyFd < 0) {
+        return false;
+    }
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigWatcher addPath " << path << " errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+
+    Watch w;
+    std::vector<std::string> files;
+    if(S_ISDIR(st.st_mode)) {
+        w.dir = path;
+        while(w.dir.size() > 1 && w.dir.back() == '/') {
+            w.dir.pop_back();
+        }
+        w.all = true;
+        DIR* dir = opendir(w.dir.c_str());
+        if(dir) {
+            while(struct dirent* ent = readdir(dir)) {
+                if(IsYamlFile(ent->d_name)) {
+                    files.push_back(w.dir + "/" + ent->d_name);
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(files.begin(), files.end());
+    } else {
+        size_t pos = path.rfind('/');
+        w.dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : path.substr(0, pos));
+        w.names.insert(pos == std::string::npos ? path : path.substr(pos + 1));
+        files.push_back(w.dir + "/" + *w.names.begin());
+    }
+
+    int wd = inotify_add_watch(m_inotifyFd, w.dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if(wd < 0) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigWatcher inotify_add_watch " << w.dir << " errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+    {
+        MutexType::Lock lock(m_mutex);
+        auto it = m_watches.find(wd);                                   // 同一个目录再加时 inotify 返回同一个 wd
+        if(it == m_watches.end()) {
+            m_watches[wd] = w;
+        } else {
+            it->second.all = it->second.all || w.all;
+            it->second.names.insert(w.names.begin(), w.names.end());
+        }
+    }
+    for(auto& i : files) {
+        reload(i);
+    }
+    return true;
+}
+
+size_t ConfigWatcher::reload(const std::string& file)
+{
+    std::unordered_map<std::string, std::string> applied;
+    {
+        MutexType::Lock lock(m_mutex);
+        FileState& fs = m_files[file];
+        if(fs.loading) {
+            fs.again = true;                                            // 别的线程(或者回调里重入)正在加载这个文件: 它加载完会再读一遍
+            return 0;
+        }
+        fs.loading = true;
+        applied.swap(fs.applied);
+    }
+    // 解析和应用都在锁外: 回调里可以 addPath()/reload(), 也不会卡住 readEvents
+    size_t count = 0;
+    while(true) {
+        bool ok = true;
+        try {
+            YAML::Node root = YAML::LoadFile(file);
+            count += Config::LoadFromYaml(root, applied);
+        } catch(const std::exception& e) {
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigWatcher load " << file << " fail: " << e.what();
+            ok = false;
+        }
+        MutexType::Lock lock(m_mutex);
+        FileState& fs = m_files[file];
+        if(ok && fs.again) {
+            fs.again = false;
+            continue;
+        }
+        fs.again = false;
+        fs.loading = false;
+        fs.applied.swap(applied);
+        if(!ok) {
+            return count;
+        }
+        break;
+    }
+    ++m_reloadCount;
+    m_applyCount += count;
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "ConfigWatcher reload " << file << " changed=" << count;
+    return count;
+}
+
+void ConfigWatcher::stop()
+{
+    if(!m_thread) {
+        return;
+    }
+    uint64_t one = 1;
+    if(write(m_wakeFd, &one, sizeof(one)) < 0) {
+        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigWatcher wake errno=" << errno;
+    }
+    m_thread->join();
+    m_thread.reset();
+}
+
+void ConfigWatcher::readEvents(std::set<std::string>& dirty)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(true) {
+        ssize_t len = read(m_inotifyFd, buf, sizeof(buf));
+        if(len <= 0) {
+            return;                                                     // EAGAIN: 读完了
+        }
+        MutexType::Lock lock(m_mutex);
+        for(char* p = buf; p < buf + len; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if(ev->mask & IN_Q_OVERFLOW) {                              // 事件丢了, 全部重新加载(没变的配置项不会被应用)
+                for(auto& i : m_files) {
+                    dirty.insert(i.first);
+                }
+                continue;
+            }
+            auto it = m_watches.find(ev->wd);
+            if(it == m_watches.end() || ev->len == 0) {
+                continue;
+            }
+            std::string name = ev->name;
+            if(it->second.all ? IsYamlFile(name) : it->second.names.count(name) > 0) {
+                dirty.insert(it->second.dir + "/" + name);
+            }
+        }
+    }
+}
+
+void ConfigWatcher::run()
+{
+    std::set<std::string> dirty;
+    uint64_t first_us = 0;                                              // 这一批第一个事件的时间
+    struct pollfd fds[2];
+    fds[0].fd = m_inotifyFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_wakeFd;
+    fds[1].events = POLLIN;
+    while(true) {
+        int timeout = -1;
+        if(!dirty.empty()) {
+            uint64_t waited_ms = (GetMonotonicUS() - first_us) / 1000;
+            uint64_t max_ms = m_debounceMs * 10ul;
+            timeout = waited_ms >= max_ms ? 0 : (int)std::min<uint64_t>(m_debounceMs, max_ms - waited_ms);
+        }
+        int rt = poll(fds, 2, timeout);
+        if(rt < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigWatcher poll errno=" << errno << " " << strerror(errno);
+            return;
+        }
+        if(fds[1].revents & POLLIN) {
+            return;
+        }
+        if(rt > 0 && (fds[0].revents & POLLIN)) {
+            bool was_empty = dirty.empty();
+            readEvents(dirty);
+            if(was_empty && !dirty.empty()) {
+                first_us = GetMonotonicUS();
+            }
+            if(timeout != 0) {
+                continue;                                               // 还有事件进来, 继续等安静下来
+            }
+        }
+        if(!dirty.empty()) {
+            for(auto& i : dirty) {
+                reload(i);
             }
+            dirty.clear();
         }
     }
 }
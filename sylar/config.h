@@ -22,6 +22,10 @@
 #include <unordered_set>
 #include <functional>
 #include <mutex>
+#include <type_traits>
+#include <typeinfo>
+#include <atomic>
+#include <string.h>
 
 #include "log.h"
 #include "util.h"
@@ -32,6 +36,18 @@ namespace sylar {
 
 /// 模板类不能实现在cpp，因为模板类在运行的时候才实现，所以连接的时候如果分离，就会报错，
 
+/// 配置名的哈希(64位 FNV-1a), 注册表按它索引; 配置项构造时算一次存在 ConfigVarBase 里
+inline uint64_t ConfigNameHash(const char* str, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+inline uint64_t ConfigNameHash(const std::string& name)     { return ConfigNameHash(name.c_str(), name.size()); }
+
 /* ******************** 一条配置信息： name: value # 注释信息（description）********************
  * ******************** 配置变量的基类(该基类 包含 name 和 注释) ********************
  */
@@ -43,21 +59,92 @@ public:
         ,m_description(description)                                             // description 配置参数描述
     {
         std::transform(m_name.begin(), m_name.end(), m_name.begin(), ::tolower);// 将名称变成大小写不明感的(只有小写)
+        m_hash = ConfigNameHash(m_name);
+        m_slot = AllocSlot();
     }
     virtual ~ConfigVarBase() {}                                                 // 有具体类型的子类，所以需要变成 虚析构
 
     const std::string& getName() const          { return m_name; }              // 返回配置参数名称
     const std::string& getDescription() const   { return m_description; }       // 返回配置参数的描述
+    uint64_t getHash() const                    { return m_hash; }              // 返回配置参数名称的哈希
+    size_t getSlot() const                      { return m_slot; }              // 在版本快照里的下标
 
     virtual std::string toString() = 0;                                         // 转成字符串
     virtual bool fromString(const std::string& value) = 0;                      // 从字符串初始化值
-//    virtual std::string getTypeName() const = 0;                                // 返回配置参数值的类型名称
+    virtual YAML::Node toNode() = 0;                                            // 转成YAML节点
+    virtual bool fromNode(const YAML::Node& node) = 0;                          // 直接从YAML节点初始化值(容器一次转换完, 没有中间的字符串)
+    virtual std::string getTypeName() const = 0;                                // 返回配置参数值的类型名称
+
+    // 以下给事务提交用, 值用类型擦除的 std::shared_ptr<const void> 传递(实际是 std::shared_ptr<const T>)
+    virtual std::shared_ptr<const void> parseNode(const YAML::Node& node) = 0;  // 只转换不设置, 失败返回 nullptr
+    virtual bool exchangeValue(std::shared_ptr<const void>& value) = 0;         // 和当前值不同时换上去, value 换回旧值; 相同返回 false
+    virtual void notifyListeners(const void* old_value, const void* new_value) = 0; // 调用这个配置项的回调
+    uint64_t nextCommitSeq()                    { return ++m_commitSeq; }       // 这一项的第几次修改, 需持有提交锁
+    /// 提交之后在锁外调用: 按 seq 的顺序调用回调。前面的修改还没通知完(别的线程正在通知, 或者还没轮到)时只排队,
+    /// 由正在通知的线程接着调用, 所以回调看到的 (旧值, 新值) 依次相连, 最后一次回调的新值就是当前值
+    void deliverChange(uint64_t seq, std::shared_ptr<const void> old_value, std::shared_ptr<const void> new_value);
+
+    // 配置缓存用: 当前值序列化成二进制 / 从二进制转换(只转换不设置, 失败返回 nullptr)
+    virtual void toBinary(std::string& out) = 0;
+    virtual std::shared_ptr<const void> parseBinary(const char* data, size_t len) = 0;
+
+private:
+    static size_t AllocSlot();
 
 protected:
     std::string m_name;                                                         // 配置参数的名称
     std::string m_description;                                                  // 配置参数的描述
+    uint64_t m_hash;                                                            // 配置参数名称的哈希
+    size_t m_slot;                                                              // 在版本快照里的下标(每个配置项一个)
+
+private:
+    uint64_t m_commitSeq = 0;                                                   // 提交过几次修改(提交锁保护)
+    Mutex m_notifyMutex;                                                        // 保护下面这一组
+    uint64_t m_notifiedSeq = 0;                                                 // 已经通知到第几次修改
+    bool m_notifying = false;                                                   // 有线程正在调用回调
+    std::map<uint64_t, std::pair<std::shared_ptr<const void>, std::shared_ptr<const void> > > m_pendingChanges;  // 排队等通知的修改
 };
 
+/// 一次提交: 新的版本号和这次变了的配置项
+struct ConfigCommit {
+    uint64_t version = 0;
+    std::vector<ConfigVarBase*> vars;
+};
+
+namespace detail {
+
+/// 某个版本的全部配置值, 按 slot 分块存: 块 slot / CHUNK_SIZE 的第 slot % CHUNK_SIZE 个。
+/// 空(或者超出范围)表示从没改过, 还是默认值。块是不可变的, 各版本共用没改过的块:
+/// 一次提交只复制块指针的数组(配置项个数 / CHUNK_SIZE 个)和改到的块, 不复制整张表
+struct ConfigState {
+    static const size_t CHUNK_SIZE = 64;
+    struct Chunk {
+        std::shared_ptr<const void> values[CHUNK_SIZE];
+    };
+
+    uint64_t version = 0;
+    std::vector<std::shared_ptr<const Chunk> > chunks;
+
+    const std::shared_ptr<const void>* find(size_t slot) const
+    {
+        size_t idx = slot / CHUNK_SIZE;
+        if(idx >= chunks.size() || !chunks[idx]) {
+            return nullptr;
+        }
+        const std::shared_ptr<const void>& v = chunks[idx]->values[slot % CHUNK_SIZE];
+        return v ? &v : nullptr;
+    }
+};
+
+typedef std::pair<ConfigVarBase*, std::shared_ptr<const void> > ConfigChange;
+
+std::shared_ptr<const ConfigState> LoadConfigState();                          // 最新版本
+/// 在全局的提交锁里把 changes 和当前值比较, 变了的一起换上去, 发布成一个新版本, 返回版本号(都没变时返回当前版本号);
+/// 发布之后在锁外调用变了的各配置项的回调(新旧值就是锁里换下来的那两个, 同一项按提交顺序), 最后调用一次提交回调
+uint64_t PublishConfig(const std::vector<ConfigChange>& changes);
+
+}
+
 
 template<class F, class T>                  // F from_type, T to_type(基础类型) 把F 转成T
 class LexicalCast{
@@ -66,50 +153,424 @@ public:
         return boost::lexical_cast<T>(v);   // 基础类型的转换度可以
     }
 };
-/// ******************** 偏特化 ********************
+
+/* ******************** YAML节点 <-> T ********************
+ * 配置从文件加载时手里已经是解析好的 YAML::Node, 直接按节点转换: 容器逐个元素递归转换, 一遍完成,
+ * 不用先 dump 成字符串再 YAML::Load 回来(元素多的时候这个来回占了加载的大部分时间)。
+ *      数值/bool  : 标量文本 -> boost::lexical_cast(和字符串的转换规则一致; bool 另外接受 true/false/yes/no)
+ *      std::string: 标量原样
+ *      其他类型    : 退回字符串的 LexicalCast(自定义类型只写了 string <-> T 的转换也能用)
+ * 字符串的 LexicalCast<std::string, 容器> 也是先 YAML::Load 一次再走这里。
+ */
+namespace detail {
+struct NodeCastScalar {};                   // 数值, bool
+struct NodeCastString {};                   // std::string
+struct NodeCastText {};                     // 其他: 经过字符串的 LexicalCast
+
+template<class T>
+struct NodeCastTag {
+    typedef typename std::conditional<std::is_arithmetic<T>::value, NodeCastScalar,
+            typename std::conditional<std::is_same<T, std::string>::value, NodeCastString, NodeCastText>::type>::type type;
+};
+
+template<class T>
+T FromNode(const YAML::Node& node, NodeCastScalar)          { return boost::lexical_cast<T>(node.Scalar()); }
+template<>
+inline bool FromNode<bool>(const YAML::Node& node, NodeCastScalar)
+{
+    bool v = false;
+    if(YAML::convert<bool>::decode(node, v)) {
+        return v;
+    }
+    return boost::lexical_cast<bool>(node.Scalar());                    // "1" / "0"
+}
+template<class T>
+T FromNode(const YAML::Node& node, NodeCastString)          { return node.Scalar(); }
+template<class T>
+T FromNode(const YAML::Node& node, NodeCastText)
+{
+    if(node.IsScalar()) {
+        return LexicalCast<std::string, T>()(node.Scalar());
+    }
+    return LexicalCast<std::string, T>()(YAML::Dump(node));
+}
+
+template<class T>
+YAML::Node ToNode(const T& v, NodeCastScalar)               { return YAML::Node(v); }
+template<class T>
+YAML::Node ToNode(const T& v, NodeCastString)               { return YAML::Node(v); }
+template<class T>
+YAML::Node ToNode(const T& v, NodeCastText)                 { return YAML::Load(LexicalCast<T, std::string>()(v)); }
+}
+
+template<class T>
+class LexicalCast<YAML::Node, T> {
+public:
+    T operator()(const YAML::Node& node) {
+        return detail::FromNode<T>(node, typename detail::NodeCastTag<T>::type());
+    }
+};
+
 template<class T>
-class LexicalCast<std::string, std::vector<T> >{        // str to vector 这里只考虑一维vector  输入int_vector: [[10, 20, 30], [11, 22, 33]]是不可以的
+class LexicalCast<T, YAML::Node> {
 public:
-    std::vector<T> operator()(const std::string& v){    // v = "vector1: [11, 22, 33]\nvector2: [101, 202, 303]"
-        std::cout << " LexicalCast before YAML::Load v : "  << typeid(v).name() << "; "   << v << std::endl;
-        YAML::Node node = YAML::Load(v);                // YAML::Load(v) 将字符串转换为 YAML对应的YAMLType (vector对应的就是Sequence)
-        std::cout << " LexicalCast after YAML::Load node : "<< node.Type() << "; " << node << std::endl;  //YAML::Sequence
-        typename std::vector<T> vec;                                            // 定义的返回类，这个时候用typename
+    YAML::Node operator()(const T& v) {
+        return detail::ToNode<T>(v, typename detail::NodeCastTag<T>::type());
+    }
+};
+
+/* ******************** 偏特化: 容器 ********************
+ * vector/list/set/unordered_set 对应 YAML 的序列, map/unordered_map 对应 YAML 的 map(键也按 LexicalCast 转换)。
+ * 元素递归调用 LexicalCast<YAML::Node, T>, 所以可以任意嵌套: std::map<std::string, std::vector<int> > 之类。
+ * 转换出来的元素直接移动进容器, vector 和 unordered_* 先按元素个数 reserve; 生成 YAML map 用 force_insert(不查重, O(1))。
+ * 字符串 <-> 容器: YAML::Load 一次后走节点的转换(TextToNode / NodeToText)。
+ */
+namespace detail {
+template<class T>
+class TextToNode {                          // string -> T
+public:
+    T operator()(const std::string& v)          { return LexicalCast<YAML::Node, T>()(YAML::Load(v)); }
+};
+
+template<class T>
+class NodeToText {                          // T -> string
+public:
+    std::string operator()(const T& v) {
         std::stringstream ss;
-        std::cout << " LexicalCast after YAML::Load node.size() : " << node.size() << std::endl;
-        for (size_t i = 0; i < node.size(); i++)
-        {
-            ss.str("");
-            ss << node[i];
-            std::cout << " LexicalCast after YAML::Load ss : " << ss.str() << std::endl;
-            vec.push_back(LexicalCast<std::string, T>()(ss.str()));
+        ss << LexicalCast<T, YAML::Node>()(v);
+        return ss.str();
+    }
+};
+
+template<class C>
+YAML::Node SequenceToNode(const C& v)
+{
+    YAML::Node node(YAML::NodeType::Sequence);
+    for(auto& i : v) {
+        node.push_back(LexicalCast<typename C::value_type, YAML::Node>()(i));
+    }
+    return node;
+}
+
+template<class C>
+YAML::Node MapToNode(const C& v)
+{
+    YAML::Node node(YAML::NodeType::Map);
+    for(auto& i : v) {
+        node.force_insert(LexicalCast<typename C::key_type, YAML::Node>()(i.first),
+                          LexicalCast<typename C::mapped_type, YAML::Node>()(i.second));
+    }
+    return node;
+}
+
+template<class C>
+void NodeToMap(const YAML::Node& node, C& v)
+{
+    for(auto it = node.begin(); it != node.end(); ++it) {
+        v.emplace(LexicalCast<YAML::Node, typename C::key_type>()(it->first),
+                  LexicalCast<YAML::Node, typename C::mapped_type>()(it->second));
+    }
+}
+}
+
+/// std::vector
+template<class T>
+class LexicalCast<YAML::Node, std::vector<T> > {
+public:
+    std::vector<T> operator()(const YAML::Node& node) {
+        std::vector<T> vec;
+        vec.reserve(node.size());
+        for(auto it = node.begin(); it != node.end(); ++it) {
+            vec.push_back(LexicalCast<YAML::Node, T>()(*it));
         }
         return vec;
     }
 };
+template<class T>
+class LexicalCast<std::vector<T>, YAML::Node> {
+public:
+    YAML::Node operator()(const std::vector<T>& v)  { return detail::SequenceToNode(v); }
+};
+template<class T>
+class LexicalCast<std::string, std::vector<T> > : public detail::TextToNode<std::vector<T> > {};   // "[11, 22, 33]"
+template<class T>
+class LexicalCast<std::vector<T>, std::string> : public detail::NodeToText<std::vector<T> > {};
 
+/// std::list
 template<class T>
-class LexicalCast<std::vector<T>, std::string>{         // vector to str 这里只考虑一维vector
+class LexicalCast<YAML::Node, std::list<T> > {
 public:
-    std::string operator()(const std::vector<T>& v){
-//        std::cout << " LexicalCast before operator v : "  << typeid(v).name() << "; "   << v << std::endl;
-//        std::string ret = YAML::Dump(v);
-//        MYLOG_ERROR(SYLAR_LOG_ROOT()) << " LexicalCast(vector to str) : " << ret;
-
-        YAML::Node node;
-//        std::cout << " LexicalCast push back v : "  << v << std::endl;
-        for (auto& i : v)
-        {
-            node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
-            std::cout << " LexicalCast push back node : "  << node << std::endl;
+    std::list<T> operator()(const YAML::Node& node) {
+        std::list<T> v;
+        for(auto it = node.begin(); it != node.end(); ++it) {
+            v.push_back(LexicalCast<YAML::Node, T>()(*it));
         }
-        std::stringstream ss;
-        ss << node;
-        MYLOG_ERROR(SYLAR_LOG_ROOT()) << " LexicalCast(vector to str) : " << ss.str();
-        return ss.str();
+        return v;
+    }
+};
+template<class T>
+class LexicalCast<std::list<T>, YAML::Node> {
+public:
+    YAML::Node operator()(const std::list<T>& v)    { return detail::SequenceToNode(v); }
+};
+template<class T>
+class LexicalCast<std::string, std::list<T> > : public detail::TextToNode<std::list<T> > {};
+template<class T>
+class LexicalCast<std::list<T>, std::string> : public detail::NodeToText<std::list<T> > {};
+
+/// std::set
+template<class T>
+class LexicalCast<YAML::Node, std::set<T> > {
+public:
+    std::set<T> operator()(const YAML::Node& node) {
+        std::set<T> v;
+        for(auto it = node.begin(); it != node.end(); ++it) {
+            v.insert(v.end(), LexicalCast<YAML::Node, T>()(*it));   // 已经有序时 hint 在末尾是 O(1)
+        }
+        return v;
+    }
+};
+template<class T>
+class LexicalCast<std::set<T>, YAML::Node> {
+public:
+    YAML::Node operator()(const std::set<T>& v)     { return detail::SequenceToNode(v); }
+};
+template<class T>
+class LexicalCast<std::string, std::set<T> > : public detail::TextToNode<std::set<T> > {};
+template<class T>
+class LexicalCast<std::set<T>, std::string> : public detail::NodeToText<std::set<T> > {};
+
+/// std::unordered_set
+template<class T>
+class LexicalCast<YAML::Node, std::unordered_set<T> > {
+public:
+    std::unordered_set<T> operator()(const YAML::Node& node) {
+        std::unordered_set<T> v;
+        v.reserve(node.size());
+        for(auto it = node.begin(); it != node.end(); ++it) {
+            v.insert(LexicalCast<YAML::Node, T>()(*it));
+        }
+        return v;
     }
 };
+template<class T>
+class LexicalCast<std::unordered_set<T>, YAML::Node> {
+public:
+    YAML::Node operator()(const std::unordered_set<T>& v)   { return detail::SequenceToNode(v); }
+};
+template<class T>
+class LexicalCast<std::string, std::unordered_set<T> > : public detail::TextToNode<std::unordered_set<T> > {};
+template<class T>
+class LexicalCast<std::unordered_set<T>, std::string> : public detail::NodeToText<std::unordered_set<T> > {};
 
+/// std::map
+template<class K, class T>
+class LexicalCast<YAML::Node, std::map<K, T> > {
+public:
+    std::map<K, T> operator()(const YAML::Node& node) {
+        std::map<K, T> v;
+        detail::NodeToMap(node, v);
+        return v;
+    }
+};
+template<class K, class T>
+class LexicalCast<std::map<K, T>, YAML::Node> {
+public:
+    YAML::Node operator()(const std::map<K, T>& v)  { return detail::MapToNode(v); }
+};
+template<class K, class T>
+class LexicalCast<std::string, std::map<K, T> > : public detail::TextToNode<std::map<K, T> > {};
+template<class K, class T>
+class LexicalCast<std::map<K, T>, std::string> : public detail::NodeToText<std::map<K, T> > {};
+
+/// std::unordered_map
+template<class K, class T>
+class LexicalCast<YAML::Node, std::unordered_map<K, T> > {
+public:
+    std::unordered_map<K, T> operator()(const YAML::Node& node) {
+        std::unordered_map<K, T> v;
+        v.reserve(node.size());
+        detail::NodeToMap(node, v);
+        return v;
+    }
+};
+template<class K, class T>
+class LexicalCast<std::unordered_map<K, T>, YAML::Node> {
+public:
+    YAML::Node operator()(const std::unordered_map<K, T>& v)    { return detail::MapToNode(v); }
+};
+template<class K, class T>
+class LexicalCast<std::string, std::unordered_map<K, T> > : public detail::TextToNode<std::unordered_map<K, T> > {};
+template<class K, class T>
+class LexicalCast<std::unordered_map<K, T>, std::string> : public detail::NodeToText<std::unordered_map<K, T> > {};
+
+/* ******************** 自定义结构体的转换 ********************
+ * 用 X-macro 列出字段, 生成结构体和 YAML map 之间的 LexicalCast(节点和字符串两个方向), 字段类型可以是上面支持的任何类型。
+ * 必须在全局命名空间使用; 结构体要能默认构造, 作为 ConfigVar 的值还要有 operator==。YAML 里没写的字段保持默认值。
+ *      struct Person { std::string name; int age = 0; bool operator==(const Person& o) const {...} };
+ *      #define PERSON_FIELDS(X) X(name) X(age)
+ *      SYLAR_CONFIG_STRUCT(Person, PERSON_FIELDS)
+ */
+#define SYLAR_CONFIG_FIELD_FROM_NODE(f) \
+    if(node[#f].IsDefined()) { \
+        v.f = sylar::LexicalCast<YAML::Node, decltype(v.f)>()(node[#f]); \
+    }
+#define SYLAR_CONFIG_FIELD_TO_NODE(f) \
+    node.force_insert(#f, sylar::LexicalCast<decltype(v.f), YAML::Node>()(v.f));
+
+#define SYLAR_CONFIG_STRUCT(Type, FIELDS) \
+    namespace sylar { \
+    template<> \
+    class LexicalCast<YAML::Node, Type> { \
+    public: \
+        Type operator()(const YAML::Node& node) { \
+            Type v; \
+            FIELDS(SYLAR_CONFIG_FIELD_FROM_NODE) \
+            return v; \
+        } \
+    }; \
+    template<> \
+    class LexicalCast<Type, YAML::Node> { \
+    public: \
+        YAML::Node operator()(const Type& v) { \
+            YAML::Node node(YAML::NodeType::Map); \
+            FIELDS(SYLAR_CONFIG_FIELD_TO_NODE) \
+            return node; \
+        } \
+    }; \
+    template<> \
+    class LexicalCast<std::string, Type> : public detail::TextToNode<Type> {}; \
+    template<> \
+    class LexicalCast<Type, std::string> : public detail::NodeToText<Type> {}; \
+    }
+
+
+/* ******************** 二进制序列化(配置缓存用) ********************
+ * 缓存文件里值的格式: 数值按内存里的样子原样拷贝(缓存只在本机用), std::string 是 u32 长度 + 字节,
+ * 容器是 u32 个数 + 逐个元素, map 每个元素是 键, 值。
+ * 只有 数值/std::string 和它们(可以嵌套)的标准容器 走这里(IsBinary<T>), 其他类型(自定义结构体等)缓存里存 ToStr 的文本, 读回来时 FromStr。
+ */
+namespace detail {
+
+struct BinaryInput {
+    BinaryInput(const char* p, size_t len) :ptr(p), end(p + len) {}
+    bool read(void* out, size_t len) {
+        if((size_t)(end - ptr) < len) return false;
+        memcpy(out, ptr, len);
+        ptr += len;
+        return true;
+    }
+    size_t remain() const           { return end - ptr; }
+
+    const char* ptr;
+    const char* end;
+};
+
+template<class T, class Enable = void>
+struct IsBinary : std::false_type {};
+template<class T>
+struct IsBinary<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> : std::true_type {};
+template<>
+struct IsBinary<std::string> : std::true_type {};
+template<class T>
+struct IsBinary<std::vector<T> > : IsBinary<T> {};
+template<class T>
+struct IsBinary<std::list<T> > : IsBinary<T> {};
+template<class T>
+struct IsBinary<std::set<T> > : IsBinary<T> {};
+template<class T>
+struct IsBinary<std::unordered_set<T> > : IsBinary<T> {};
+template<class K, class T>
+struct IsBinary<std::map<K, T> > : std::integral_constant<bool, IsBinary<K>::value && IsBinary<T>::value> {};
+template<class K, class T>
+struct IsBinary<std::unordered_map<K, T> > : std::integral_constant<bool, IsBinary<K>::value && IsBinary<T>::value> {};
+
+template<class T>
+class BinaryCast {                          // 数值
+public:
+    static void Write(std::string& out, const T& v)     { out.append((const char*)&v, sizeof(v)); }
+    static bool Read(BinaryInput& in, T& v)             { return in.read(&v, sizeof(v)); }
+};
+
+template<>
+class BinaryCast<std::string> {
+public:
+    static void Write(std::string& out, const std::string& v) {
+        uint32_t len = v.size();
+        out.append((const char*)&len, sizeof(len));
+        out.append(v);
+    }
+    static bool Read(BinaryInput& in, std::string& v) {
+        uint32_t len = 0;
+        if(!in.read(&len, sizeof(len)) || in.remain() < len) return false;
+        v.assign(in.ptr, len);
+        in.ptr += len;
+        return true;
+    }
+};
+
+/// 顺序容器和 set: 个数 + 元素
+template<class C>
+class BinarySequence {
+public:
+    static void Write(std::string& out, const C& v) {
+        uint32_t count = v.size();
+        out.append((const char*)&count, sizeof(count));
+        for(const auto& i : v) {
+            BinaryCast<typename C::value_type>::Write(out, i);
+        }
+    }
+    static bool Read(BinaryInput& in, C& v) {
+        uint32_t count = 0;
+        if(!in.read(&count, sizeof(count)) || count > in.remain()) return false;   // 每个元素至少一个字节, 防止坏文件里的个数太大
+        for(uint32_t i = 0; i < count; ++i) {
+            typename C::value_type e;
+            if(!BinaryCast<typename C::value_type>::Read(in, e)) return false;
+            v.insert(v.end(), std::move(e));
+        }
+        return true;
+    }
+};
+
+/// map: 个数 + (键, 值)
+template<class C>
+class BinaryMap {
+public:
+    static void Write(std::string& out, const C& v) {
+        uint32_t count = v.size();
+        out.append((const char*)&count, sizeof(count));
+        for(const auto& i : v) {
+            BinaryCast<typename C::key_type>::Write(out, i.first);
+            BinaryCast<typename C::mapped_type>::Write(out, i.second);
+        }
+    }
+    static bool Read(BinaryInput& in, C& v) {
+        uint32_t count = 0;
+        if(!in.read(&count, sizeof(count)) || count > in.remain()) return false;
+        for(uint32_t i = 0; i < count; ++i) {
+            typename C::key_type k;
+            typename C::mapped_type m;
+            if(!BinaryCast<typename C::key_type>::Read(in, k) || !BinaryCast<typename C::mapped_type>::Read(in, m)) return false;
+            v.insert(v.end(), std::make_pair(std::move(k), std::move(m)));
+        }
+        return true;
+    }
+};
+
+template<class T>
+class BinaryCast<std::vector<T> > : public BinarySequence<std::vector<T> > {};
+template<class T>
+class BinaryCast<std::list<T> > : public BinarySequence<std::list<T> > {};
+template<class T>
+class BinaryCast<std::set<T> > : public BinarySequence<std::set<T> > {};
+template<class T>
+class BinaryCast<std::unordered_set<T> > : public BinarySequence<std::unordered_set<T> > {};
+template<class K, class T>
+class BinaryCast<std::map<K, T> > : public BinaryMap<std::map<K, T> > {};
+template<class K, class T>
+class BinaryCast<std::unordered_map<K, T> > : public BinaryMap<std::unordered_map<K, T> > {};
+
+}
 
 
 /* ******************** 配置变量类(继承 配置变量的基类) ********************
@@ -126,9 +587,18 @@ public:
  *      功能：将字符串转换为配置项的值，并更新 m_value
  *  setValue(const T& value):
  *      功能：更新配置项的值，并触发所有注册的回调函数。
- *      实现：如果新值与旧值相同，直接返回。
- *           否则，遍历 m_callbacks，依次调用回调函数，传入旧值和新值。
- *           最后更新 m_value。
+ *      实现：就是只有一项的事务提交(detail::PublishConfig): 在全局的提交锁里和当前值比较, 相同直接返回;
+ *           不同就换上去发布成新版本, 然后在锁外遍历 m_callbacks, 依次调用回调函数, 传入旧值和新值。
+ *      回调一律在新值发布之后调用(单独 setValue 和事务一样), 回调里 getValue() 读到的已经是新值;
+ *      传给回调的旧值/新值是提交锁里真正换下来/换上去的, 和别的线程同时改同一项时也不会出现没发生过的组合。
+ *      同一项的回调按提交的顺序调用, 不会交错: 别的线程正在通知这一项时, 这次修改排队交给那个线程调用
+ *      (回调里再 setValue 同一项也是排队, 当前回调返回后再调用), 这时 setValue 可能在回调执行之前就返回。
+ *  值的快照: 值保存成不可变的 std::shared_ptr<const T>, 读的一方原子地取出当前快照(只加一次引用计数, 不拷贝容器),
+ *      写的一方构造好新值整体换上去, 读到的快照在用完之前一直有效, 不会读到改了一半的值。
+ *      热路径上用 getSnapshot(), getValue() 为了兼容还是返回拷贝。
+ *      不用 std::atomic_load(shared_ptr): libstdc++ 里它是用全局的 16 把互斥锁实现的, 读多的时候所有配置项抢这几把锁。
+ *      这里原子变量里放的是指向 shared_ptr 的裸指针, 读的一方在 EpochGuard 里取出指针再拷贝 shared_ptr(一次原子加),
+ *      换下来的旧指针交给 Epoch::Retire, 没有线程在读了才释放。
 
 这个模板声明是 C++ 中非常典型的**模板参数默认值**和**策略模式**的结合。它的目的是为 `ConfigVar` 类提供灵活的类型转换机制。以下是对这段代码的详细解释：
 
@@ -148,22 +618,25 @@ template<class T, class FromStr = LexicalCast<std::string, T>, class ToStr = Lex
 class ConfigVar : public ConfigVarBase {
 public:
     typedef std::shared_ptr<ConfigVar> ptr;
+    typedef std::shared_ptr<const T> snapshot;
+    typedef RWMutex RWMutexType;
     typedef std::function<void (const T& old_value, const T& new_value)> on_change_callback;
 
     ConfigVar(const std::string& name, const T& default_value, const std::string& description)
         :ConfigVarBase(name, description)
-        ,m_value(default_value)
+        ,m_default(std::make_shared<const T>(default_value))
+        ,m_value(new snapshot(m_default))
     {
     }
-    // ~ConfigVar() {}  // 不用
+    ~ConfigVar()                                            { delete m_value.load(); }
 
     std::string toString() override     // 原本想把此函数提出去放在公共函数中，但是看到 catch中的输出信息， 它是专有的
     {
         try{
             // return boost::lexical_cast<std::string>(m_value);    // 此方法只对简单Scalar类型有用
-            return ToStr()(m_value);
+            return ToStr()(*getSnapshot());
         } catch(const std::exception& e){
-            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigVar::toString exception" << e.what() << " convert: " << typeid(m_value).name() << " to string";
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigVar::toString exception" << e.what() << " convert: " << typeid(T).name() << " to string";
             // std::cerr << e.what() << '\n';
         }
         return "";
@@ -174,37 +647,199 @@ public:
         try{
             // m_value = boost::lexical_cast<T>(value);                             // 此方法只对简单Scalar类型有用
             setValue(FromStr()(value));     // m_value = FromStr()(value);          // 仿函数 实现
+            return true;
         }
         catch(const std::exception& e)
         {
-            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigVar::fromString exception " << e.what() << " convert: string to " << typeid(m_value).name();
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigVar::fromString exception " << e.what() << " convert: string to " << typeid(T).name();
             // std::cerr << e.what() << '\n';
         }
         return false;
     }
 
-    const T getValue() const                                { return m_value; }
-    void setValue(const T& value) {
-        if(value == m_value)
-            return;
+    /// 用默认的 FromStr/ToStr 时直接按节点转换; 指定了自己的转换类的, 经过字符串调用它们
+    YAML::Node toNode() override
+    {
+        try{
+            return toNode(*getSnapshot(), UseNodeCast());
+        } catch(const std::exception& e){
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigVar::toNode exception " << e.what() << " convert: " << typeid(T).name() << " to node";
+        }
+        return YAML::Node();
+    }
+
+    bool fromNode(const YAML::Node& node) override
+    {
+        std::shared_ptr<const void> value = parseNode(node);
+        if(!value) {
+            return false;
+        }
+        setValue(*std::static_pointer_cast<const T>(value));
+        return true;
+    }
+
+    std::string getTypeName() const override                { return TypeToName<T>(); }
+
+    std::shared_ptr<const void> parseNode(const YAML::Node& node) override
+    {
+        try{
+            return std::make_shared<const T>(fromNode(node, UseNodeCast()));
+        } catch(const std::exception& e){
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigVar::fromNode exception " << e.what() << " convert: node to " << typeid(T).name();
+        }
+        return nullptr;
+    }
+
+    bool exchangeValue(std::shared_ptr<const void>& value) override
+    {
+        snapshot new_value = std::static_pointer_cast<const T>(value);
+        const snapshot* old_value = m_value.load(std::memory_order_relaxed);     // 只在提交锁里换, 这里不会被释放
+        if(*new_value == **old_value)
+            return false;
+        m_value.store(new snapshot(new_value), std::memory_order_release);
+        value = *old_value;
+        Epoch::Retire(old_value);
+        return true;
+    }
+
+    void notifyListeners(const void* old_value, const void* new_value) override
+    {
+        RWMutexType::ReadLock lock(m_cbMutex);
         for(auto& i : m_callbacks) {
-            i.second(m_value, value);
+            i.second(*static_cast<const T*>(old_value), *static_cast<const T*>(new_value));
+        }
+    }
+
+    void toBinary(std::string& out) override                { toBinary(out, *getSnapshot(), UseBinary()); }
+
+    std::shared_ptr<const void> parseBinary(const char* data, size_t len) override
+    {
+        try{
+            return parseBinary(data, len, UseBinary());
+        } catch(const std::exception& e){
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "ConfigVar::parseBinary exception " << e.what() << " convert: binary to " << typeid(T).name();
         }
-        m_value = value;
+        return nullptr;
+    }
+
+    snapshot getDefault() const                             { return m_default; }                   // 默认值
+    snapshot getSnapshot() const                            { EpochGuard guard; return *m_value.load(std::memory_order_acquire); }  // 当前值的只读快照(无锁)
+    const T getValue() const                                { return *getSnapshot(); }              // 拷贝一份(兼容原来的接口)
+    void setValue(const T& value)                           { setValue(T(value)); }
+    void setValue(T&& value) {
+        std::vector<detail::ConfigChange> changes(1, detail::ConfigChange(this, std::make_shared<const T>(std::move(value))));
+        detail::PublishConfig(changes);                     // 单独一项也是一次提交: 比较和替换都在提交锁里, 版本号加一, 发布之后调回调
     }
-    void addListener(uint64_t key, on_change_callback cb)   { m_callbacks[key] = cb; }
-    void deleteListener(uint64_t key)                       { m_callbacks.erase(key); }
-    void clearListener()                                    { m_callbacks.clear(); }
+    void addListener(uint64_t key, on_change_callback cb)   { RWMutexType::WriteLock lock(m_cbMutex); m_callbacks[key] = cb; }
+    void deleteListener(uint64_t key)                       { RWMutexType::WriteLock lock(m_cbMutex); m_callbacks.erase(key); }
+    void clearListener()                                    { RWMutexType::WriteLock lock(m_cbMutex); m_callbacks.clear(); }
     on_change_callback getListener(uint64_t key) {
+        RWMutexType::ReadLock lock(m_cbMutex);
         auto it = m_callbacks.find(key);
         return it == m_callbacks.end() ? nullptr : it->second;
     }
 
 private:
-    T m_value;                                              // 存储配置项的当前值，类型为 T
+    typedef std::integral_constant<bool, std::is_same<FromStr, LexicalCast<std::string, T> >::value
+                                         && std::is_same<ToStr, LexicalCast<T, std::string> >::value> UseNodeCast;
+    YAML::Node toNode(const T& v, std::true_type)               { return LexicalCast<T, YAML::Node>()(v); }
+    YAML::Node toNode(const T& v, std::false_type)              { return YAML::Load(ToStr()(v)); }
+    T fromNode(const YAML::Node& node, std::true_type)          { return LexicalCast<YAML::Node, T>()(node); }
+    T fromNode(const YAML::Node& node, std::false_type)         { return FromStr()(node.IsScalar() ? node.Scalar() : YAML::Dump(node)); }
+
+    typedef std::integral_constant<bool, UseNodeCast::value && detail::IsBinary<T>::value> UseBinary;
+    void toBinary(std::string& out, const T& v, std::true_type)     { detail::BinaryCast<T>::Write(out, v); }
+    void toBinary(std::string& out, const T& v, std::false_type)    { out += ToStr()(v); }
+    std::shared_ptr<const void> parseBinary(const char* data, size_t len, std::true_type)
+    {
+        detail::BinaryInput in(data, len);
+        std::shared_ptr<T> v = std::make_shared<T>();
+        if(!detail::BinaryCast<T>::Read(in, *v) || in.remain() != 0) {
+            return nullptr;
+        }
+        return v;
+    }
+    std::shared_ptr<const void> parseBinary(const char* data, size_t len, std::false_type)
+    {
+        return std::make_shared<const T>(FromStr()(std::string(data, len)));
+    }
+
+private:
+    snapshot m_default;                                     // 默认值(版本快照里没有这一项时用它)
+    std::atomic<const snapshot*> m_value;                   // 存储配置项的当前值(不可变快照), 在提交锁里换, 旧的交给 Epoch::Retire
+    RWMutexType m_cbMutex;                                  // 保护 m_callbacks
     std::map<uint64_t, on_change_callback> m_callbacks;     // 存储配置项值变化时的回调函数，键为 uint64_t，值为 on_change_callback
 };
 
+/* ******************** 配置事务和版本快照 ********************
+ *  几个相关的配置(比如线程数和队列长度)要一起改时, 一个个 setValue 中间会有只改了一半的状态。
+ *  ConfigTransaction 先把要改的值暂存起来, commit 时在全局的提交锁里一起换上去, 发布成一个新的全局版本号:
+ *      sylar::ConfigTransaction tx;
+ *      tx.set(g_threads, 8).set(g_queue_size, 4096);
+ *      tx.commit();
+ *  每次提交(包括单独的 setValue, 文件加载也是一个文件一次提交)都有一个版本号, 对应一份不可变的 所有配置值 的表(只有改过的项, 其余是默认值),
+ *  ConfigSnapshot 原子地取出最新的一份(一次引用计数), 之后从它读到的都是同一个版本的值, 不会读到一次提交里改了一半的状态:
+ *      sylar::ConfigSnapshot snap;
+ *      int threads = *snap.get(g_threads);
+ *      int queue_size = *snap.get(g_queue_size);
+ *  事务的回调: 新值发布之后, 依次调用变了的各配置项的回调(和 setValue 一样, 回调里读到的已经是新值),
+ *  然后调用一次 Config::AddCommitListener 注册的提交回调, 参数是版本号和这次变了的配置项。
+ *  版本表分块共用(见 detail::ConfigState): 每次提交只复制块指针和改到的块, 单独 setValue 的开销和配置项总数关系不大。
+ */
+class ConfigTransaction {
+public:
+    template<class T, class FromStr, class ToStr>
+    ConfigTransaction& set(ConfigVar<T, FromStr, ToStr>* var, const typename std::common_type<T>::type& value)
+    {
+        stage(var, std::make_shared<const T>(value));
+        return *this;
+    }
+    template<class T, class FromStr, class ToStr>
+    ConfigTransaction& set(const std::shared_ptr<ConfigVar<T, FromStr, ToStr> >& var, const typename std::common_type<T>::type& value)
+    {
+        return set(var.get(), value);
+    }
+
+    void stage(ConfigVarBase* var, std::shared_ptr<const void> value);     // 暂存(同一项改多次的以最后一次为准)
+    uint64_t commit();                                                      // 提交, 返回版本号; 提交后事务清空, 可以继续用
+    void rollback()                     { m_changes.clear(); m_index.clear(); }  // 放弃暂存的修改
+    bool empty() const                  { return m_changes.empty(); }
+    size_t size() const                 { return m_changes.size(); }
+
+private:
+    std::vector<detail::ConfigChange> m_changes;                            // 按暂存的顺序提交, 回调也按这个顺序
+    std::unordered_map<ConfigVarBase*, size_t> m_index;                     // 配置项 -> m_changes 里的下标
+};
+
+/// 固定在某个版本的全部配置值
+class ConfigSnapshot {
+public:
+    ConfigSnapshot()
+        :m_state(detail::LoadConfigState())
+    {
+    }
+
+    uint64_t getVersion() const         { return m_state->version; }
+
+    template<class T, class FromStr, class ToStr>
+    std::shared_ptr<const T> get(const ConfigVar<T, FromStr, ToStr>* var) const
+    {
+        const std::shared_ptr<const void>* value = m_state->find(var->getSlot());
+        if(value) {
+            return std::static_pointer_cast<const T>(*value);
+        }
+        return var->getDefault();                                           // 到这个版本为止没改过
+    }
+    template<class T, class FromStr, class ToStr>
+    std::shared_ptr<const T> get(const std::shared_ptr<ConfigVar<T, FromStr, ToStr> >& var) const
+    {
+        return get(var.get());
+    }
+
+private:
+    std::shared_ptr<const detail::ConfigState> m_state;
+};
+
 
 
 /*  ******************** 配置管理类 ********************
@@ -213,32 +848,65 @@ private:
  *      2. 并支持从 YAML 文件加载配置。
  *  它的设计目标是提供一个统一的接口来操作配置项，并支持从外部数据源（如 YAML 文件）加载配置。就是这个类管理配置的读取解析，以及存放每一条配置
  */
+/* ******************** 配置注册表 ********************
+ *  按名称的哈希(ConfigNameHash)索引的 unordered_map, 配置项只注册不删除, 所以拿到的指针一直有效:
+ *      static sylar::ConfigVar<int>* g_port = sylar::Config::Handle("system.port", 8080, "port");
+ *      ... g_port->getValue()                  // 热路径上直接读, 不再按名字查找
+ *  Lookup(name, default_value, description): 注册。名字已经注册过时返回原来的配置项(不会新建一个把它冲掉),
+ *      类型不一致(比如一个编译单元注册成 int, 另一个当成 std::string)直接抛 std::invalid_argument。
+ *  Lookup<T>(name): 查找, 类型不一致时返回 nullptr 并打错误日志。
+ *  注册和查找由读写锁保护: 不同编译单元的静态初始化(以及之后的线程)可以同时注册。
+ *  两个不同的名字哈希冲突时注册也会抛异常(64位哈希, 实际碰不到, 碰到了就改名字)。
+ */
 class Config {
 public:
-    typedef std::map<std::string, ConfigVarBase::ptr> ConfigVarMap; // std::unordered_map
+    typedef std::unordered_map<uint64_t, ConfigVarBase::ptr> ConfigVarMap;  // 名称哈希 -> 配置项
+    typedef RWMutex RWMutexType;
 
     // 查找
     template<class T>
     static typename ConfigVar<T>::ptr Lookup(const std::string& name)
     {
-        auto it =  s_datas.find(name);
-        if(it == s_datas.end()) return nullptr;                             // 未找到
-        return std::dynamic_pointer_cast<ConfigVar<T>>(it->second);         // 找到转换成智能指针
+        ConfigVarBase::ptr var = LookupBase(name);
+        if(!var) return nullptr;                                            // 未找到
+        if(typeid(*var) != typeid(ConfigVar<T>)) {                          // 同一个名字注册的是别的类型
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Lookup name = " << name << " type mismatch: real_type = "
+                                          << var->getTypeName() << " lookup_type = " << TypeToName<T>();
+            return nullptr;
+        }
+        return std::static_pointer_cast<ConfigVar<T> >(var);                // 类型已经核对过, 不用 dynamic_pointer_cast
     }
 
     template<class T>
     static typename ConfigVar<T>::ptr Lookup(const std::string& name, const T& default_value, const std::string& description = "")
     {                                               // 诚实的讲，我觉得这个函数叫做 register()更好。 注册默认（default）配置
-        auto tmp = Lookup<T>(name);
-        if(tmp)  MYLOG_INFO(SYLAR_LOG_ROOT()) << "Lookup name = " << name << " exists";
-        if(name.find_first_not_of("abcdefghijklmnopqrstuvwxyz._012345678") != std::string::npos)
+        if(name.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") != std::string::npos)
         {                                                                   // 发现异常
             MYLOG_ERROR(SYLAR_LOG_ROOT()) <<"Lookup name invalid " << name;
             throw std::invalid_argument(name);
         }
-        typename ConfigVar<T>::ptr value(new ConfigVar<T>(name, default_value, description));
-        s_datas[name] = value;
-        return value;
+        bool created = false;
+        ConfigVarBase::ptr var = LookupBase(name);                          // 已经注册过(重复注册): 读锁查到就返回, 不拷贝默认值, 不占快照槽位
+        if(!var) {
+            var = Register(name, [&]() {                                    // 写锁下再查一次, 确实没有才构造
+                created = true;
+                return ConfigVarBase::ptr(new ConfigVar<T>(name, default_value, description));
+            });
+        }
+        if(typeid(*var) != typeid(ConfigVar<T>)) {
+            MYLOG_ERROR(SYLAR_LOG_ROOT()) << "Lookup name = " << name << " exists with type " << var->getTypeName()
+                                          << ", register type = " << TypeToName<T>();
+            throw std::invalid_argument("config type mismatch: " + name);
+        }
+        if(!created)  MYLOG_DEBUG(SYLAR_LOG_ROOT()) << "Lookup name = " << name << " exists";
+        return std::static_pointer_cast<ConfigVar<T> >(var);
+    }
+
+    /// 注册并返回裸指针句柄(配置项不会被删除, 进程内一直有效)
+    template<class T>
+    static ConfigVar<T>* Handle(const std::string& name, const T& default_value, const std::string& description = "")
+    {
+        return Lookup(name, default_value, description).get();
     }
 
     // YAML与日志的整合
@@ -248,11 +916,103 @@ public:
     //     return it == s_datas.end() ? nullptr : it->second;
     // }        // 一个方法 只被这个类使用，就写在这个类中
 
-    static void LoadFromYaml(const YAML::Node& root);               // (static方法)从YAML配置文件中加载配置，并将其应用到内存中的配置变量中
+    static void LoadFromYaml(const YAML::Node& root);               // (static方法)从YAML配置文件中加载配置，并将其应用到内存中的配置变量中(一次提交)
+    /// 带二进制缓存加载 YAML 文件: 缓存(默认 file + ".cache")里记着源文件内容的哈希和注册表的哈希(配置名 + 类型),
+    /// 都对得上时 mmap 缓存直接转换出配置值(不用解析 YAML, 也不用 LexicalCast); 对不上或者缓存坏了就解析 YAML,
+    /// 加载完把用到的配置项的值重新写进缓存。两种方式都是一次提交。from_cache 返回是不是从缓存加载的
+    static bool LoadFromFile(const std::string& file, const std::string& cache_file = "", bool* from_cache = nullptr);
+    /// 增量加载: applied 是这份文件上次应用过的 配置名 -> 节点文本, 只有文本变了(或者新出现)的配置项才 fromNode,
+    /// 没变的不转换也不触发回调; 返回应用了几项, applied 更新成这次的内容
+    static size_t LoadFromYaml(const YAML::Node& root, std::unordered_map<std::string, std::string>& applied);
     static ConfigVarBase::ptr LookupBase(const std::string& name);  // 查找配置参数,返回配置参数的基类(name 配置参数名称)
 
+    static uint64_t GetVersion();                                   // 当前的全局版本号
+    static void AddCommitListener(uint64_t key, std::function<void (const ConfigCommit&)> cb);  // 每次提交调用一次
+    static void DeleteCommitListener(uint64_t key);
+
+private:
+    /// 名字已存在时返回已有的配置项; 不存在时(持有写锁)调用 create 构造并插入注册表
+    static ConfigVarBase::ptr Register(const std::string& name, const std::function<ConfigVarBase::ptr ()>& create);
+    static void ApplyYaml(const YAML::Node& root, std::vector<ConfigVarBase::ptr>* vars);    // 加载, vars 返回文件里出现的配置项
+    static uint64_t GetRegistryHash();                              // 注册表的哈希(所有 配置名:类型 的哈希之和)
+
+    static uint64_t& RegistryHash()
+    {
+        static uint64_t s_hash = 0;
+        return s_hash;
+    }
+
+    /// 函数内静态变量: 别的编译单元的静态对象(比如 log.cc 里的 "logs" 配置)在静态初始化时就会 Lookup,
+    /// 用类的静态成员的话, 它可能还没构造, 注册的配置会丢(或者被后来的构造冲掉)
+    static ConfigVarMap& GetDatas()
+    {
+        static ConfigVarMap s_datas;
+        return s_datas;
+    }
+    static RWMutexType& GetMutex()
+    {
+        static RWMutexType s_mutex;
+        return s_mutex;
+    }
+};
+
+
+/* ******************** 配置文件监视 ********************
+ *  inotify 监视若干 YAML 文件或目录(目录下的 *.yml / *.yaml), 文件改了以后只重新解析这一个文件,
+ *  用 Config::LoadFromYaml(root, applied) 和这个文件上次应用的内容比较, 只 setValue 变了的配置项, 别的配置项的回调不会触发。
+ *      - 监视的是文件所在的目录(IN_CLOSE_WRITE | IN_MOVED_TO), 编辑器"写临时文件再 rename"的保存方式也能收到
+ *      - 防抖: 收到事件后等 debounce_ms 内没有新事件再加载(一直有事件的话最多等 10 倍 debounce_ms), 一次保存触发的多个事件只加载一次
+ *      - 加载在后台线程 "config_watch" 里做, 配置项的回调也在这个线程里执行(不持有监视器的锁, 回调里可以 addPath)
+ *      - 文件解析失败(比如写了一半)时打错误日志, 配置保持原样, 等下次修改
+ *      - 文件里删掉的配置项不会恢复成默认值(和 LoadFromYaml 一样)
+ *  用法:
+ *      sylar::ConfigWatcher::ptr watcher(new sylar::ConfigWatcher);
+ *      watcher->addPath("conf/");              // 先加载一遍, 之后改动自动生效
+ */
+class ConfigWatcher {
+public:
+    typedef std::shared_ptr<ConfigWatcher> ptr;
+    typedef Mutex MutexType;
+
+    ConfigWatcher(uint32_t debounce_ms = 100);
+    ~ConfigWatcher();
+
+    bool addPath(const std::string& path);                          // 监视一个文件或目录, 并马上加载一次
+    size_t reload(const std::string& file);                         // 重新加载一个文件, 返回变了的配置项个数
+    void stop();                                                    // 停止后台线程
+
+    uint64_t getReloadCount() const     { return m_reloadCount; }   // 加载过的文件次数
+    uint64_t getApplyCount() const      { return m_applyCount; }    // 应用过的配置项个数
+
+private:
+    ConfigWatcher(const ConfigWatcher&) = delete;
+    ConfigWatcher& operator=(const ConfigWatcher&) = delete;
+
+    void run();
+    void readEvents(std::set<std::string>& dirty);                  // 读 inotify 事件, 把要重新加载的文件放进 dirty
+
 private:
-    static ConfigVarMap s_datas;
+    struct Watch {
+        std::string dir;                                            // 监视的目录
+        bool all = false;                                           // 目录下所有的 *.yml / *.yaml
+        std::set<std::string> names;                                // 只监视这几个文件(all 为 false 时)
+    };
+
+    int m_inotifyFd = -1;
+    int m_wakeFd = -1;                                              // eventfd, stop 时唤醒后台线程
+    uint32_t m_debounceMs;
+    struct FileState {
+        std::unordered_map<std::string, std::string> applied;      // 上次应用的 配置名 -> 节点文本(加载期间由加载的线程拿走)
+        bool loading = false;                                       // 有线程正在加载(同一个文件同一时间只有一个线程加载)
+        bool again = false;                                         // 加载期间又要求加载: 加载完再读一遍
+    };
+
+    MutexType m_mutex;                                              // 保护 m_watches, m_files(只在查改状态时持有, 加载和回调在锁外)
+    std::map<int, Watch> m_watches;                                 // inotify watch 描述符 -> 目录
+    std::map<std::string, FileState> m_files;                       // 文件 -> 加载状态
+    std::atomic<uint64_t> m_reloadCount {0};
+    std::atomic<uint64_t> m_applyCount {0};
+    Thread::ptr m_thread;
 };
 
 
@@ -4,6 +4,8 @@
 #include "log.h"
 //#include "scheduler.h"
 #include <atomic>
+#include <unistd.h>
+#include <sys/mman.h>
 
 namespace sylar {
 
@@ -23,7 +25,30 @@ public:
     static void* Alloc(size_t size)             { return malloc(size); }
     static void Dealloc(void* vp, size_t size)  { return free(vp); }
 };
-using StackAllocator = MallocStackAllocator;
+
+/// mmap 分配协程栈, 栈底(低地址)多映射一页 PROT_NONE 的保护页: 栈溢出时立即 SIGSEGV, 而不是悄悄写坏旁边的堆内存
+class MmapStackAllocator
+{
+public:
+    static size_t GuardSize() {
+        static size_t s_page = sysconf(_SC_PAGESIZE);
+        return s_page;
+    }
+    static void* Alloc(size_t size) {
+        size_t guard = GuardSize();
+        void* base = mmap(nullptr, size + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED) {
+            return nullptr;
+        }
+        mprotect(base, guard, PROT_NONE);
+        return (char*)base + guard;
+    }
+    static void Dealloc(void* vp, size_t size) {
+        size_t guard = GuardSize();
+        munmap((char*)vp - guard, size + guard);
+    }
+};
+using StackAllocator = MmapStackAllocator;
 
 
 uint64_t Fiber::GetFiberId()    /// ??? 有 协程的就返回协程id. 没有的就是原来的线程，就返回0
@@ -32,6 +57,17 @@ uint64_t Fiber::GetFiberId()    /// ??? 有 协程的就返回协程id. 没有
     return 0;
 }
 
+bool Fiber::InStackGuard(const void* addr)
+{
+    Fiber* cur = t_fiber;
+    if(!cur || !cur->m_stack) {
+        return false;
+    }
+    const char* p = (const char*)addr;
+    const char* stack = (const char*)cur->m_stack;
+    return p < stack && p >= stack - StackAllocator::GuardSize();
+}
+
 Fiber::Fiber()                  /// 每个线程第一个协程的构造(也就是主协程的构造函数，是私有的)  ----- 主协程是没有栈，没有回调函数的
 {
     m_state = EXEC;             // 主协程m_id = 0; m_stacksize = 0; INIT state变为执行中EXEC
@@ -48,6 +84,7 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)   ///
     ++s_fiber_count;
     m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();   /// 这里设置函数栈大小，如果你传参数为0，则我用配置的栈大小。不为0，就以你给的为准
     m_stack = StackAllocator::Alloc(m_stacksize);                           // 为当前（新的）协程申请对应的上下文context栈空间
+    SYLAR_ASSERT2(m_stack, "alloc fiber stack");
     if(getcontext(&m_ctx)) { SYLAR_ASSERT2(false, "getcontext"); }          // 该函数会将当前线程的上下文保存到该结构体m_ctx中, 就是将线程中的上下文信息（处于正在运行的协程的上下文）保存到这个新协程的ucontext_t变量中(初始化它)
                                                                             // 就是用当前线程的上下文来给这个新协程赋值上下文信息，让后再去修改，使其符合自己协程的上下文信息
     m_ctx.uc_link = nullptr;                 // ??? uc_link 为啥不设置为 线程主协程？  这样本线程运行完了自动就回到主协程了，不用后续自己管理了 (我直接在带参数的构造函数内，把uc_link指向&t_threadFiber->m_ctx ? 设置为主协程，如果没有主协程，可以提前判断出来)
@@ -64,6 +64,7 @@ public:
     static void MainFunc();                             /// 协程执行函数   @post 执行完成返回到线程主协程
     static void CallerMainFunc();                       /// @brief 协程执行函数   @post 执行完成返回到线程调度协程
     static uint64_t GetFiberId();                       /// @brief 获取当前协程的id
+    static bool InStackGuard(const void* addr);         /// addr 是否落在当前协程栈的保护页里(栈溢出), 信号处理函数里调用
 
 private:
     uint64_t m_id = 0;                                  /// 协程id (m_fiber_id)
@@ -1,10 +1,24 @@
 #include "log.h"
+#include "config.h"
 #include <iostream>
 #include <map>
+#include <set>
 #include <functional>
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
+#include <sched.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <algorithm>
 
 namespace sylar {
 
@@ -52,7 +66,8 @@ class MessageFormatItem : public LogFormatter::FormatItem { // [继承类中类]
 public:
     MessageFormatItem(const std::string& fmt = "") {}
     void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override {
-        os << event->getContent();  // 直接返回event中的 信息对应的字符串 到 os 中: std::ostream& os; os << "Hello, ";  os << "World!"; 最终 os 中的内容是 "Hello, World!"。
+        const LogStream& ss = event->getSS();
+        os.write(ss.data(), ss.size());     // 直接把event中的日志内容写到 os 中(不再 getContent() 拷贝一份 string)
     }
 };
 
@@ -139,10 +154,237 @@ public:
     }
 };
 
+namespace {
+/// 时间渲染的线程缓存: localtime_r 要拿时区锁, 同一秒内的日志直接复用上一次 strftime 的结果
+struct DateTimeCache {
+    uint64_t id = 0;                // 哪个时间格式(0: 空)
+    time_t sec = -1;
+    size_t len = 0;
+    char buf[64];
+};
+static std::atomic<uint64_t> s_datetime_id(0);                 // 每个时间格式项一个编号, 不会复用(formatter析构后地址可能被复用)
+static thread_local DateTimeCache t_datetime_cache[4];         // 按编号取模, 几个formatter交替使用时也不会互相挤掉
+static thread_local DateTimeCache t_iso8601_cache;
+
+static const char* RenderDateTime(uint64_t id, const std::string& fmt, time_t sec, size_t& len)
+{
+    DateTimeCache& cache = t_datetime_cache[id & 3];
+    if(cache.id != id || cache.sec != sec) {
+        struct tm tm;
+        localtime_r(&sec, &tm);     // 将时间戳转换为本地时间，并将结果存放在tm中
+        cache.len = strftime(cache.buf, sizeof(cache.buf), fmt.c_str(), &tm);
+        cache.id = id;
+        cache.sec = sec;
+    }
+    len = cache.len;
+    return cache.buf;
+}
+
+// 定长补0的数字, 毫秒/微秒用
+static void AppendFixed(LogStream& out, uint32_t v, int width)
+{
+    char buf[8];
+    for(int i = width - 1; i >= 0; --i) {
+        buf[i] = '0' + v % 10;
+        v /= 10;
+    }
+    out.append(buf, width);
+}
+
+static void AppendISO8601(LogStream& out, time_t sec, uint32_t usec)
+{
+    DateTimeCache& cache = t_iso8601_cache;
+    if(cache.sec != sec) {
+        struct tm tm;
+        gmtime_r(&sec, &tm);        // UTC 不需要时区
+        cache.len = strftime(cache.buf, sizeof(cache.buf), "%Y-%m-%dT%H:%M:%S.", &tm);
+        cache.sec = sec;
+    }
+    out.append(cache.buf, cache.len);
+    AppendFixed(out, usec / 1000, 3);
+    out.append("Z", 1);
+}
+
+/// JSON 字符串(带引号): " \ 和控制字符转义, 其他字节(包括 UTF-8)原样输出
+static void AppendJsonString(LogStream& out, const char* str, size_t len)
+{
+    static const char* s_hex = "0123456789abcdef";
+    out.append("\"", 1);
+    size_t begin = 0;
+    for(size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)str[i];
+        if(c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(str + begin, i - begin);             // 不需要转义的一段整块拷贝
+        begin = i + 1;
+        switch(c) {
+        case '"':   out.append("\\\"", 2);   break;
+        case '\\':  out.append("\\\\", 2);  break;
+        case '\n':  out.append("\\n", 2);   break;
+        case '\r':  out.append("\\r", 2);   break;
+        case '\t':  out.append("\\t", 2);   break;
+        case '\b':  out.append("\\b", 2);   break;
+        case '\f':  out.append("\\f", 2);   break;
+        default:
+            {
+                char buf[6] = {'\\', 'u', '0', '0', s_hex[c >> 4], s_hex[c & 0xf]};
+                out.append(buf, 6);
+            }
+            break;
+        }
+    }
+    out.append(str + begin, len - begin);
+    out.append("\"", 1);
+}
+
+/// logfmt 的值: 空串, 含空格/=/"/控制字符时加引号并转义, 否则原样
+static void AppendLogfmtString(LogStream& out, const char* str, size_t len)
+{
+    bool quote = len == 0;
+    for(size_t i = 0; i < len && !quote; ++i) {
+        unsigned char c = (unsigned char)str[i];
+        quote = c <= ' ' || c == '=' || c == '"' || c == '\\' || c == 0x7f;
+    }
+    if(quote) {
+        AppendJsonString(out, str, len);                // 转义规则一样
+    } else {
+        out.append(str, len);
+    }
+}
+
+static void AppendDouble(LogStream& out, double v, bool json)
+{
+    if(v != v || v - v != 0) {                          // NaN / Inf, JSON 里没有
+        if(json) {
+            out.append("null", 4);
+        } else {
+            out << v;
+        }
+        return;
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.16g", v);
+    out.append(buf, n > 0 ? (size_t)n : 0);
+}
+
+static void AppendFieldValue(LogStream& out, const LogStream& ss, const LogField& f, bool json)
+{
+    switch(f.type) {
+    case LogField::INT64:   out << (long long)f.v.i;                    break;
+    case LogField::UINT64:  out << (unsigned long long)f.v.u;           break;
+    case LogField::DOUBLE:  AppendDouble(out, f.v.d, json);             break;
+    case LogField::BOOL:    out.append(f.v.b ? "true" : "false", f.v.b ? 4 : 5); break;
+    case LogField::STRING:
+        if(json) {
+            AppendJsonString(out, ss.fieldStr(f), f.strLen);
+        } else {
+            AppendLogfmtString(out, ss.fieldStr(f), f.strLen);
+        }
+        break;
+    }
+}
+
+/// kv() 的字段, logfmt: 前面有内容时先补一个空格
+static void AppendLogfmtFields(LogStream& out, const LogStream& ss, bool leading_space)
+{
+    for(auto& f : ss.fields()) {
+        if(leading_space) {
+            out.append(" ", 1);
+        }
+        leading_space = true;
+        out.append(ss.fieldKey(f), f.keyLen);
+        out.append("=", 1);
+        AppendFieldValue(out, ss, f, false);
+    }
+}
+
+/// {"time":"...","level":"INFO","logger":"root","thread":1,"thread_name":"main","fiber":0,"file":"...","line":10,"msg":"...",字段...}
+/// 字段和内置的键同名时两个都输出, 由下游决定
+static void AppendJson(LogStream& out, const Logger& logger, LogLevel::Level level, const LogEvent& event)
+{
+    const LogStream& ss = event.getSS();
+    out.append("{\"time\":\"", 9);
+    AppendISO8601(out, event.getTime(), event.getUsec());
+    out.append("\",\"level\":\"", 11);
+    out << LogLevel::ToString(level);
+    out.append("\",\"logger\":", 11);
+    AppendJsonString(out, logger.getName().data(), logger.getName().size());
+    out.append(",\"thread\":", 10) << event.getThreadId();
+    out.append(",\"thread_name\":", 15);
+    AppendJsonString(out, event.getThreadName().data(), event.getThreadName().size());
+    out.append(",\"fiber\":", 9) << event.getFiberId();
+    out.append(",\"file\":", 8);
+    AppendJsonString(out, event.getFile(), strlen(event.getFile()));
+    out.append(",\"line\":", 8) << event.getLine();
+    out.append(",\"msg\":", 7);
+    AppendJsonString(out, ss.data(), ss.size());
+    for(auto& f : ss.fields()) {
+        out.append(",", 1);
+        AppendJsonString(out, ss.fieldKey(f), f.keyLen);
+        out.append(":", 1);
+        AppendFieldValue(out, ss, f, true);
+    }
+    out.append("}", 1);
+}
+
+/// time=... level=INFO logger=root thread=1 thread_name=main fiber=0 file=... line=10 msg="..." 字段...
+static void AppendLogfmt(LogStream& out, const Logger& logger, LogLevel::Level level, const LogEvent& event)
+{
+    const LogStream& ss = event.getSS();
+    out.append("time=", 5);
+    AppendISO8601(out, event.getTime(), event.getUsec());
+    out.append(" level=", 7) << LogLevel::ToString(level);
+    out.append(" logger=", 8);
+    AppendLogfmtString(out, logger.getName().data(), logger.getName().size());
+    out.append(" thread=", 8) << event.getThreadId();
+    out.append(" thread_name=", 13);
+    AppendLogfmtString(out, event.getThreadName().data(), event.getThreadName().size());
+    out.append(" fiber=", 7) << event.getFiberId();
+    out.append(" file=", 6);
+    AppendLogfmtString(out, event.getFile(), strlen(event.getFile()));
+    out.append(" line=", 6) << event.getLine();
+    out.append(" msg=", 5);
+    AppendLogfmtString(out, ss.data(), ss.size());
+    AppendLogfmtFields(out, ss, true);
+}
+}
+
+class JsonFormatItem : public LogFormatter::FormatItem {
+public:
+    JsonFormatItem(const std::string& fmt = "") {}
+    void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override {
+        LogStream::Scoped out;
+        AppendJson(*out, *logger, level, *event);
+        os.write(out->data(), out->size());
+    }
+};
+
+class LogfmtFormatItem : public LogFormatter::FormatItem {
+public:
+    LogfmtFormatItem(const std::string& fmt = "") {}
+    void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override {
+        LogStream::Scoped out;
+        AppendLogfmt(*out, *logger, level, *event);
+        os.write(out->data(), out->size());
+    }
+};
+
+class FieldsFormatItem : public LogFormatter::FormatItem {
+public:
+    FieldsFormatItem(const std::string& fmt = "") {}
+    void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override {
+        LogStream::Scoped out;
+        AppendLogfmtFields(*out, event->getSS(), false);
+        os.write(out->data(), out->size());
+    }
+};
+
 class DateTimeFormatItem : public LogFormatter::FormatItem { 
 public:
     DateTimeFormatItem(const std::string& format = "%Y:%m:%d %H:%M:%S") 
-        : m_format(format)
+        : m_format(format),
+          m_id(++s_datetime_id)
     {
         if(m_format.empty())
         {
@@ -151,16 +393,43 @@ public:
     }
     void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override 
     {
-        // os << event->getTime();
-        struct tm tm;
-        time_t time = event->getTime();     // 当前时间戳 引入time.h
-        localtime_r(&time, &tm);            // 将时间戳转换为本地时间，并将结果存放在tm中
-        char buf[64];
-        strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-        os << buf;
+        size_t len = 0;
+        const char* buf = RenderDateTime(m_id, m_format, event->getTime(), len);
+        os.write(buf, len);
     }
 private:
     std::string m_format;
+    uint64_t m_id;
+};
+
+class MillisecondFormatItem : public LogFormatter::FormatItem {
+public:
+    MillisecondFormatItem(const std::string& fmt = "") {}
+    void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%03u", event->getUsec() / 1000);
+        os << buf;
+    }
+};
+
+class MicrosecondFormatItem : public LogFormatter::FormatItem {
+public:
+    MicrosecondFormatItem(const std::string& fmt = "") {}
+    void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%06u", event->getUsec());
+        os << buf;
+    }
+};
+
+class ISO8601FormatItem : public LogFormatter::FormatItem {
+public:
+    ISO8601FormatItem(const std::string& fmt = "") {}
+    void format(std::ostream& os, std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) override {
+        LogStream::Scoped out;
+        AppendISO8601(*out, event->getTime(), event->getUsec());
+        os.write(out->data(), out->size());
+    }
 };
 
 class TabFormatItem : public LogFormatter::FormatItem 
@@ -172,6 +441,161 @@ public:
     }
 };
 
+LogStream::Buffer::Buffer()
+{
+    setp(m_inline, m_inline + sizeof(m_inline));
+}
+
+LogStream::Buffer::~Buffer()
+{
+    delete[] m_heap;
+}
+
+void LogStream::Buffer::reset()
+{
+    if(m_heap && m_heapSize > 16 * INLINE_SIZE) {   // 特别大的缓冲不留着, 免得一条超长日志让线程一直占着这块内存
+        delete[] m_heap;
+        m_heap = nullptr;
+        m_heapSize = 0;
+    }
+    if(m_heap) {
+        setp(m_heap, m_heap + m_heapSize);
+    } else {
+        setp(m_inline, m_inline + sizeof(m_inline));
+    }
+}
+
+void LogStream::Buffer::grow(size_t need)
+{
+    size_t used = size();
+    size_t cap = (size_t)(epptr() - pbase());
+    size_t new_size = cap * 2;
+    while(new_size < used + need) {
+        new_size *= 2;
+    }
+    char* buf = new char[new_size];
+    memcpy(buf, pbase(), used);
+    delete[] m_heap;                                // pbase() 可能就是旧的 m_heap, 已经拷走了
+    m_heap = buf;
+    m_heapSize = new_size;
+    setp(m_heap, m_heap + m_heapSize);
+    pbump((int)used);
+}
+
+LogStream::Buffer::int_type LogStream::Buffer::overflow(int_type c)
+{
+    if(traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+    char ch = traits_type::to_char_type(c);
+    append(&ch, 1);
+    return c;
+}
+
+std::streamsize LogStream::Buffer::xsputn(const char* s, std::streamsize n)
+{
+    append(s, (size_t)n);
+    return n;
+}
+
+LogStream::LogStream()
+    :m_os(&m_buf)
+{
+}
+
+LogStream::~LogStream()
+{
+}
+
+void LogStream::clear()
+{
+    m_buf.reset();
+    m_os.clear();
+    m_os.flags(std::ios_base::skipws | std::ios_base::dec);
+    m_os.width(0);
+    m_os.precision(6);
+    m_os.fill(' ');
+    m_fields.clear();
+    m_arena.clear();
+}
+
+LogField& LogStream::addField(const char* key, LogField::Type type)
+{
+    size_t len = strlen(key);
+    m_fields.push_back(LogField());
+    LogField& f = m_fields.back();
+    f.type = type;
+    f.keyOff = (uint32_t)m_arena.size();
+    f.keyLen = (uint32_t)len;
+    f.strOff = 0;
+    f.strLen = 0;
+    f.v.u = 0;
+    m_arena.append(key, len);
+    return f;
+}
+
+LogStream& LogStream::kv(const char* key, const char* v, size_t len)
+{
+    LogField& f = addField(key, LogField::STRING);
+    f.strOff = (uint32_t)m_arena.size();
+    f.strLen = (uint32_t)len;
+    m_arena.append(v, len);
+    return *this;
+}
+
+LogStream& LogStream::kvFromTail(const char* key, size_t mark)
+{
+    kv(key, data() + mark, size() - mark);
+    m_buf.truncate(mark);
+    return *this;
+}
+
+LogStream& LogStream::appendDouble(double v)
+{
+    if(!isDefaultFormat()) {
+        return fallback(v);
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.*g", (int)m_os.precision(), v);   // 与 ostream 默认(非fixed/scientific)的输出一致
+    return append(buf, n > 0 ? (size_t)n : 0);
+}
+
+namespace {
+static thread_local bool t_log_stream_exited = false;       // 线程退出时线程局部的缓冲已经析构(之后再打日志只能new)
+
+struct ThreadLogStream {
+    LogStream streams[2];                                   // 一个给事件的内容, 一个给格式化后的输出
+    ~ThreadLogStream() { t_log_stream_exited = true; }
+};
+}
+
+LogStream* LogStream::Acquire()
+{
+    if(!t_log_stream_exited) {
+        static thread_local ThreadLogStream t_stream;       // 每个线程第一次打日志时构造一次
+        for(auto& i : t_stream.streams) {
+            if(!i.m_busy) {
+                i.m_busy = true;
+                return &i;
+            }
+        }
+    }
+    LogStream* stream = new LogStream;
+    stream->m_heapAllocated = true;
+    stream->m_busy = true;
+    return stream;
+}
+
+void LogStream::Release(LogStream* stream)
+{
+    if(stream->m_heapAllocated) {
+        delete stream;
+        return;
+    }
+    stream->clear();
+    stream->m_busy = false;
+}
+
 LogEvent::LogEvent(std::shared_ptr<Logger> logger,
                     LogLevel::Level level,
                     const char *file, 
@@ -180,107 +604,1899 @@ LogEvent::LogEvent(std::shared_ptr<Logger> logger,
                     uint32_t thread_id, 
                     uint32_t fiber_id, 
                     uint64_t time, 
-                    const std::string &thread_name)
+                    const std::string &thread_name,
+                    uint32_t usec)
+    :LogEvent(logger, level, file, line, elapse, thread_id, fiber_id, time, &m_threadNameCopy, usec)
+{
+    m_threadNameCopy = thread_name;
+}
+
+LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse,
+                   uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string* thread_name, uint32_t usec)
     :m_file(file),
     m_line(line),
     m_elapse(elapse),
     m_threadId(thread_id),
     m_fiberId(fiber_id),
     m_time(time),
+    m_usec(usec),
     m_threadName(thread_name),
+    m_ss(LogStream::Acquire()),
     m_logger(logger),
     m_level(level)
 {
 }
 
-
-Logger::Logger(const std::string& name) 
-    :m_name(name),
-     m_level(LogLevel::DEBUG)
+LogEvent::~LogEvent()
+{
+    LogStream::Release(m_ss);
+}
+
+
+Logger::Logger(const std::string& name) 
+    :m_name(name),
+     m_level(LogLevel::DEBUG),
+     m_effectiveLevel(LogLevel::DEBUG),
+     m_appenders(new AppenderList),
+     m_effective(new AppenderList)
+{
+    m_formatter = DefaultFormatter();
+}
+
+LogFormatter::ptr Logger::DefaultFormatter()
+{
+    // const char[] formatter = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";  false
+    // const char formatter[] = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"; 
+//    m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
+
+    // mode1 ^-------v mode2
+
+    // 定义日志格式
+    std::vector<std::pair<LogFormatter::LogPattern, std::string>> patterns = {
+//        {static_cast<LogFormatter::LogPattern>(100), "MyCustomFormat"}, // 使用动态注册的格式
+        {LogFormatter::LogPattern::DateTimeFormat, ""},
+        {LogFormatter::LogPattern::TabFormat, ""},
+        {LogFormatter::LogPattern::LevelFormat, ""},                   // 使用默认格式
+        {LogFormatter::LogPattern::TabFormat, ""},
+        {LogFormatter::LogPattern::ThreadIdFormat, ""},
+        {LogFormatter::LogPattern::TabFormat, ""},
+        {LogFormatter::LogPattern::ThreadNameFormat, ""},
+        {LogFormatter::LogPattern::TabFormat, ""},
+        {LogFormatter::LogPattern::FiberIdFormat, ""},
+        {LogFormatter::LogPattern::TabFormat, ""},
+        {LogFormatter::LogPattern::MessageFormat, ""},
+        {LogFormatter::LogPattern::NewLineFormat, ""}
+    };
+
+    // 初始化日志格式
+    return LogFormatter::ptr(new LogFormatter(patterns));
+}
+
+Logger::~Logger()
+{
+    delete m_appenders.load();
+    delete m_effective.load();
+}
+
+Logger::MutexType& Logger::GetHierarchyMutex()
+{
+    static MutexType s_mutex;                   // 函数内静态变量: 别的静态对象构造时创建日志器也安全
+    return s_mutex;
+}
+
+void Logger::Retire(const RetiredLists& retired)
+{
+    for(auto i : retired) {
+        Epoch::Retire(i);
+    }
+}
+
+void Logger::publish(AppenderList* list, RetiredLists& retired)
+{
+    retired.push_back(m_appenders.load(std::memory_order_relaxed));
+    m_appenders.store(list, std::memory_order_release);
+    refresh(retired);
+}
+
+void Logger::setParent(Logger* parent, RetiredLists& retired)
+{
+    m_parent = parent;
+    parent->m_children.push_back(this);
+    refresh(retired);
+}
+
+void Logger::refresh(RetiredLists& retired)
+{
+    LogLevel::Level level = m_level.load(std::memory_order_relaxed);
+    if(level == LogLevel::UNKNOW) {
+        level = m_parent ? m_parent->getLevel() : LogLevel::DEBUG;
+    }
+
+    AppenderList* list = new AppenderList(*m_appenders.load(std::memory_order_relaxed));
+    if(m_additive && m_parent) {
+        for(auto& i : *m_parent->m_effective.load(std::memory_order_relaxed)) {
+            if(std::find(list->begin(), list->end(), i) == list->end()) {   // 同一个appender挂在多层上只输出一次
+                list->push_back(i);
+            }
+        }
+    }
+    const AppenderList* cur = m_effective.load(std::memory_order_relaxed);
+    if(*list == *cur) {                         // 没变(比如只改了级别): 不换快照, 也就没有要回收的
+        delete list;
+    } else {
+        retired.push_back(cur);
+        m_effective.store(list, std::memory_order_release);
+    }
+    m_effectiveLevel.store(level, std::memory_order_relaxed);   // 先换 appender 再换级别: 调高级别时新放行的日志不会写到旧的 appender 上
+
+    for(auto i : m_children) {
+        i->refresh(retired);
+    }
+}
+
+Logger::AppenderList Logger::getAppenders() const
+{
+    EpochGuard guard;
+    return *m_appenders.load(std::memory_order_acquire);
+}
+
+Logger::AppenderList Logger::getEffectiveAppenders() const
+{
+    EpochGuard guard;
+    return *m_effective.load(std::memory_order_acquire);
+}
+
+void Logger::setLevel(LogLevel::Level val)
+{
+    RetiredLists retired;
+    {
+        MutexType::Lock lock(GetHierarchyMutex());
+        m_level.store(val, std::memory_order_relaxed);
+        refresh(retired);
+    }
+    Retire(retired);
+}
+
+void Logger::setAdditive(bool val)
+{
+    RetiredLists retired;
+    {
+        MutexType::Lock lock(GetHierarchyMutex());
+        m_additive = val;
+        refresh(retired);
+    }
+    Retire(retired);
+}
+
+Logger::AppenderList Logger::configure(LogLevel::Level level, bool additive, const AppenderList* appenders)
+{
+    AppenderList removed;
+    RetiredLists retired;
+    {
+        MutexType::Lock lock(GetHierarchyMutex());
+        m_level.store(level, std::memory_order_relaxed);
+        m_additive = additive;
+        if(appenders) {
+            for(auto& i : *appenders) {
+                if(!i->getFormatter()) {
+                    i->setFormatter(m_formatter);
+                }
+            }
+            removed = *m_appenders.load(std::memory_order_relaxed);
+            publish(new AppenderList(*appenders), retired);
+        } else {
+            refresh(retired);
+        }
+    }
+    Retire(retired);
+    return removed;
+}
+
+void Logger::addAppender(LogAppender::ptr appender) {
+    RetiredLists retired;
+    {
+        MutexType::Lock lock(GetHierarchyMutex());
+        if(!appender->getFormatter()) {
+            appender->setFormatter(m_formatter); // 保证每一个日志都有默认格式
+        }
+        AppenderList* list = new AppenderList(*m_appenders.load(std::memory_order_relaxed));
+        list->push_back(appender);
+        publish(list, retired);
+    }
+    Retire(retired);
+}           
+void Logger::delAppender(LogAppender::ptr appender) {
+    RetiredLists retired;
+    {
+        MutexType::Lock lock(GetHierarchyMutex());
+        const AppenderList* cur = m_appenders.load(std::memory_order_relaxed);
+        for(auto it = cur->begin(); it != cur->end(); ++ it) {
+            if(*it == appender) {
+                AppenderList* list = new AppenderList(*cur);
+                list->erase(list->begin() + (it - cur->begin()));
+                publish(list, retired);
+                break;
+            }
+        }
+    }
+    Retire(retired);
+}
+
+void Logger::clearAppenders()
+{
+    RetiredLists retired;
+    {
+        MutexType::Lock lock(GetHierarchyMutex());
+        publish(new AppenderList, retired);
+    }
+    Retire(retired);
+}
+
+void Logger::setAppenders(const AppenderList& appenders)
+{
+    RetiredLists retired;
+    {
+        MutexType::Lock lock(GetHierarchyMutex());
+        for(auto& i : appenders) {
+            if(!i->getFormatter()) {
+                i->setFormatter(m_formatter);
+            }
+        }
+        publish(new AppenderList(appenders), retired);
+    }
+    Retire(retired);
+}
+
+void Logger::setFormatter(LogFormatter::ptr val)
+{
+    MutexType::Lock lock(GetHierarchyMutex());
+    m_formatter = val;
+}
+
+LogFormatter::ptr Logger::getFormatter() const
+{
+    MutexType::Lock lock(GetHierarchyMutex());
+    return m_formatter;
+}
+
+void Logger::log(LogLevel::Level level, LogEvent::ptr event)  {
+    if(level >= getLevel()) {
+        // 原来用 shared_from_this() (需要继承 std::enable_shared_from_this<Logger>), 每条日志两次原子的引用计数增减。
+        // 这里改成不持有所有权的别名指针: log() 执行期间 this 一定有效, appender 也不能把它留到 log() 之后(和 event 一样)
+        Logger::ptr self(Logger::ptr(), this);
+        LogStream::Scoped out;
+        const LogFormatter* formatted = nullptr;    // out 中是哪个formatter的结果; 相同formatter的appender共用, 只格式化一次
+        EpochGuard guard;                           // 保护期间快照不会被释放
+        const AppenderList* appenders = m_effective.load(std::memory_order_acquire);   // 无锁读取快照(含继承的appender)
+        for(auto &i : *appenders) {
+            if(level < i->getLevel()) {
+                continue;
+            }
+            const LogFormatter::ptr& formatter = i->getFormatter();
+            if(formatter.get() != formatted) {
+                out->clear();
+                formatter->format(*out, self, level, event);
+                formatted = formatter.get();
+            }
+            i->logFormatted(self, level, event, out->data(), out->size());
+        } 
+    }
+}
+
+void Logger::debug(LogEvent::ptr event) { log(LogLevel::DEBUG, event); }
+void Logger::info(LogEvent::ptr event)  { log(LogLevel::INFO, event); }
+void Logger::warn(LogEvent::ptr event)  { log(LogLevel::WARN, event); }
+void Logger::fatal(LogEvent::ptr event) { log(LogLevel::ERROR, event); }
+void Logger::error(LogEvent::ptr event) { log(LogLevel::FATAL, event); }
+
+
+void LogAppender::logFormatted(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len)
+{
+    log(logger, level, event);
+}
+
+void LogAppender::formatAndLog(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    LogStream::Scoped out;
+    m_formatter->format(*out, logger, level, event);
+    logFormatted(logger, level, event, out->data(), out->size());
+}
+
+void LogAppender::hookCrash()
+{
+    if(!m_crashHooked) {
+        m_crashHooked = AddCrashHook(&LogAppender::OnCrash, this);
+    }
+}
+
+void LogAppender::unhookCrash()
+{
+    if(m_crashHooked) {
+        DelCrashHook(&LogAppender::OnCrash, this);
+        m_crashHooked = false;
+    }
+}
+
+void LogAppender::close()
+{
+    unhookCrash();
+    flush();
+}
+
+void LogAppender::OnCrash(void* arg)
+{
+    size_t len = 0;
+    const char* record = GetCrashRecord(len);
+    ((LogAppender*)arg)->crashFlush(record, len);
+}
+
+namespace {
+static std::atomic<uint32_t> s_file_reopen_generation(0);     // RequestReopen() 的次数
+
+static void ReopenSignalHandler(int)
+{
+    FileLogAppender::RequestReopen();
+}
+
+/// 后台刷盘: 没有新日志写进来时, 缓冲里的内容靠它写出去。
+/// 有注册的 appender 才启动线程; 进程退出时(atexit)停止并 join, fork 前也先停掉, fork 之后父子进程各自按需重新启动
+struct FileFlusher {
+    Mutex mutex;                                                // 刷的时候一直持有: 注销返回之后不会再碰这个 appender
+    std::set<FileLogAppender*> appenders;
+    Thread::ptr thread;
+    Semaphore wakeup;                                           // 停止时叫醒在等下一轮的刷盘线程
+    std::atomic<bool> stopping {false};
+    bool paused = false;                                        // 正在 fork 或进程在退出: 不启动刷盘线程
+
+    void start() {                                              // 需持有 mutex
+        if(thread || paused || appenders.empty()) {
+            return;
+        }
+        thread.reset(new Thread([this]() {
+            while(!stopping) {
+                wakeup.waitFor(200);
+                if(stopping) {
+                    break;
+                }
+                Mutex::Lock lock(mutex);
+                for(auto i : appenders) {
+                    i->flushIdle();
+                }
+            }
+        }, "log_flush"));
+    }
+
+    void stop() {                                               // 不能持有 mutex(刷盘线程要拿它); 之后 start() 不再启动线程
+        Thread::ptr t;
+        {
+            Mutex::Lock lock(mutex);
+            paused = true;
+            t.swap(thread);
+        }
+        if(t) {
+            stopping = true;
+            wakeup.notify();
+            t->join();
+            stopping = false;
+        }
+    }
+};
+
+static FileFlusher& GetFileFlusher()                            // 故意不析构: 进程退出时别的静态对象析构还会注销
+{
+    static FileFlusher* s_flusher = []() {
+        FileFlusher* f = new FileFlusher;
+        pthread_atfork([]() {                                   // 子进程里不会有刷盘线程: fork 前停掉, 之后重新启动
+                           FileFlusher& f = GetFileFlusher();
+                           f.stop();
+                           f.mutex.lock();
+                           for(auto i : f.appenders) {          // 缓冲里的日志先写出去, 不然父子进程各写一遍
+                               i->flush();
+                           }
+                       },
+                       []() {
+                           FileFlusher& f = GetFileFlusher();
+                           f.paused = false;
+                           f.start();
+                           f.mutex.unlock();
+                       },
+                       []() {
+                           FileFlusher& f = GetFileFlusher();
+                           f.paused = false;
+                           f.start();
+                           f.mutex.unlock();
+                       });
+        atexit([]() { GetFileFlusher().stop(); });
+        return f;
+    }();
+    return *s_flusher;
+}
+}
+
+void FileLogAppender::RegisterFlush(FileLogAppender* appender)
+{
+    FileFlusher& f = GetFileFlusher();
+    Mutex::Lock lock(f.mutex);
+    f.appenders.insert(appender);
+    f.start();
+}
+
+void FileLogAppender::UnregisterFlush(FileLogAppender* appender)
+{
+    FileFlusher& f = GetFileFlusher();
+    Mutex::Lock lock(f.mutex);
+    f.appenders.erase(appender);
+}
+
+FileLogAppender::FileLogAppender(const std::string& filename) 
+    : m_filename(filename),
+      m_buffer(64 * 1024),
+      m_reopenGeneration(s_file_reopen_generation)
+{
+    openFile();
+    hookCrash();
+    RegisterFlush(this);
+}
+
+FileLogAppender::~FileLogAppender()
+{
+    UnregisterFlush(this);
+    unhookCrash();
+    flush();
+    closeFile();
+}
+
+void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if(level >= m_level) {
+        formatAndLog(logger, level, event);
+    }
+}
+
+void FileLogAppender::logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len)
+{
+    MutexType::Lock lock(m_mutex);
+    append(data, len);
+    if(level >= LogLevel::ERROR) {                      // 错误日志不留在缓冲里: 紧接着进程被 kill -9 也不会丢
+        flushBuffer();
+    }
+}
+
+void FileLogAppender::write(const char* data, size_t len)
+{
+    MutexType::Lock lock(m_mutex);
+    append(data, len);
+}
+
+void FileLogAppender::append(const char* data, size_t len)
+{
+    if(m_closed) {
+        return;
+    }
+    time_t now = time(0);
+    if(m_reopenGeneration != s_file_reopen_generation) {
+        m_reopenGeneration = s_file_reopen_generation;
+        flushBuffer();
+        closeFile();
+        openFile();
+    }
+    if((m_maxSize && m_fileSize + m_bufferUsed + len > m_maxSize && m_fileSize + m_bufferUsed > 0)
+            || (m_nextRotateTime && now >= m_nextRotateTime)) {
+        flushBuffer();
+        if(m_fsyncPolicy != FSYNC_NEVER && m_fd >= 0) {
+            fdatasync(m_fd);
+        }
+        closeFile();
+        shiftFiles();
+        openFile();
+        updateNextRotateTime(now);
+    }
+    if(m_bufferUsed + len > m_buffer.size() || now != m_lastFlushTime) {
+        flushBuffer();                                  // 缓冲放不下, 或者已经到了下一秒
+        m_lastFlushTime = now;
+    }
+    if(len > m_buffer.size()) {                         // 比缓冲还大的直接写, 不拷贝
+        writeFd(data, len);
+        return;
+    }
+    memcpy(&m_buffer[m_bufferUsed], data, len);
+    m_bufferUsed += len;
+}
+
+bool FileLogAppender::flushBuffer()
+{
+    if(!m_bufferUsed) {
+        return true;
+    }
+    bool rt = writeFd(&m_buffer[0], m_bufferUsed);
+    m_bufferUsed = 0;
+    return rt;
+}
+
+bool FileLogAppender::writeFd(const char* data, size_t len)
+{
+    const char* p = data;
+    size_t left = len;
+    int err = m_fd >= 0 ? 0 : EBADF;                    // 文件没打开(打开失败时已经报过)
+    while(left > 0 && m_fd >= 0) {
+        ssize_t n = ::write(m_fd, p, left);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            err = n < 0 ? errno : EIO;
+            break;                                      // 磁盘满等错误: 丢掉这批, 不让业务线程卡住
+        }
+        p += n;
+        left -= n;
+    }
+    m_fileSize += len - left;
+    if(left) {
+        uint64_t lines = std::count(p, p + left, '\n');
+        m_dropCount += lines ? lines : 1;
+        m_lastError = err;
+        if(!m_errorReported && m_fd >= 0 && !m_crashing) {  // 一直失败只报第一次, 恢复之后再失败再报; 崩溃时不碰 iostream
+            m_errorReported = true;
+            std::cerr << "FileLogAppender write " << m_filename << " failed: " << strerror(err)
+                      << ", dropping log lines" << std::endl;
+        }
+    } else if(len) {
+        m_errorReported = false;
+    }
+    if(m_fsyncPolicy == FSYNC_ALWAYS && m_fd >= 0) {
+        fdatasync(m_fd);
+    }
+    return left == 0;
+}
+
+void FileLogAppender::flushIdle()
+{
+    MutexType::Lock lock(m_mutex);
+    time_t now = time(0);
+    if(m_bufferUsed && now != m_lastFlushTime) {        // 这一秒里还有写入的话, 下一次写入或者下一次检查时再刷
+        flushBuffer();
+        m_lastFlushTime = now;
+    }
+}
+
+void FileLogAppender::flush()
+{
+    MutexType::Lock lock(m_mutex);
+    flushBuffer();
+    if(m_fsyncPolicy != FSYNC_NEVER && m_fd >= 0) {
+        fdatasync(m_fd);
+    }
+}
+
+void FileLogAppender::crashWrite(const char* data, size_t len)
+{
+    // 不加锁: 持锁的线程可能就是崩溃的线程。缓冲的大小不会在这期间变化(setBufferSize 只在配置时调用)
+    m_crashing = true;
+    if(m_bufferUsed + len <= m_buffer.size()) {
+        memcpy(&m_buffer[m_bufferUsed], data, len);
+        m_bufferUsed += len;
+        return;
+    }
+    flushBuffer();
+    writeFd(data, len);
+}
+
+void FileLogAppender::crashFlush(const char* record, size_t len)
+{
+    m_crashing = true;
+    crashWrite(record, len);
+    flushBuffer();
+    if(m_fsyncPolicy != FSYNC_NEVER && m_fd >= 0) {
+        fdatasync(m_fd);
+    }
+}
+
+void FileLogAppender::close()
+{
+    UnregisterFlush(this);                              // 后台刷盘拿着注册表的锁再拿 m_mutex, 不能在 m_mutex 里注销
+    MutexType::Lock lock(m_mutex);
+    if(m_closed) {
+        return;
+    }
+    unhookCrash();
+    flushBuffer();
+    if(m_fsyncPolicy != FSYNC_NEVER && m_fd >= 0) {
+        fdatasync(m_fd);
+    }
+    closeFile();
+    m_closed = true;
+}
+
+bool FileLogAppender::reopen() {
+    MutexType::Lock lock(m_mutex);
+    if(m_closed) {
+        return false;
+    }
+    flushBuffer();
+    closeFile();
+    return openFile();
+}
+
+bool FileLogAppender::rotate()
+{
+    MutexType::Lock lock(m_mutex);
+    if(m_closed) {
+        return false;
+    }
+    flushBuffer();
+    if(m_fsyncPolicy != FSYNC_NEVER && m_fd >= 0) {
+        fdatasync(m_fd);
+    }
+    closeFile();
+    shiftFiles();
+    return openFile();
+}
+
+void FileLogAppender::setRotateMode(RotateMode v)
+{
+    MutexType::Lock lock(m_mutex);
+    m_rotateMode = v;
+    updateNextRotateTime(time(0));
+}
+
+void FileLogAppender::setBufferSize(size_t v)
+{
+    MutexType::Lock lock(m_mutex);
+    flushBuffer();
+    m_buffer.resize(v);
+}
+
+bool FileLogAppender::openFile()
+{
+    m_fd = ::open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(m_fd < 0) {
+        std::cerr << "FileLogAppender open " << m_filename << " failed: " << strerror(errno) << std::endl;
+        m_fileSize = 0;
+        return false;
+    }
+    struct stat st;
+    m_fileSize = fstat(m_fd, &st) == 0 ? st.st_size : 0;
+    return true;
+}
+
+void FileLogAppender::closeFile()
+{
+    if(m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+void FileLogAppender::shiftFiles()
+{
+    // filename.N-1 -> filename.N ... filename -> filename.1, 超出 m_maxFiles 的删掉
+    uint32_t last = m_maxFiles;
+    if(!last) {
+        last = 1;
+        while(access((m_filename + "." + std::to_string(last)).c_str(), F_OK) == 0) {
+            ++last;
+        }
+    } else {
+        ::unlink((m_filename + "." + std::to_string(last)).c_str());
+    }
+    for(uint32_t i = last; i > 1; --i) {
+        ::rename((m_filename + "." + std::to_string(i - 1)).c_str(), (m_filename + "." + std::to_string(i)).c_str());
+    }
+    ::rename(m_filename.c_str(), (m_filename + ".1").c_str());
+}
+
+void FileLogAppender::updateNextRotateTime(time_t now)
+{
+    if(m_rotateMode == ROTATE_NONE) {
+        m_nextRotateTime = 0;
+        return;
+    }
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    if(m_rotateMode == ROTATE_HOURLY) {
+        tm.tm_hour += 1;
+    } else {
+        tm.tm_hour = 0;
+        tm.tm_mday += 1;
+    }
+    tm.tm_isdst = -1;
+    m_nextRotateTime = mktime(&tm);                     // mktime 会把越界的小时/日期进位
+}
+
+void FileLogAppender::RequestReopen()
+{
+    ++s_file_reopen_generation;
+}
+
+void FileLogAppender::InstallReopenHandler(int signum)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ReopenSignalHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signum, &sa, nullptr);
+}
+
+/// 正在写每个文件的 MmapFileLogAppender: 同一个文件同时只能有一个在写(各自预扩展、各自截断会互相破坏)
+static Mutex& MmapRegistryMutex()
+{
+    static Mutex s_mutex;
+    return s_mutex;
+}
+
+static std::map<std::string, MmapFileLogAppender*>& MmapRegistry()
+{
+    static std::map<std::string, MmapFileLogAppender*> s_registry;
+    return s_registry;
+}
+
+MmapFileLogAppender::MmapFileLogAppender(const std::string& filename, size_t chunk_size)
+    :m_filename(filename),
+     m_fileSize(0)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    m_chunkSize = (std::max(chunk_size, page) + page - 1) / page * page;
+    Mutex::Lock lock(MmapRegistryMutex());
+    MmapFileLogAppender*& cur = MmapRegistry()[m_filename];
+    if(cur) {
+        cur->release();                                 // 接管文件: 旧的先截断到实际长度, 新的才能接着写, 中间不留空白
+    }
+    cur = this;
+    if(open()) {
+        hookCrash();
+    }
+}
+
+MmapFileLogAppender::~MmapFileLogAppender()
+{
+    close();
+}
+
+bool MmapFileLogAppender::open()
+{
+    m_fd = ::open(m_filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(m_fd < 0) {
+        std::cerr << "MmapFileLogAppender open " << m_filename << " failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    uint64_t size = fstat(m_fd, &st) == 0 ? st.st_size : 0;
+    m_fileSize = size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    if(!mapWindow(size / page * page)) {                // 映射的偏移必须页对齐, 接着已有内容往后写
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    m_mapPos = size - m_mapOffset;
+    return true;
+}
+
+bool MmapFileLogAppender::mapWindow(uint64_t offset)
+{
+    if(m_base) {
+        munmap(m_base, m_chunkSize);
+        m_base = nullptr;
+    }
+    // 先把磁盘空间分配好: 只用 ftruncate 的话, 磁盘满时写映射区会收到 SIGBUS
+    int rt = posix_fallocate(m_fd, offset, m_chunkSize);
+    if(rt == EOPNOTSUPP || rt == EINVAL) {
+        rt = ftruncate(m_fd, offset + m_chunkSize) == 0 ? 0 : errno;
+    }
+    if(rt != 0) {
+        std::cerr << "MmapFileLogAppender extend " << m_filename << " failed: " << strerror(rt) << std::endl;
+        return false;
+    }
+    void* addr = mmap(nullptr, m_chunkSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+    if(addr == MAP_FAILED) {
+        std::cerr << "MmapFileLogAppender mmap " << m_filename << " failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    m_base = (char*)addr;
+    m_mapOffset = offset;
+    m_mapPos = 0;
+    return true;
+}
+
+void MmapFileLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if(level >= m_level) {
+        formatAndLog(logger, level, event);
+    }
+}
+
+void MmapFileLogAppender::logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len)
+{
+    write(data, len);
+}
+
+void MmapFileLogAppender::write(const char* data, size_t len)
+{
+    MutexType::Lock lock(m_mutex);
+    while(len > 0 && m_base) {
+        size_t n = std::min(len, m_chunkSize - m_mapPos);
+        memcpy(m_base + m_mapPos, data, n);
+        m_mapPos += n;
+        data += n;
+        len -= n;
+        m_fileSize.store(m_mapOffset + m_mapPos, std::memory_order_release);
+        if(m_mapPos == m_chunkSize) {
+            mapWindow(m_mapOffset + m_chunkSize);       // 窗口写满, 往后挪一个chunk
+        }
+    }
+}
+
+void MmapFileLogAppender::flush()
+{
+    MutexType::Lock lock(m_mutex);
+    if(m_base && m_mapPos) {
+        msync(m_base, m_mapPos, MS_SYNC);
+    }
+}
+
+void MmapFileLogAppender::close()
+{
+    {
+        Mutex::Lock lock(MmapRegistryMutex());
+        auto it = MmapRegistry().find(m_filename);
+        if(it != MmapRegistry().end() && it->second == this) {
+            MmapRegistry().erase(it);
+        }
+    }
+    release();
+}
+
+void MmapFileLogAppender::release()
+{
+    MutexType::Lock lock(m_mutex);
+    if(m_fd < 0) {
+        return;
+    }
+    unhookCrash();
+    if(m_base) {
+        munmap(m_base, m_chunkSize);
+        m_base = nullptr;
+    }
+    if(ftruncate(m_fd, m_fileSize)) {                   // 去掉预扩展的空白
+        std::cerr << "MmapFileLogAppender truncate " << m_filename << " failed: " << strerror(errno) << std::endl;
+    }
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+void MmapFileLogAppender::crashWrite(const char* data, size_t len)
+{
+    // 信号处理函数里调用: 不加锁, 不重新映射, 窗口放不下的部分丢掉
+    if(!m_base) {
+        return;
+    }
+    size_t n = std::min(len, m_chunkSize - m_mapPos);
+    memcpy(m_base + m_mapPos, data, n);
+    m_mapPos += n;
+    m_fileSize.store(m_mapOffset + m_mapPos, std::memory_order_release);
+}
+
+void MmapFileLogAppender::crashFlush(const char* record, size_t len)
+{
+    crashWrite(record, len);
+    if(m_fd >= 0) {
+        ftruncate(m_fd, m_fileSize.load(std::memory_order_acquire));    // 异步信号安全
+    }
+}
+
+void StdoutAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if(level >= m_level) {
+        formatAndLog(logger, level, event);
+    }
+}
+
+void StdoutAppender::logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len)
+{
+    std::cout.write(data, len);
+}
+
+void StdoutAppender::write(const char* data, size_t len)
+{
+    std::cout.write(data, len);
+}
+
+void StdoutAppender::flush()
+{
+    std::cout.flush();
+}
+
+void StdoutAppender::crashWrite(const char* data, size_t len)
+{
+    while(len > 0) {                                    // 崩溃时不碰 std::cout(有锁), 直接 write
+        ssize_t n = ::write(STDOUT_FILENO, data, len);
+        if(n <= 0 && errno != EINTR) {
+            break;
+        }
+        if(n > 0) {
+            data += n;
+            len -= n;
+        }
+    }
+}
+
+LogRingBuffer::LogRingBuffer(size_t capacity)
+{
+    size_t size = 2;
+    while(size < capacity) size <<= 1;                  // 取2的幂, 下标用 & m_mask 代替取模
+    m_mask = size - 1;
+    m_cells = new Cell[size];
+    for(size_t i = 0; i < size; ++i) {
+        m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    m_enqueuePos.store(0, std::memory_order_relaxed);
+}
+
+LogRingBuffer::~LogRingBuffer()
+{
+    delete[] m_cells;
+}
+
+bool LogRingBuffer::tryPush(LogLevel::Level level, std::string& msg)
+{
+    Cell* cell = nullptr;
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    while(true) {
+        cell = &m_cells[pos & m_mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if(dif == 0) {                                  // 槽位空闲, 抢占 pos
+            if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(dif < 0) {                            // 消费者还没读走上一轮的数据: 队列满
+            return false;
+        } else {                                        // 被别的生产者抢先了, 重新读取
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->level = level;
+    cell->msg.swap(msg);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool LogRingBuffer::tryPop(std::string& out)
+{
+    Cell* cell = &m_cells[m_dequeuePos & m_mask];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+    if((intptr_t)seq - (intptr_t)(m_dequeuePos + 1) < 0) {
+        return false;
+    }
+    out.append(cell->msg);
+    cell->msg.clear();                                  // clear 保留容量, 交还给下一个生产者复用
+    cell->seq.store(m_dequeuePos + m_mask + 1, std::memory_order_release);
+    ++m_dequeuePos;
+    return true;
+}
+
+bool LogRingBuffer::empty() const
+{
+    const Cell* cell = &m_cells[m_dequeuePos & m_mask];
+    return cell->seq.load(std::memory_order_acquire) != m_dequeuePos + 1;
+}
+
+void LogRingBuffer::visitPending(void (*visit)(void* arg, const char* data, size_t len), void* arg) const
+{
+    for(size_t pos = m_dequeuePos; ; ++pos) {
+        const Cell* cell = &m_cells[pos & m_mask];
+        if(cell->seq.load(std::memory_order_acquire) != pos + 1) {
+            break;                                      // 空槽位, 或者生产者还没写完
+        }
+        visit(arg, cell->msg.data(), cell->msg.size());
+    }
+}
+
+const uint32_t SpscByteRing::PAD_MARKER;
+const size_t SpscByteRing::HEADER_SIZE;
+
+SpscByteRing::SpscByteRing(size_t capacity)
+    :m_head(0),
+     m_tail(0)
+{
+    size_t size = 64;
+    while(size < capacity) size <<= 1;
+    m_mask = size - 1;
+    m_storage = new char[size];
+}
+
+SpscByteRing::~SpscByteRing()
+{
+    delete[] m_storage;
+}
+
+char* SpscByteRing::reserve(size_t len, const std::atomic<bool>* abort, uint64_t* waits)
+{
+    size_t total = RecordSize(len);                     // 8 字节对齐, 保证尾部剩余至少能放下填充标记
+    size_t cap = m_mask + 1;
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    size_t off = head & m_mask;
+    size_t contiguous = cap - off;
+    size_t need = total <= contiguous ? total : contiguous + total;
+    while(cap - (size_t)(head - m_tail.load(std::memory_order_acquire)) < need) {
+        if(abort && abort->load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        if(waits) {
+            ++*waits;
+        }
+        sched_yield();                                  // 消费者跟不上, 等它腾出空间
+    }
+    if(total > contiguous) {
+        memcpy(m_storage + off, &PAD_MARKER, 4);
+        head += contiguous;
+        off = 0;
+    }
+    uint32_t n = (uint32_t)len;
+    memcpy(m_storage + off, &n, 4);
+    m_reserveHead = head + total;
+    return m_storage + off + HEADER_SIZE;
+}
+
+const char* SpscByteRing::peek(size_t& len)
+{
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    while(tail < head) {
+        size_t off = tail & m_mask;
+        uint32_t n;
+        memcpy(&n, m_storage + off, 4);
+        if(n == PAD_MARKER) {
+            tail += m_mask + 1 - off;
+            m_tail.store(tail, std::memory_order_release);
+            continue;
+        }
+        len = n;
+        return m_storage + off + HEADER_SIZE;
+    }
+    return nullptr;
+}
+
+void SpscByteRing::pop(size_t len)
+{
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    m_tail.store(tail + RecordSize(len), std::memory_order_release);
+}
+
+AsyncLogAppender::AsyncLogAppender(LogAppender::ptr appender, size_t capacity, OverflowPolicy policy,
+                                   LogLevel::Level drop_level, size_t batch_size)
+    :m_appender(appender),
+     m_queue(capacity),
+     m_policy(policy),
+     m_dropLevel(drop_level),
+     m_batchSize(batch_size ? batch_size : 1)
+{
+    m_formatter = appender->getFormatter();             // 目标appender有自己的格式就沿用; 没有的话 addAppender 时会给默认格式
+    m_batch.reserve(64 * 1024);
+    if(m_appender->isCrashHooked()) {                   // 崩溃时要先写它缓冲里的(更早的)日志, 再写队列里的, 所以由这里统一调用
+        m_appender->unhookCrash();
+        m_innerHooked = true;
+    }
+    hookCrash();
+    m_thread.reset(new Thread(std::bind(&AsyncLogAppender::run, this), "log_async"));
+}
+
+AsyncLogAppender::~AsyncLogAppender()
+{
+    unhookCrash();
+    stop();
+    if(m_innerHooked) {
+        m_appender->hookCrash();                        // 目标appender可能还在别处使用
+    }
+}
+
+void AsyncLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if(level >= m_level) {
+        formatAndLog(logger, level, event);
+    }
+}
+
+void AsyncLogAppender::logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len)
+{
+    if(level < m_appender->getLevel()) {
+        return;
+    }
+    ++m_producers;                                      // 与 stop() 中 "m_stopping = true; 再等 m_producers 归零" 配对
+    if(m_stopping) {
+        --m_producers;
+        ++m_dropCount;
+        return;
+    }
+    static thread_local std::string t_msg;              // 入队时和槽位里的 string 交换, 换回来的是刷盘线程清空过的旧串, 容量一直复用
+    std::string& msg = t_msg;
+    msg.assign(data, len);
+
+    if(!m_queue.tryPush(level, msg)) {
+        if(m_policy == DROP || (m_policy == DROP_BELOW_LEVEL && level < m_dropLevel)) {
+            --m_producers;
+            ++m_dropCount;
+            return;
+        }
+        ++m_blockCount;
+        do {                                            // BLOCK: 让出CPU, 等刷盘线程腾出位置
+            if(m_stopping) {                            // 刷盘线程要退出了, 不会再有人腾位置
+                --m_producers;
+                ++m_dropCount;
+                return;
+            }
+            wakeup();
+            sched_yield();
+        } while(!m_queue.tryPush(level, msg));
+    }
+    ++m_pushCount;
+    --m_producers;
+    wakeup();
+}
+
+void AsyncLogAppender::wakeup()
+{
+    // 与 run() 中 "m_waiting = true; fence; 再检查队列" 配对, 保证不会出现: 刷盘线程看到空队列去睡了, 而生产者又没看到它在睡
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_waiting.load(std::memory_order_relaxed) && m_waiting.exchange(false)) {
+        m_semaphore.notify();
+    }
+}
+
+void AsyncLogAppender::notifyFlushWaiters()
+{
+    for(uint32_t n = m_flushWaiters.exchange(0); n; --n) {
+        m_flushSemaphore.notify();
+    }
+}
+
+void AsyncLogAppender::flush()
+{
+    uint64_t target = m_pushCount;
+    while(m_writeCount < target) {
+        ++m_flushWaiters;                               // 先登记再检查, 与 run()/stop() 的 "先改状态再取走登记数" 配对
+        wakeup();
+        if(m_stopped || m_writeCount >= target) {
+            break;                                      // 多登记的一次只会让信号量多一次计数, 下一轮直接返回重新检查
+        }
+        m_flushSemaphore.wait();
+    }
+    Mutex::Lock lock(m_writeMutex);
+    m_appender->flush();
+}
+
+void AsyncLogAppender::stop()
+{
+    if(!m_thread) {
+        return;
+    }
+    m_stopping = true;
+    m_semaphore.notify();
+    m_thread->join();
+    m_thread.reset();
+    while(m_producers) {                                // 检查 m_stopping 之前就进来的生产者, 入队或丢弃后马上会离开
+        sched_yield();
+    }
+    while(writeBatch()) {                               // 刷盘线程退出后才入队的日志
+    }
+    m_stopped = true;
+    notifyFlushWaiters();
+    m_appender->flush();
+}
+
+void AsyncLogAppender::close()
+{
+    unhookCrash();
+    stop();
+    m_innerHooked = false;                              // 目标appender也关掉了, 析构时不用再替它注册
+    m_appender->close();
+}
+
+void AsyncLogAppender::crashWrite(const char* data, size_t len)
+{
+    m_appender->crashWrite(data, len);
+}
+
+void AsyncLogAppender::crashFlush(const char* record, size_t len)
+{
+    if(m_batchBusy) {
+        m_appender->crashWrite(m_batch.data(), m_batch.size());
+    }
+    m_queue.visitPending(&AsyncLogAppender::CrashVisit, m_appender.get());
+    m_appender->crashFlush(record, len);
+}
+
+void AsyncLogAppender::CrashVisit(void* arg, const char* data, size_t len)
+{
+    ((LogAppender*)arg)->crashWrite(data, len);
+}
+
+size_t AsyncLogAppender::writeBatch()
+{
+    size_t n = 0;
+    m_batchBusy = true;                                 // 取出来还没写完的日志, 崩溃钩子也要写出去
+    while(n < m_batchSize && m_queue.tryPop(m_batch)) {
+        ++n;
+    }
+    if(n) {                                             // 一批日志合并成一次 write
+        {
+            Mutex::Lock lock(m_writeMutex);
+            m_appender->write(m_batch.data(), m_batch.size());
+        }
+        m_writeCount += n;
+        m_batch.clear();
+    }
+    m_batchBusy = false;
+    return n;
+}
+
+void AsyncLogAppender::run()
+{
+    while(true) {
+        if(writeBatch()) {
+            notifyFlushWaiters();
+            continue;
+        }
+        notifyFlushWaiters();
+        if(m_stopping) {
+            break;                                      // 队列已经清空, 剩下的由 stop() 收尾
+        }
+        m_waiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!m_queue.empty() || m_stopping || m_flushWaiters) {
+            m_waiting = false;
+            continue;
+        }
+        m_semaphore.wait();
+    }
+}
+
+/* ******************** 单个线程的日志分片 ********************
+ * 一个 SpscByteRing, 记录的数据是 [时间戳(微秒) 8][日志文本]
+ */
+class LogShard {
+public:
+    LogShard(size_t capacity)
+        :retired(false),
+         m_ring(capacity)
+    {
+    }
+
+    /// 放进分片的一条日志最长多少(再长就直接写, 免得一条占满分片)
+    size_t maxRecord() const    { return m_ring.capacity() / 2 - SpscByteRing::HEADER_SIZE - 8; }
+    bool empty() const          { return m_ring.empty(); }
+
+    /// (生产者) 满了就让出CPU等归并线程, 等待次数累加到 waits; *abort 变为 true 时放弃并返回 false
+    bool push(uint64_t ts, const char* data, size_t len, const std::atomic<bool>* abort, uint64_t& waits) {
+        char* p = m_ring.reserve(8 + len, abort, &waits);
+        if(!p) {
+            return false;
+        }
+        memcpy(p, &ts, 8);
+        memcpy(p + 8, data, len);
+        m_ring.commit();
+        return true;
+    }
+
+    /// (消费者) 看最早的一条, 没有返回false
+    bool peek(uint64_t& ts, const char*& data, size_t& len) {
+        size_t n = 0;
+        const char* p = m_ring.peek(n);
+        if(!p) {
+            return false;
+        }
+        memcpy(&ts, p, 8);
+        data = p + 8;
+        len = n - 8;
+        return true;
+    }
+
+    /// (消费者) 丢掉 peek 到的那一条
+    void pop(size_t len)        { m_ring.pop(8 + len); }
+
+    std::atomic<bool> retired;                          // 线程已经退出, 写空之后释放
+    uint64_t ownerId = 0;                               // 所属 ShardedLogAppender 的 m_id
+    std::atomic<uint64_t> inflight {0};                 // 生产者正在写入(可能在等空间)的那条的时间戳, 0: 没有
+private:
+    SpscByteRing m_ring;
+};
+
+namespace {
+static thread_local bool t_log_shards_exited = false;  // 线程局部的分片表已经析构(之后的日志直接写)
+
+/// 当前线程在各个 ShardedLogAppender 里的分片; 线程退出时标记 retired, 由归并线程写空后释放
+struct ThreadLogShards {
+    std::vector<std::shared_ptr<LogShard> > shards;
+    ~ThreadLogShards() {
+        t_log_shards_exited = true;
+        for(auto& i : shards) {
+            i->retired = true;
+        }
+    }
+};
+static thread_local ThreadLogShards t_log_shards;
+static std::atomic<uint64_t> s_sharded_appender_id(0);
+
+/// 活着的 ShardedLogAppender, RegisterThread() 用
+static Mutex& ShardedRegistryMutex()
+{
+    static Mutex s_mutex;
+    return s_mutex;
+}
+static std::set<ShardedLogAppender*>& ShardedRegistry()
+{
+    static std::set<ShardedLogAppender*> s_appenders;
+    return s_appenders;
+}
+
+static inline uint64_t EventTimeUS(const LogEvent::ptr& event)
+{
+    return event->getTime() * 1000000ul + event->getUsec();
+}
+}
+
+ShardedLogAppender::ShardedLogAppender(LogAppender::ptr appender, size_t shard_size, uint32_t merge_delay_ms)
+    :m_id(++s_sharded_appender_id),
+     m_appender(appender),
+     m_shardSize(shard_size),
+     m_mergeDelayUs(merge_delay_ms * 1000ul)
+{
+    m_formatter = appender->getFormatter();             // 同 AsyncLogAppender: 目标appender有格式就沿用
+    m_batch.reserve(64 * 1024);
+    if(m_appender->isCrashHooked()) {
+        m_appender->unhookCrash();
+        m_innerHooked = true;
+    }
+    hookCrash();
+    {
+        Mutex::Lock lock(ShardedRegistryMutex());
+        ShardedRegistry().insert(this);
+    }
+    m_thread.reset(new Thread(std::bind(&ShardedLogAppender::run, this), "log_merge"));
+}
+
+ShardedLogAppender::~ShardedLogAppender()
+{
+    {
+        Mutex::Lock lock(ShardedRegistryMutex());
+        ShardedRegistry().erase(this);
+    }
+    unhookCrash();
+    stop();
+    if(m_innerHooked) {
+        m_appender->hookCrash();
+    }
+}
+
+void ShardedLogAppender::RegisterThread()
+{
+    Mutex::Lock lock(ShardedRegistryMutex());
+    for(auto i : ShardedRegistry()) {
+        i->getShard();
+    }
+}
+
+LogShard* ShardedLogAppender::getShard()
+{
+    if(t_log_shards_exited) {
+        return nullptr;
+    }
+    auto& shards = t_log_shards.shards;
+    for(auto& i : shards) {
+        if(i->ownerId == m_id) {
+            return i.get();
+        }
+    }
+    std::shared_ptr<LogShard> shard(new LogShard(m_shardSize));
+    shard->ownerId = m_id;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_shards.push_back(shard);
+    }
+    // 已经销毁的 appender 留下的分片(归并线程不会再读)顺便清掉
+    for(auto it = shards.begin(); it != shards.end();) {
+        if(it->use_count() == 1) {
+            it = shards.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    shards.push_back(shard);
+    return shard.get();
+}
+
+size_t ShardedLogAppender::getShardCount()
+{
+    MutexType::Lock lock(m_mutex);
+    return m_shards.size();
+}
+
+void ShardedLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if(level >= m_level) {
+        formatAndLog(logger, level, event);
+    }
+}
+
+void ShardedLogAppender::logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len)
+{
+    if(level < m_appender->getLevel()) {
+        return;
+    }
+    bool pushed = false;
+    {
+        EpochGuard guard;                               // stop() 置 m_stopping 后用 Epoch::Synchronize() 等这里面的生产者离开
+        LogShard* shard = m_stopping ? nullptr : getShard();
+        if(shard && len <= shard->maxRecord()) {
+            uint64_t ts = EventTimeUS(event);
+            uint64_t waits = 0;
+            shard->inflight.store(ts, std::memory_order_release);
+            pushed = shard->push(ts, data, len, &m_stopping, waits);    // 归并线程要退出时不再等空间
+            shard->inflight.store(0, std::memory_order_release);
+            if(waits) {
+                m_waitCount += waits;
+            }
+        }
+    }
+    if(!pushed) {
+        MutexType::Lock lock(m_mergeMutex);             // 已经停止, 分片满了又在停止, 或者超大的一条: 直接写
+        m_appender->write(data, len);
+        ++m_writeCount;
+    }
+}
+
+size_t ShardedLogAppender::merge(bool all)
+{
+    MutexType::Lock lock(m_mergeMutex);
+    {
+        MutexType::Lock lock2(m_mutex);
+        for(auto it = m_shards.begin(); it != m_shards.end();) {
+            if((*it)->retired && (*it)->empty()) {      // 先读 retired 再看是否为空: 标记之后线程不会再写
+                it = m_shards.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        m_active.assign(m_shards.begin(), m_shards.end());
+    }
+    uint64_t limit = all ? (uint64_t)-1 : GetFastUS() - m_mergeDelayUs;     // 和日志事件的时间戳同一个时钟
+    for(auto& i : m_active) {                           // 有线程正卡在写分片(等空间): 比它早的才能输出
+        uint64_t v = i->inflight.load(std::memory_order_acquire);
+        if(v && v - 1 < limit) {
+            limit = v - 1;
+        }
+    }
+    typedef std::pair<uint64_t, size_t> Item;
+    std::greater<Item> cmp;                             // 小根堆: 时间戳最早的在堆顶, 同一时间戳按分片下标
+    m_heap.clear();
+    uint64_t ts = 0;
+    const char* data = nullptr;
+    size_t len = 0;
+    for(size_t i = 0; i < m_active.size(); ++i) {
+        if(m_active[i]->peek(ts, data, len) && ts <= limit) {
+            m_heap.push_back(Item(ts, i));
+        }
+    }
+    std::make_heap(m_heap.begin(), m_heap.end(), cmp);
+
+    size_t count = 0;
+    while(!m_heap.empty()) {
+        std::pop_heap(m_heap.begin(), m_heap.end(), cmp);
+        size_t idx = m_heap.back().second;
+        m_heap.pop_back();
+        LogShard* shard = m_active[idx].get();
+        shard->peek(ts, data, len);
+        if(m_batch.size() + len > m_batch.capacity() && !m_batch.empty()) {
+            m_appender->write(m_batch.data(), m_batch.size());
+            m_batch.clear();
+        }
+        m_batch.append(data, len);
+        shard->pop(len);
+        ++count;
+        if(shard->peek(ts, data, len) && ts <= limit) {
+            m_heap.push_back(Item(ts, idx));
+            std::push_heap(m_heap.begin(), m_heap.end(), cmp);
+        }
+    }
+    if(!m_batch.empty()) {
+        m_appender->write(m_batch.data(), m_batch.size());
+        m_batch.clear();
+    }
+    m_active.clear();
+    m_writeCount += count;
+    return count;
+}
+
+void ShardedLogAppender::flush()
+{
+    merge(true);
+    m_appender->flush();
+}
+
+void ShardedLogAppender::stop()
+{
+    if(!m_thread) {
+        return;
+    }
+    m_stopping = true;
+    m_thread->join();
+    m_thread.reset();
+    Epoch::Synchronize();                               // 检查 m_stopping 之前就进来的生产者, 写完分片(满了会放弃)就会离开
+    merge(true);
+    m_appender->flush();
+}
+
+void ShardedLogAppender::close()
+{
+    unhookCrash();
+    stop();
+    m_innerHooked = false;
+    m_appender->close();
+}
+
+void ShardedLogAppender::run()
+{
+    while(!m_stopping) {
+        if(!merge(false)) {
+            usleep(1000);
+        }
+    }
+}
+
+void ShardedLogAppender::crashWrite(const char* data, size_t len)
+{
+    m_appender->crashWrite(data, len);
+}
+
+void ShardedLogAppender::crashFlush(const char* record, size_t len)
+{
+    // 信号处理函数里不能用堆: 每次线性扫一遍各分片的队头找最早的一条
+    while(true) {
+        LogShard* min_shard = nullptr;
+        uint64_t min_ts = 0;
+        size_t min_len = 0;
+        const char* min_data = nullptr;
+        for(auto& i : m_shards) {
+            uint64_t ts;
+            const char* data;
+            size_t n;
+            if(i->peek(ts, data, n) && (!min_shard || ts < min_ts)) {
+                min_shard = i.get();
+                min_ts = ts;
+                min_data = data;
+                min_len = n;
+            }
+        }
+        if(!min_shard) {
+            break;
+        }
+        m_appender->crashWrite(min_data, min_len);
+        min_shard->pop(min_len);
+    }
+    m_appender->crashFlush(record, len);
+}
+
+UnixSocketLogAppender::UnixSocketLogAppender(const std::string& path, SocketType type, const std::string& spill_file,
+                                             size_t max_buffer, uint32_t reconnect_interval_ms)
+    :m_path(path),
+     m_type(type),
+     m_maxBuffer(max_buffer),
+     m_reconnectIntervalUs(reconnect_interval_ms * 1000ul)
+{
+    if(!spill_file.empty()) {
+        m_spill.reset(new FileLogAppender(spill_file));
+        m_spill->unhookCrash();                         // 崩溃时由这里按顺序写
+    }
+    m_pending.reserve(64 * 1024);
+    m_sending.reserve(64 * 1024);
+    hookCrash();
+    m_thread.reset(new Thread(std::bind(&UnixSocketLogAppender::run, this), "log_unix"));
+}
+
+UnixSocketLogAppender::~UnixSocketLogAppender()
+{
+    unhookCrash();
+    stop();
+    disconnect();
+}
+
+void UnixSocketLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if(level >= m_level) {
+        formatAndLog(logger, level, event);
+    }
+}
+
+void UnixSocketLogAppender::logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len)
+{
+    write(data, len);
+}
+
+void UnixSocketLogAppender::write(const char* data, size_t len)
+{
+    bool wake = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_stopping || m_pending.size() + len > m_maxBuffer) {
+            ++m_dropCount;
+            return;
+        }
+        m_pending.append(data, len);
+        m_pendingLens.push_back(len);
+        ++m_pushCount;
+        wake = m_waiting;
+        m_waiting = false;
+    }
+    if(wake) {
+        m_semaphore.notify();
+    }
+}
+
+void UnixSocketLogAppender::flush()
+{
+    uint64_t target = 0;
+    {
+        MutexType::Lock lock(m_mutex);
+        target = m_pushCount;
+    }
+    while(m_doneCount < target && m_thread) {       // 追加的时候已经唤醒过发送线程
+        sched_yield();
+    }
+    if(m_spill) {
+        m_spill->flush();
+    }
+}
+
+void UnixSocketLogAppender::stop()
+{
+    if(!m_thread) {
+        return;
+    }
+    bool wake = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_stopping = true;
+        wake = m_waiting;
+        m_waiting = false;
+    }
+    if(wake) {
+        m_semaphore.notify();
+    }
+    m_thread->join();
+    m_thread.reset();
+    if(m_spill) {
+        m_spill->flush();
+    }
+}
+
+void UnixSocketLogAppender::close()
+{
+    unhookCrash();
+    stop();
+    disconnect();
+    if(m_spill) {
+        m_spill->close();
+    }
+}
+
+void UnixSocketLogAppender::run()
+{
+    while(true) {
+        {
+            MutexType::Lock lock(m_mutex);
+            if(m_pending.empty()) {
+                if(m_stopping) {
+                    break;                              // 缓冲已经处理完
+                }
+                m_waiting = true;
+            } else {
+                m_sending.swap(m_pending);              // 整批换出来, 业务线程接着往空的缓冲里追加
+                m_sendingLens.swap(m_pendingLens);
+                m_sendingOffset = 0;
+                m_sendingBusy = true;
+            }
+        }
+        if(!m_sendingBusy) {
+            m_semaphore.wait();
+            continue;
+        }
+        deliver();
+        size_t n = m_sendingLens.size();
+        m_sending.clear();
+        m_sendingLens.clear();
+        m_sendingBusy = false;
+        m_doneCount += n;
+    }
+}
+
+void UnixSocketLogAppender::deliver()
+{
+    if(m_fd < 0 && GetMonotonicUS() >= m_nextConnectTime) {
+        connect();
+    }
+    size_t sent = 0;
+    if(m_fd >= 0) {
+        sent = m_type == STREAM ? sendStream() : sendDgram();
+        m_sendCount += sent;
+    }
+    spill();
+}
+
+bool UnixSocketLogAppender::connect()
 {
-    // const char[] formatter = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";  false
-    // const char formatter[] = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"; 
-//    m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
-
-    // mode1 ^-------v mode2
-
-    // 定义日志格式
-    std::vector<std::pair<LogFormatter::LogPattern, std::string>> patterns = {
-//        {static_cast<LogFormatter::LogPattern>(100), "MyCustomFormat"}, // 使用动态注册的格式
-        {LogFormatter::LogPattern::DateTimeFormat, ""},
-        {LogFormatter::LogPattern::TabFormat, ""},
-        {LogFormatter::LogPattern::LevelFormat, ""},                   // 使用默认格式
-        {LogFormatter::LogPattern::TabFormat, ""},
-        {LogFormatter::LogPattern::ThreadIdFormat, ""},
-        {LogFormatter::LogPattern::TabFormat, ""},
-        {LogFormatter::LogPattern::ThreadNameFormat, ""},
-        {LogFormatter::LogPattern::TabFormat, ""},
-        {LogFormatter::LogPattern::FiberIdFormat, ""},
-        {LogFormatter::LogPattern::TabFormat, ""},
-        {LogFormatter::LogPattern::MessageFormat, ""},
-        {LogFormatter::LogPattern::NewLineFormat, ""}
-    };
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(m_path.size() >= sizeof(addr.sun_path)) {
+        m_nextConnectTime = (uint64_t)-1;               // 路径太长, 不会连上
+        return false;
+    }
+    memcpy(addr.sun_path, m_path.c_str(), m_path.size());
 
-    // 初始化日志格式
-    m_formatter.reset(new LogFormatter(patterns));
+    int fd = ::socket(AF_UNIX, (m_type == STREAM ? SOCK_STREAM : SOCK_DGRAM) | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        m_nextConnectTime = GetMonotonicUS() + m_reconnectIntervalUs;
+        return false;
+    }
+    struct timeval tv = {1, 0};                         // agent 不读时发送最多卡住发送线程1秒, 然后当作断开
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(::connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        ::close(fd);
+        m_nextConnectTime = GetMonotonicUS() + m_reconnectIntervalUs;
+        return false;
+    }
+    m_fd = fd;
+    ++m_connectCount;
+    return true;
 }
 
-void Logger::addAppender(LogAppender::ptr appender) {
-    if(!appender->getFormatter()) {
-        appender->setFormatter(m_formatter); // 保证每一个日志都有默认格式
+void UnixSocketLogAppender::disconnect()
+{
+    int fd = m_fd.exchange(-1);
+    if(fd >= 0) {
+        ::close(fd);
     }
-    m_appender.push_back(appender);
-}           
-void Logger::delAppender(LogAppender::ptr appender) {
-    for(auto it = m_appender.begin(); it != m_appender.end(); ++ it) {
-        if(*it == appender) {
-            m_appender.erase(it);
+    m_nextConnectTime = GetMonotonicUS() + m_reconnectIntervalUs;
+}
+
+size_t UnixSocketLogAppender::sendStream()
+{
+    size_t off = 0;
+    size_t total = m_sending.size();
+    while(off < total) {
+        ssize_t n = ::send(m_fd, m_sending.data() + off, total - off, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {                                    // 对端关闭(EPIPE)/超时: 剩下的 spill, 过一会儿重连
+            disconnect();
             break;
         }
+        off += n;
+        m_sendingOffset = off;
     }
+    size_t sent = 0;                                    // 完整发出去的条数
+    size_t end = 0;
+    while(sent < m_sendingLens.size() && end + m_sendingLens[sent] <= off) {
+        end += m_sendingLens[sent++];
+    }
+    if(end < off) {                                     // 断在一条中间: 这条从头整条 spill, agent 那边收到的半条(没有换行, 连接随后关闭)丢掉
+        m_sendingOffset = end;
+    }
+    return sent;
 }
 
-void Logger::log(LogLevel::Level level, LogEvent::ptr event)  {
-    if(level >= m_level) {
-        auto self = shared_from_this(); // [?] 只有继承std::enable_shared_from_this<Logger>，才能在自己的成员函数中获得自己的智能指针，这样以后才能把它的智能指针传出去(智能指针哦)
-        for(auto &i : m_appender) {
-            i->log(self,level, event);
-        } 
+size_t UnixSocketLogAppender::sendDgram()
+{
+    static const size_t BATCH = 64;
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovs[BATCH];
+    size_t idx = 0;
+    size_t off = 0;
+    size_t sent = 0;
+    while(idx < m_sendingLens.size()) {
+        size_t n = 0;
+        for(size_t o = off; n < BATCH && idx + n < m_sendingLens.size(); ++n) {
+            iovs[n].iov_base = (void*)(m_sending.data() + o);
+            iovs[n].iov_len = m_sendingLens[idx + n];
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            o += m_sendingLens[idx + n];
+        }
+        int rt = ::sendmmsg(m_fd, msgs, n, MSG_NOSIGNAL);
+        if(rt < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rt < 0 && errno == EMSGSIZE) {               // 超过数据报上限的一条: 只能写 spill 文件
+            if(m_spill) {
+                m_spill->write(m_sending.data() + off, m_sendingLens[idx]);
+                ++m_spillCount;
+            } else {
+                ++m_dropCount;
+            }
+            off += m_sendingLens[idx++];
+            m_sendingOffset = off;
+            continue;
+        }
+        if(rt <= 0) {
+            disconnect();
+            break;
+        }
+        for(int i = 0; i < rt; ++i) {
+            off += m_sendingLens[idx++];
+        }
+        sent += rt;
+        m_sendingOffset = off;
     }
+    return sent;
 }
 
-void Logger::debug(LogEvent::ptr event) { log(LogLevel::DEBUG, event); }
-void Logger::info(LogEvent::ptr event)  { log(LogLevel::INFO, event); }
-void Logger::warn(LogEvent::ptr event)  { log(LogLevel::WARN, event); }
-void Logger::fatal(LogEvent::ptr event) { log(LogLevel::ERROR, event); }
-void Logger::error(LogEvent::ptr event) { log(LogLevel::FATAL, event); }
-
-
-FileLogAppender::FileLogAppender(const std::string& filename) 
-    : m_filename(filename) 
+void UnixSocketLogAppender::spill()
 {
+    size_t off = m_sendingOffset;
+    if(off >= m_sending.size()) {
+        return;
+    }
+    size_t n = 0;                                       // 还没处理完的条数(包括只发了一半的那条)
+    size_t end = 0;
+    for(auto len : m_sendingLens) {
+        end += len;
+        if(end > off) {
+            ++n;
+        }
+    }
+    if(m_spill) {
+        m_spill->write(m_sending.data() + off, m_sending.size() - off);
+        m_spillCount += n;
+    } else {
+        m_dropCount += n;
+    }
+    m_sendingOffset = m_sending.size();
 }
 
-void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+bool UnixSocketLogAppender::crashSend(const char* data, size_t len)
 {
-    if(level >= m_level) {
-        m_filestream << m_formatter->format(logger,level,event);
+    int fd = m_fd;
+    if(fd < 0 || m_type != STREAM) {                    // DGRAM 不知道记录边界, 崩溃时只写 spill 文件
+        return false;
+    }
+    while(len > 0) {
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
     }
+    return true;
 }
 
-bool FileLogAppender::reopen() {
-    if(m_filestream) {
-        m_filestream.close();
+void UnixSocketLogAppender::crashWrite(const char* data, size_t len)
+{
+    if(!crashSend(data, len) && m_spill) {
+        m_spill->crashWrite(data, len);
     }
-
-    m_filestream.open(m_filename);
-    return !!m_filestream; // [?]   双感叹号!!作用就是非0值转成1，而0值还是0. example: 非0值是true,-400就是true, !(-400)=false, !!(-400) = true
 }
 
-void StdoutAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
+void UnixSocketLogAppender::crashFlush(const char* record, size_t len)
 {
-    if(level >= m_level) {
-        std::cout << m_formatter->format(logger,level,event); // << std::endl; // namespace "std" has no member "cout" 加入iostream
+    if(m_sendingBusy) {
+        size_t off = m_sendingOffset;
+        if(off < m_sending.size()) {
+            crashWrite(m_sending.data() + off, m_sending.size() - off);
+        }
+    }
+    crashWrite(m_pending.data(), m_pending.size());     // 不能加锁: 最多有一条正在追加的写了一半
+    bool sent = crashSend(record, len);
+    if(m_spill) {
+        m_spill->crashFlush(record, sent ? 0 : len);
     }
 }
 
@@ -298,6 +2514,13 @@ std::map<LogFormatter::LogPattern, std::function<LogFormatter::FormatItem::ptr(c
     {LogPattern::FiberIdFormat,    [](const std::string& fmt) { return std::make_shared<FiberIdFormatItem>(fmt); }},
     {LogPattern::TabFormat,        [](const std::string& fmt) { return std::make_shared<TabFormatItem>(fmt); }},
     {LogPattern::ThreadNameFormat, [](const std::string& fmt) { return std::make_shared<ThreadNameFormatItem>(fmt); }},
+    {LogPattern::MillisecondFormat,[](const std::string& fmt) { return std::make_shared<MillisecondFormatItem>(fmt); }},
+    {LogPattern::MicrosecondFormat,[](const std::string& fmt) { return std::make_shared<MicrosecondFormatItem>(fmt); }},
+    {LogPattern::ISO8601Format,    [](const std::string& fmt) { return std::make_shared<ISO8601FormatItem>(fmt); }},
+    {LogPattern::JsonFormat,       [](const std::string& fmt) { return std::make_shared<JsonFormatItem>(fmt); }},
+    {LogPattern::LogfmtFormat,     [](const std::string& fmt) { return std::make_shared<LogfmtFormatItem>(fmt); }},
+    {LogPattern::FieldsFormat,     [](const std::string& fmt) { return std::make_shared<FieldsFormatItem>(fmt); }},
+    {LogPattern::StringFormat,     [](const std::string& fmt) { return std::make_shared<StringFormatItem>(fmt); }},
 };
 
 LogFormatter::LogFormatter(const std::string& pattern) 
@@ -313,12 +2536,85 @@ LogFormatter::LogFormatter(const std::vector<std::pair<LogFormatter::LogPattern,
 }
 
 std::string LogFormatter::format(std::shared_ptr<Logger> logger,LogLevel::Level level,LogEvent::ptr event) {
-    std::stringstream ss;
-    for(auto &i : m_items) {
-        i->format(ss,logger,level,event);
-      
+    LogStream::Scoped out;
+    format(*out, logger, level, event);
+    return out->str();
+}
+
+void LogFormatter::format(LogStream& out, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event)
+{
+    for(auto& i : m_ops) {
+        if(i.item) {                                            // registerFormat() 注册的自定义项
+            i.item->format(out.ostream(), logger, level, event);
+            continue;
+        }
+        switch(i.code) {
+        case MessageFormat:
+            {
+                const LogStream& ss = event->getSS();
+                out.append(ss.data(), ss.size());
+            }
+            break;
+        case LevelFormat:       out << LogLevel::ToString(level);   break;
+        case EplaseFormat:      out << event->getEplase();          break;
+        case LoggerNameFormat:  out << logger->getName();           break;
+        case ThreadIdFormat:    out << event->getThreadId();        break;
+        case NewLineFormat:     out << '\n';                        break;
+        case FilenameFormat:    out << event->getFile();            break;
+        case LineNumFormat:     out << event->getLine();            break;
+        case FiberIdFormat:     out << event->getFiberId();         break;
+        case TabFormat:         out << '\t';                        break;
+        case ThreadNameFormat:  out << event->getThreadName();      break;
+        case StringFormat:      out.append(i.arg.data(), i.arg.size()); break;
+        case DateTimeFormat:
+            {
+                size_t len = 0;
+                const char* buf = RenderDateTime(i.id, i.arg, event->getTime(), len);
+                out.append(buf, len);
+            }
+            break;
+        case MillisecondFormat: AppendFixed(out, event->getUsec() / 1000, 3);           break;
+        case MicrosecondFormat: AppendFixed(out, event->getUsec(), 6);                  break;
+        case ISO8601Format:     AppendISO8601(out, event->getTime(), event->getUsec()); break;
+        case JsonFormat:        AppendJson(out, *logger, level, *event);                break;
+        case LogfmtFormat:      AppendLogfmt(out, *logger, level, *event);              break;
+        case FieldsFormat:      AppendLogfmtFields(out, event->getSS(), false);         break;
+        default:
+            break;
+        }
+    }
+}
+
+namespace {
+// 被 registerFormat() 覆盖了的内置格式, 编译时不能再走 switch 里的内置实现
+static std::set<LogFormatter::LogPattern>& OverriddenPatterns()
+{
+    static std::set<LogFormatter::LogPattern> s_overridden;
+    return s_overridden;
+}
+}
+
+void LogFormatter::compile(LogPattern pattern, const std::string& fmt)
+{
+    Op op;
+    op.code = pattern;
+    if(pattern == StringFormat) {
+        op.arg = fmt;
+    } else if(pattern < StringFormat && !OverriddenPatterns().count(pattern)) {
+        if(pattern == DateTimeFormat) {
+            op.arg = fmt.empty() ? "%Y:%m:%d %H:%M:%S" : fmt;
+            op.id = ++s_datetime_id;
+        }
+    } else {
+        auto it = s_c_format_items.find(pattern);
+        if(it == s_c_format_items.end()) {                      // 处理未知枚举值
+            op.code = StringFormat;
+            op.arg = "<error_format>";
+        } else {
+            op.item = it->second(fmt);
+        }
     }
-    return ss.str();
+    m_ops.push_back(op);
 }
 
 // 日志格式定义
@@ -423,23 +2719,28 @@ void LogFormatter::init()
         vec.push_back(std::make_tuple(nstr, std::string(), 0));
     }
     // [function] 引入function
-    static std::map<std::string, std::function<FormatItem::ptr(const std::string& str)>> s_format_items = {
-        // {"m",[](const std::string& fmt) { return FormatItem::ptr(new MessageFormatItem(fmt)); } }
-#define XX(str,C) \
-        {#str, [] (const std::string& fmt) { return FormatItem::ptr(new C(fmt)); }}
-
-        XX(m, MessageFormatItem),           //m:消息
-        XX(p, LevelFormatItem),             //p:日志级别
-        XX(r, EplaseFormatItem),            //r:累计毫秒数
-        XX(c, LoggerNameFormatItem),        //c:日志名称
-        XX(t, ThreadIdFormatItem),          //t:线程id
-        XX(n, NewLineFormatItem),           //n:换行
-        XX(d, DateTimeFormatItem),          //d:时间
-        XX(f, FilenameFormatItem),          //f:文件名
-        XX(l, LineFormatItem),              //l:行号
-        XX(F, FiberIdFormatItem),           //F:协程id
-        XX(T, TabFormatItem),               //T:TAB
-        XX(N, ThreadNameFormatItem),        //N:线程名称
+    static std::map<std::string, LogPattern> s_format_items = {
+#define XX(str, P) \
+        {#str, P}
+
+        XX(m, MessageFormat),               //m:消息
+        XX(p, LevelFormat),                 //p:日志级别
+        XX(r, EplaseFormat),                //r:累计毫秒数
+        XX(c, LoggerNameFormat),            //c:日志名称
+        XX(t, ThreadIdFormat),              //t:线程id
+        XX(n, NewLineFormat),               //n:换行
+        XX(d, DateTimeFormat),              //d:时间
+        XX(f, FilenameFormat),              //f:文件名
+        XX(l, LineNumFormat),               //l:行号
+        XX(F, FiberIdFormat),               //F:协程id
+        XX(T, TabFormat),                   //T:TAB
+        XX(N, ThreadNameFormat),            //N:线程名称
+        XX(e, MillisecondFormat),           //e:毫秒 (%d{%H:%M:%S}.%e)
+        XX(E, MicrosecondFormat),           //E:微秒
+        XX(Z, ISO8601Format),               //Z:ISO-8601 UTC时间
+        XX(J, JsonFormat),                  //J:JSON(含字段)
+        XX(K, LogfmtFormat),                //K:logfmt(含字段)
+        XX(V, FieldsFormat),                //V:只有字段(logfmt)
 #undef XX
     };
     /* 直接把所有的类型都实例化到静态map里(知识点18: static静局部态变量初始化与函数执行关系 https://chat.deepseek.com/a/chat/s/457fb921-90f9-4a27-8b39-2636ce2e2315)
@@ -463,30 +2764,30 @@ void LogFormatter::init()
         需要注意的是，静态变量的生命周期是整个程序运行期间，所以它的值会在多次函数调用之间保持持久性。
      */
 
+    m_ops.clear();
     for(auto& i : vec)
     {
         if(std::get<2>(i) == 0)
         {
-            m_items.push_back(FormatItem::ptr(new StringFormatItem(std::get<0>(i))));
+            compile(StringFormat, std::get<0>(i));
         }
         else
         {
             auto it = s_format_items.find(std::get<0>(i));
             if(it == s_format_items.end())
             {
-                m_items.push_back(FormatItem::ptr(new StringFormatItem("<<error_format %" + std::get<0>(i) + ">>")));
+                compile(StringFormat, "<<error_format %" + std::get<0>(i) + ">>");
             } else
             {
-                m_items.push_back(it->second(std::get<1>(i)));
+                compile(it->second, std::get<1>(i));
             }
         }
-        std::cout << '(' << std::get<0>(i) << ") - (" << std::get<1>(i) << ") - (" << std::get<2>(i) << ')' << std::endl;
     }
 }
 
 void LogFormatter::init2()
 {
-    m_items.clear();
+    m_ops.clear();
 //(放到外面)    // 枚举值到格式化项的映射
 //    static const std::map<LogPattern, std::function<FormatItem::ptr(const std::string&)> > s_c_format_items = {
 //        {LogPattern::MessageFormat,    [](const std::string& fmt) { return std::make_shared<MessageFormatItem>(fmt); }},
@@ -509,11 +2810,7 @@ void LogFormatter::init2()
         LogPattern pattern = pattern_pair.first;       // 获取枚举值
         const std::string& fmt = pattern_pair.second;  // 获取格式字符串
 
-        auto it = s_c_format_items.find(pattern);
-        if (it != s_c_format_items.end())
-            m_items.push_back(it->second(fmt)); // 使用用户指定的格式
-        else
-            m_items.push_back(std::make_shared<StringFormatItem>("<error_format>"));    // 处理未知枚举值
+        compile(pattern, fmt);                         // 内置的编译成 switch 分支, 其余的查 s_c_format_items
     }
 
 //        // 遍历枚举值，生成格式化项
@@ -590,6 +2887,44 @@ void LogFormatter::init2()
 void LogFormatter::registerFormat(LogFormatter::LogPattern pattern, std::function<LogFormatter::FormatItem::ptr (const std::string &)> creator)
 {
     s_c_format_items[pattern] = creator;
+    if(pattern < StringFormat) {
+        OverriddenPatterns().insert(pattern);           // 之后构造的formatter改用注册的实现
+    }
+}
+
+bool LogEveryMs::admit(uint64_t ms, uint64_t& suppressed)
+{
+    uint64_t now = GetMonotonicUS();
+    uint64_t next = m_next.load(std::memory_order_relaxed);
+    if(now >= next && m_next.compare_exchange_strong(next, now + ms * 1000, std::memory_order_relaxed)) {
+        suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+    m_suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+bool LogRateLimiter::admit(uint64_t rate, uint64_t burst, uint64_t& suppressed)
+{
+    if(!rate) {
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);  // 全部限流也要计数, rate 改成非0后第一条带出来
+        return false;
+    }
+    uint64_t interval = 1000000 / rate;                 // 每条消耗的时间(微秒)
+    uint64_t tolerance = interval * (burst ? burst : 1);
+    uint64_t now = GetMonotonicUS();
+    uint64_t tat = m_tat.load(std::memory_order_relaxed);
+    while(true) {
+        uint64_t new_tat = std::max(tat, now) + interval;
+        if(new_tat - now > tolerance) {                 // 桶里没有令牌了
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if(m_tat.compare_exchange_weak(tat, new_tat, std::memory_order_relaxed)) {
+            suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+    }
 }
 
 LogEventWrap::LogEventWrap(LogEvent::ptr event)
@@ -597,11 +2932,27 @@ LogEventWrap::LogEventWrap(LogEvent::ptr event)
 {
 }
 
+LogEventWrap::LogEventWrap(Logger* logger, LogLevel::Level level, const char* file, int32_t line,
+                           uint32_t elapse, uint32_t thread_id, uint32_t fiber_id, uint64_t time_us, const std::string& thread_name)
+    :m_inplace(true)
+{
+    // 不持有所有权的 shared_ptr(别名构造): 宏的调用方保证 logger 活得比这条日志久, 省掉引用计数的原子操作
+    LogEvent* event = new (&m_storage) LogEvent(Logger::ptr(Logger::ptr(), logger), level, file, line, elapse, thread_id, fiber_id,
+                                                time_us / 1000000, &thread_name, time_us % 1000000);
+    m_event = LogEvent::ptr(LogEvent::ptr(), event);            // [shared_ptr别名构造] 空的所有者 + 裸指针: 不分配控制块, 不做引用计数
+}
+
 LogEventWrap::~LogEventWrap()
 {
     m_event->getLogger()->log(m_event->getLevel(), m_event);    // 把自己写入日志 ?  深入分析一下，怎么输出到控制台
+    if(m_inplace) {
+        LogEvent* event = m_event.get();
+        m_event.reset();
+        event->~LogEvent();
+    }
 }
-std::stringstream &LogEventWrap::getSS()
+
+LogStream& LogEventWrap::getSS()
 {
     return m_event->getSS();
 }
@@ -611,14 +2962,499 @@ LoggerManager::LoggerManager()
     m_root.reset(new Logger);
     m_root->addAppender(LogAppender::ptr(new StdoutAppender));
 
-    m_loggers[m_root->getName()] = m_root;
+    LoggerMap* loggers = new LoggerMap;
+    (*loggers)[m_root->getName()] = m_root;
+    m_loggers.store(loggers, std::memory_order_release);
+}
+
+LoggerManager::~LoggerManager()
+{
+    delete m_loggers.load();
+}
+
+Logger::ptr LoggerManager::findLogger(const std::string& name) const
+{
+    if(name.empty()) {
+        return m_root;
+    }
+    EpochGuard guard;
+    const LoggerMap* loggers = m_loggers.load(std::memory_order_acquire);
+    auto it = loggers->find(name);
+    return it == loggers->end() ? nullptr : it->second;
 }
 
 Logger::ptr LoggerManager::getLogger(const std::string &name)
 {
-    auto it = m_loggers.find(name);
-    return it == m_loggers.end() ? m_root : it->second;
-    // return Logger::ptr();
+    Logger::ptr logger = findLogger(name);
+    if(logger) {
+        return logger;
+    }
+
+    const LoggerMap* cur = nullptr;
+    Logger::RetiredLists retired;
+    {
+        MutexType::Lock lock(m_mutex);
+        cur = m_loggers.load(std::memory_order_relaxed);
+        auto it = cur->find(name);              // 别的线程可能刚建好
+        if(it != cur->end()) {
+            return it->second;
+        }
+
+        // 从最上一级开始, 缺哪一级建哪一级: "a.b.c" -> "a", "a.b", "a.b.c"
+        LoggerMap* loggers = new LoggerMap(*cur);
+        Logger::MutexType::Lock hlock(Logger::GetHierarchyMutex());
+        Logger* parent = m_root.get();
+        size_t pos = 0;
+        do {
+            pos = name.find('.', pos);
+            std::string prefix = name.substr(0, pos);
+            Logger::ptr& node = (*loggers)[prefix];
+            if(!node) {
+                node.reset(new Logger(prefix));
+                node->m_level.store(LogLevel::UNKNOW, std::memory_order_relaxed);  // 继承父日志器的级别
+                node->m_formatter = parent->m_formatter;
+                node->setParent(parent, retired);
+            }
+            parent = node.get();
+            logger = node;
+            if(pos != std::string::npos) {
+                ++pos;
+            }
+        } while(pos != std::string::npos);
+
+        m_loggers.store(loggers, std::memory_order_release);
+    }
+    Logger::Retire(retired);                    // 出了锁再回收: 释放旧快照时可能顺带析构 appender
+    Epoch::Retire(cur);
+    return logger;
+}
+
+/* ******************** 日志配置(YAML) ********************
+ * Config 里的 "logs" 配置项, 例:
+ *  logs:
+ *      - name: root
+ *        level: info
+ *        formatter: "%d%T%m%n"
+ *        appenders:
+ *            - type: StdoutLogAppender
+ *      - name: system                          # system.scheduler 等没配置的子日志器继承它
+ *        level: debug
+ *        additive: false                       # 不再输出到 root 的 appender
+ *        appenders:
+ *            - type: FileLogAppender
+ *              file: ./system.txt
+ *              level: info                     # 可选: appender 自己的级别/格式
+ *              max_size: 104857600             # 可选: 滚动/缓冲/落盘策略, 和 FileLogAppender 的 set 函数对应
+ *              max_files: 5
+ *              rotate: daily                   # none / hourly / daily
+ *              buffer_size: 65536
+ *              fsync: never                    # never / flush / always
+ *              async: true                     # 可选: 套一层 AsyncLogAppender
+ *              async_capacity: 8192
+ *              async_policy: block             # block / drop / drop_below_level
+ *            - type: MmapFileLogAppender
+ *              file: ./system_mmap.txt
+ *            - type: UnixSocketLogAppender     # 发给本机的日志收集 agent
+ *              file: /run/agent/log.sock       # 套接字路径
+ *              socket: dgram                   # stream / dgram
+ *              spill: ./system_spill.txt       # 可选: agent 连不上时写到这个文件
+ * Config::LoadFromYaml 之后配置变化的回调按新旧差异修改 LoggerManager 里的日志器:
+ *  只改了级别/additive 的只改这两项(appender 不动, 打日志的路径上还是只读一个原子变量);
+ *  appender 或格式有变化的整体换一个新的 appender 快照; 配置里删掉的日志器恢复成默认(继承父日志器, 没有自己的 appender)。
+ * LexicalCast 的特化只在这个文件里用(ConfigVar<std::set<LogDefine> > 也只在这里实例化); LoadFromYaml 直接按节点转换。
+ */
+namespace {
+
+struct LogAppenderDefine {
+    enum Type {
+        UNKNOWN = 0,
+        FILE = 1,
+        STDOUT = 2,
+        MMAP = 3,
+        UNIX = 4
+    };
+    int type = UNKNOWN;
+    LogLevel::Level level = LogLevel::UNKNOW;           // UNKNOW: 不设置, 用 appender 的默认级别
+    std::string formatter;                              // 空: 用日志器的格式
+    std::string file;
+    uint64_t max_size = 0;
+    uint32_t max_files = 0;
+    int rotate = FileLogAppender::ROTATE_NONE;
+    int64_t buffer_size = -1;                           // -1: 不设置, 用 FileLogAppender 的默认值
+    int fsync = FileLogAppender::FSYNC_NEVER;
+    bool async = false;
+    uint64_t async_capacity = 8192;
+    int async_policy = AsyncLogAppender::BLOCK;
+    int socket = UnixSocketLogAppender::STREAM;
+    std::string spill;
+
+    bool operator==(const LogAppenderDefine& o) const {
+        return type == o.type && level == o.level && formatter == o.formatter && file == o.file
+            && max_size == o.max_size && max_files == o.max_files && rotate == o.rotate
+            && buffer_size == o.buffer_size && fsync == o.fsync && async == o.async
+            && async_capacity == o.async_capacity && async_policy == o.async_policy
+            && socket == o.socket && spill == o.spill;
+    }
+};
+
+struct LogDefine {
+    std::string name;
+    LogLevel::Level level = LogLevel::UNKNOW;           // UNKNOW: 继承父日志器
+    std::string formatter;
+    bool additive = true;
+    std::vector<LogAppenderDefine> appenders;
+
+    bool operator==(const LogDefine& o) const {
+        return name == o.name && level == o.level && formatter == o.formatter
+            && additive == o.additive && appenders == o.appenders;
+    }
+    bool operator<(const LogDefine& o) const    { return name < o.name; }
+};
+
+/// 配置里的枚举都写成小写字符串, 下标就是枚举值
+const char* const s_appender_types[] = {"", "FileLogAppender", "StdoutLogAppender", "MmapFileLogAppender", "UnixSocketLogAppender"};
+const char* const s_rotate_modes[] = {"none", "hourly", "daily"};
+const char* const s_fsync_policies[] = {"never", "flush", "always"};
+const char* const s_async_policies[] = {"block", "drop", "drop_below_level"};
+const char* const s_socket_types[] = {"stream", "dgram"};
+
+template<size_t N>
+int NameToEnum(const char* const (&names)[N], const std::string& v, int def)
+{
+    for(size_t i = 0; i < N; ++i) {
+        if(v == names[i]) {
+            return i;
+        }
+    }
+    return def;
+}
+
+std::string LevelToConfig(LogLevel::Level level)
+{
+    std::string rt = LogLevel::ToString(level);
+    std::transform(rt.begin(), rt.end(), rt.begin(), ::tolower);
+    return rt;
+}
+
+}
+
+template<>
+class LexicalCast<YAML::Node, std::set<LogDefine> > {
+public:
+    std::set<LogDefine> operator()(const YAML::Node& node) {
+        std::set<LogDefine> rt;
+        for(size_t i = 0; i < node.size(); ++i) {
+            const YAML::Node& n = node[i];
+            if(!n["name"].IsDefined()) {
+                MYLOG_ERROR(SYLAR_LOG_ROOT()) << "log config error: name is null, " << n;
+                continue;
+            }
+            LogDefine ld;
+            ld.name = n["name"].as<std::string>();
+            if(n["level"].IsDefined()) {
+                ld.level = LogLevel::FromString(n["level"].as<std::string>());
+            }
+            if(n["formatter"].IsDefined()) {
+                ld.formatter = n["formatter"].as<std::string>();
+            }
+            if(n["additive"].IsDefined()) {
+                ld.additive = n["additive"].as<bool>();
+            }
+            const YAML::Node& appenders = n["appenders"];
+            for(size_t j = 0; appenders.IsSequence() && j < appenders.size(); ++j) {
+                const YAML::Node& a = appenders[j];
+                LogAppenderDefine lad;
+                lad.type = NameToEnum(s_appender_types, a["type"].IsDefined() ? a["type"].as<std::string>() : "",
+                                      LogAppenderDefine::UNKNOWN);
+                if(lad.type == LogAppenderDefine::UNKNOWN) {
+                    MYLOG_ERROR(SYLAR_LOG_ROOT()) << "log config error: appender type is invalid, " << a;
+                    continue;
+                }
+                if(lad.type != LogAppenderDefine::STDOUT) {
+                    if(!a["file"].IsDefined()) {
+                        MYLOG_ERROR(SYLAR_LOG_ROOT()) << "log config error: appender file is null, " << a;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
+                }
+                if(a["level"].IsDefined()) {
+                    lad.level = LogLevel::FromString(a["level"].as<std::string>());
+                }
+                if(a["formatter"].IsDefined()) {
+                    lad.formatter = a["formatter"].as<std::string>();
+                }
+                if(a["max_size"].IsDefined()) {
+                    lad.max_size = a["max_size"].as<uint64_t>();
+                }
+                if(a["max_files"].IsDefined()) {
+                    lad.max_files = a["max_files"].as<uint32_t>();
+                }
+                if(a["rotate"].IsDefined()) {
+                    lad.rotate = NameToEnum(s_rotate_modes, a["rotate"].as<std::string>(), lad.rotate);
+                }
+                if(a["buffer_size"].IsDefined()) {
+                    lad.buffer_size = a["buffer_size"].as<int64_t>();
+                }
+                if(a["fsync"].IsDefined()) {
+                    lad.fsync = NameToEnum(s_fsync_policies, a["fsync"].as<std::string>(), lad.fsync);
+                }
+                if(a["async"].IsDefined()) {
+                    lad.async = a["async"].as<bool>();
+                }
+                if(a["async_capacity"].IsDefined()) {
+                    lad.async_capacity = a["async_capacity"].as<uint64_t>();
+                }
+                if(a["async_policy"].IsDefined()) {
+                    lad.async_policy = NameToEnum(s_async_policies, a["async_policy"].as<std::string>(), lad.async_policy);
+                }
+                if(a["socket"].IsDefined()) {
+                    lad.socket = NameToEnum(s_socket_types, a["socket"].as<std::string>(), lad.socket);
+                }
+                if(a["spill"].IsDefined()) {
+                    lad.spill = a["spill"].as<std::string>();
+                }
+                ld.appenders.push_back(lad);
+            }
+            rt.erase(ld);                               // 同名的以后面的为准
+            rt.insert(ld);
+        }
+        return rt;
+    }
+};
+
+template<>
+class LexicalCast<std::set<LogDefine>, YAML::Node> {
+public:
+    YAML::Node operator()(const std::set<LogDefine>& v) {
+        YAML::Node node(YAML::NodeType::Sequence);
+        for(auto& i : v) {
+            YAML::Node n;
+            n["name"] = i.name;
+            if(i.level != LogLevel::UNKNOW) {
+                n["level"] = LevelToConfig(i.level);
+            }
+            if(!i.formatter.empty()) {
+                n["formatter"] = i.formatter;
+            }
+            if(!i.additive) {
+                n["additive"] = false;
+            }
+            for(auto& a : i.appenders) {
+                YAML::Node na;
+                na["type"] = s_appender_types[a.type];
+                if(!a.file.empty()) {
+                    na["file"] = a.file;
+                }
+                if(a.level != LogLevel::UNKNOW) {
+                    na["level"] = LevelToConfig(a.level);
+                }
+                if(!a.formatter.empty()) {
+                    na["formatter"] = a.formatter;
+                }
+                if(a.type == LogAppenderDefine::FILE) {
+                    if(a.max_size) {
+                        na["max_size"] = a.max_size;
+                    }
+                    if(a.max_files) {
+                        na["max_files"] = a.max_files;
+                    }
+                    na["rotate"] = s_rotate_modes[a.rotate];
+                    if(a.buffer_size >= 0) {
+                        na["buffer_size"] = a.buffer_size;
+                    }
+                    na["fsync"] = s_fsync_policies[a.fsync];
+                }
+                if(a.type == LogAppenderDefine::UNIX) {
+                    na["socket"] = s_socket_types[a.socket];
+                    if(!a.spill.empty()) {
+                        na["spill"] = a.spill;
+                    }
+                }
+                if(a.async) {
+                    na["async"] = true;
+                    na["async_capacity"] = a.async_capacity;
+                    na["async_policy"] = s_async_policies[a.async_policy];
+                }
+                n["appenders"].push_back(na);
+            }
+            node.push_back(n);
+        }
+        return node;
+    }
+};
+
+template<>
+class LexicalCast<std::string, std::set<LogDefine> > {
+public:
+    std::set<LogDefine> operator()(const std::string& v) {
+        return LexicalCast<YAML::Node, std::set<LogDefine> >()(YAML::Load(v));
+    }
+};
+
+template<>
+class LexicalCast<std::set<LogDefine>, std::string> {
+public:
+    std::string operator()(const std::set<LogDefine>& v) {
+        std::stringstream ss;
+        ss << LexicalCast<std::set<LogDefine>, YAML::Node>()(v);
+        return ss.str();
+    }
+};
+
+namespace {
+
+LogAppender::ptr CreateAppender(const LogAppenderDefine& def, const LogFormatter::ptr& formatter)
+{
+    LogAppender::ptr ap;
+    switch(def.type) {
+    case LogAppenderDefine::FILE: {
+        FileLogAppender::ptr fap(new FileLogAppender(def.file));
+        fap->setMaxSize(def.max_size);
+        fap->setMaxFiles(def.max_files);
+        fap->setRotateMode((FileLogAppender::RotateMode)def.rotate);
+        if(def.buffer_size >= 0) {
+            fap->setBufferSize(def.buffer_size);
+        }
+        fap->setFsyncPolicy((FileLogAppender::FsyncPolicy)def.fsync);
+        ap = fap;
+        break;
+    }
+    case LogAppenderDefine::STDOUT:
+        ap.reset(new StdoutAppender);
+        break;
+    case LogAppenderDefine::MMAP:
+        ap.reset(new MmapFileLogAppender(def.file));
+        break;
+    case LogAppenderDefine::UNIX:
+        ap.reset(new UnixSocketLogAppender(def.file, (UnixSocketLogAppender::SocketType)def.socket, def.spill));
+        break;
+    default:
+        return nullptr;
+    }
+    ap->setFormatter(formatter);
+    if(def.async) {                                     // 级别放在外层: 低于级别的不入队
+        ap.reset(new AsyncLogAppender(ap, def.async_capacity, (AsyncLogAppender::OverflowPolicy)def.async_policy));
+        ap->setFormatter(formatter);
+    }
+    if(def.level != LogLevel::UNKNOW) {
+        ap->setLevel(def.level);
+    }
+    return ap;
+}
+
+/// 每个日志器按配置建出来的 appender 和它对应的配置, 改配置时没变的 appender 原样留用(不重开文件, 不重启后台线程)。
+/// 只在 g_log_defines 的监听器里访问, 监听器是串行调用的
+typedef std::vector<std::pair<LogAppenderDefine, LogAppender::ptr> > ConfiguredAppenders;
+std::map<std::string, ConfiguredAppenders>& GetConfiguredAppenders()
+{
+    static std::map<std::string, ConfiguredAppenders> s_appenders;
+    return s_appenders;
+}
+
+/// 按一条配置修改日志器; old 是这个日志器原来的配置(没有为 nullptr); 换下来的 appender 追加到 removed
+void ApplyLogDefine(const LogDefine* old, const LogDefine& def, Logger::AppenderList& removed)
+{
+    Logger::ptr logger = SYLAR_LOG_NAME(def.name);
+    if(old && old->formatter == def.formatter && old->appenders == def.appenders) {
+        logger->configure(def.level, def.additive);     // 只调级别: 不重建 appender
+        return;
+    }
+
+    bool same_formatter = old && old->formatter == def.formatter;
+    if(!def.formatter.empty() && !same_formatter) {    // 格式没改就留着原来的格式器对象, 留用的和新建的 appender 共用, 一条日志只格式化一次
+        logger->setFormatter(LogFormatter::ptr(new LogFormatter(def.formatter)));
+    } else if(def.formatter.empty() && old && !old->formatter.empty()) {
+        logger->setFormatter(Logger::DefaultFormatter());   // 配置里去掉了 formatter
+    }
+    LogFormatter::ptr logger_formatter = logger->getFormatter();
+    ConfiguredAppenders& configured = GetConfiguredAppenders()[def.name];
+    ConfiguredAppenders unused;
+    unused.swap(configured);
+    Logger::AppenderList appenders;
+    for(auto& a : def.appenders) {
+        LogAppender::ptr ap;
+        for(auto it = unused.begin(); it != unused.end(); ++it) {
+            // 配置一样, 用的格式也没变(自己写了格式, 或者日志器的格式没改): 原来的 appender 接着用
+            if(it->first == a && (!a.formatter.empty() || same_formatter)) {
+                ap = it->second;
+                unused.erase(it);
+                break;
+            }
+        }
+        if(!ap) {
+            ap = CreateAppender(a, a.formatter.empty() ? logger_formatter
+                                    : LogFormatter::ptr(new LogFormatter(a.formatter)));
+        }
+        if(ap) {
+            appenders.push_back(ap);
+            configured.push_back(std::make_pair(a, ap));
+        }
+    }
+    // 要换掉的 appender 先把缓冲写出去, 免得写同一个文件的新 appender 先追加, 旧的到 close() 时才写出更早的日志
+    for(auto& i : unused) {
+        i.second->flush();
+    }
+    Logger::AppenderList old_appenders = logger->configure(def.level, def.additive, &appenders);   // 一次发布, 读者看不到新级别配旧 appender
+    for(auto& i : old_appenders) {
+        if(std::find(appenders.begin(), appenders.end(), i) == appenders.end()) {
+            removed.push_back(i);                       // 留用的不能关
+        }
+    }
+}
+
+/// 配置里删掉的日志器: 恢复默认。root 恢复成构造时的样子(输出到控制台), 免得整个进程没有日志
+void ResetLogger(const LogDefine& def, Logger::AppenderList& removed)
+{
+    Logger::ptr logger = SYLAR_LOG_NAME(def.name);
+    GetConfiguredAppenders().erase(def.name);
+    if(!def.formatter.empty()) {
+        logger->setFormatter(Logger::DefaultFormatter());
+    }
+    Logger::AppenderList old_appenders;
+    if(logger == SYLAR_LOG_ROOT()) {
+        Logger::AppenderList appenders{LogAppender::ptr(new StdoutAppender)};
+        old_appenders = logger->configure(LogLevel::DEBUG, true, &appenders);
+    } else {
+        Logger::AppenderList appenders;
+        old_appenders = logger->configure(LogLevel::UNKNOW, true, &appenders);
+    }
+    removed.insert(removed.end(), old_appenders.begin(), old_appenders.end());
+}
+
+ConfigVar<std::set<LogDefine> >::ptr g_log_defines =
+    Config::Lookup("logs", std::set<LogDefine>(), "logs config");
+
+struct LogIniter {
+    LogIniter() {
+        g_log_defines->addListener(0xF1E231, [](const std::set<LogDefine>& old_value,
+                                                const std::set<LogDefine>& new_value) {
+            MYLOG_INFO(SYLAR_LOG_ROOT()) << "on_logger_conf_changed";
+            Logger::AppenderList removed;
+            for(auto& i : new_value) {
+                auto it = old_value.find(i);
+                if(it == old_value.end()) {
+                    ApplyLogDefine(nullptr, i, removed);    // 新增的日志器
+                } else if(!(i == *it)) {
+                    ApplyLogDefine(&*it, i, removed);       // 修改的日志器
+                }
+            }
+            for(auto& i : old_value) {
+                if(new_value.find(i) == new_value.end()) {
+                    ResetLogger(i, removed);            // 删除的日志器
+                }
+            }
+            // 换下来的 appender: 等还在用旧快照写日志的线程都离开, 再关掉(停后台线程, 关文件, 注销崩溃钩子),
+            // 不然每次重新加载都会留下一批线程和文件描述符, 崩溃钩子的槽位也会被占满
+            Epoch::Synchronize();
+            for(auto& i : removed) {
+                i->close();
+            }
+        });
+    }
+};
+
+LogIniter s_log_initer;
+
 }
 
 }
@@ -3,24 +3,44 @@
 
 #include <string>
 #include <stdint.h>
+#include <string.h>
 #include <memory>
 #include <list>
 #include <vector>
 #include <sstream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
+#include <atomic>
+#include <type_traits>
 
 #include "util.h"
 #include "singleton.h"
 #include "thread.h"
 
 
+/// ******************** 编译期日志级别 ********************
+/// 低于 SYLAR_LOG_MIN_LEVEL 的日志语句在编译期就是死代码(参数也不会求值), 比如 release 构建里 -DSYLAR_LOG_MIN_LEVEL=2 去掉所有 DEBUG 日志。
+/// 取值同 LogLevel::Level: 1 DEBUG, 2 INFO, 3 WARN, 4 ERROR, 5 FATAL
+#ifndef SYLAR_LOG_MIN_LEVEL
+#define SYLAR_LOG_MIN_LEVEL 1
+#endif
+
 /// ******************** 使用流式方式将日志级别level的日志写入到logger ********************  (分析下这里写的好处，用宏)
-#define MYLOG(logger, level) \
-    if(logger->getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent( \
-            logger, level, __FILE__, __LINE__, 0, sylar::GetThreadId(), \
-            sylar::GetFiberId(), time(0), sylar::Thread::GetName()))).getSS()
+/// 事件直接构造在 LogEventWrap 临时对象里(栈上), 内容写进线程局部的 LogStream 缓冲, 整条日志不需要堆分配
+/// 时间和运行时间(%r)用 rdtsc 换算(GetFastUS/GetUptimeMS), 线程id/名称读线程局部的缓存, 都不陷入内核
+/// logger 可以是 Logger::ptr 也可以是 Logger*, 只取一次裸指针做级别判断, 不拷贝 shared_ptr。
+/// 用 for 而不是 if: 只执行一次, 而且宏后面跟 else 时不会出现悬空 else 的问题
+/// cond 是级别满足之后才求值的附加条件(限流宏用), 可以通过 sylar_log_gate.suppressed 带出被抑制的条数
+#define SYLAR_LOG_GATED(logger, level, cond) \
+    for(sylar::LogSiteGate sylar_log_gate((level) >= SYLAR_LOG_MIN_LEVEL ? sylar::GetLoggerPtr(logger) : nullptr); \
+            (level) >= SYLAR_LOG_MIN_LEVEL && sylar_log_gate.ptr && sylar_log_gate.ptr->getLevel() <= (level) && (cond); \
+            sylar_log_gate.ptr = nullptr) \
+        sylar::LogEventWrap( \
+            sylar_log_gate.ptr, level, __FILE__, __LINE__, sylar::GetUptimeMS(), sylar::GetThreadId(), \
+            sylar::GetFiberId(), sylar::GetFastUS(), sylar::Thread::GetName()).getSS()
+
+#define MYLOG(logger, level) SYLAR_LOG_GATED(logger, level, true)
 
 #define MYLOG_DEBUG(logger) MYLOG(logger, sylar::LogLevel::DEBUG)           // 使用流式方式将日志级别debug的日志写入到logger
 #define MYLOG_INFO(logger) MYLOG(logger, sylar::LogLevel::INFO)             // 使用流式方式将日志级别info的日志写入到logger
@@ -31,6 +51,25 @@
 #define SYLAR_LOG_ROOT() sylar::LoggerMgr::GetInstance()->getRoot()             // 获取主日志器
 #define SYLAR_LOG_NAME(name) sylar::LoggerMgr::GetInstance()->getLogger(name)   // 获取name的日志器
 
+/// ******************** 按调用点采样/限流的日志 ********************
+/// 每个调用点一份状态: 宏里立即调用的 lambda 是唯一的类型, 它里面的局部静态变量就是这个调用点独有的。
+/// 判断都是原子操作, 没有锁; 级别不满足时不会动状态。被限流掉的条数在下一条放行的日志前面输出 "[suppressed N] ";
+/// FIRST_N 没有"下一条", 改成在第一次被限流时放行那一条, 前面输出 "[first N logged, suppressing the rest] "
+#define SYLAR_LOG_SITE(T) ([]() -> T& { static T sylar_log_site; return sylar_log_site; }())
+
+#define MYLOG_EVERY_N(logger, level, n) \
+    SYLAR_LOG_GATED(logger, level, SYLAR_LOG_SITE(sylar::LogEveryN).admit(n, sylar_log_gate.suppressed)) \
+        << sylar::LogSuppressed(sylar_log_gate.suppressed)                                   // 第1, n+1, 2n+1 ... 次输出
+#define MYLOG_FIRST_N(logger, level, n) \
+    SYLAR_LOG_GATED(logger, level, SYLAR_LOG_SITE(sylar::LogFirstN).admit(n, sylar_log_gate.suppressed)) \
+        << sylar::LogFirstNDone(sylar_log_gate.suppressed)                                   // 只输出前 n 次(外加一条说明)
+#define MYLOG_EVERY_MS(logger, level, ms) \
+    SYLAR_LOG_GATED(logger, level, SYLAR_LOG_SITE(sylar::LogEveryMs).admit(ms, sylar_log_gate.suppressed)) \
+        << sylar::LogSuppressed(sylar_log_gate.suppressed)                                   // 每 ms 毫秒最多一条
+#define MYLOG_RATELIMITED(logger, level, rate, burst) \
+    SYLAR_LOG_GATED(logger, level, SYLAR_LOG_SITE(sylar::LogRateLimiter).admit(rate, burst, sylar_log_gate.suppressed)) \
+        << sylar::LogSuppressed(sylar_log_gate.suppressed)                                   // 令牌桶: 每秒 rate 条, 最多突发 burst 条
+
 
 
 namespace sylar {
@@ -56,10 +95,209 @@ public:
 
 class Logger;               // <把Logger放到这里的目的?> 在定义Logger之前的一些类会用到Logger，不加会报未定义错误
 
+/* ******************** 结构化字段 ********************
+ * LogStream::kv() 记下的一个键值对。数值按原类型保存, 到格式化(%J/%K/%V)时才转成文本;
+ * 键和字符串值拷贝在 LogStream 的 arena 里, 这里只存偏移。
+ */
+struct LogField {
+    enum Type {
+        INT64,
+        UINT64,
+        DOUBLE,
+        BOOL,
+        STRING
+    };
+    Type type;
+    uint32_t keyOff;            // 键在 arena 中的偏移
+    uint32_t keyLen;
+    uint32_t strOff;            // STRING: 值在 arena 中的偏移
+    uint32_t strLen;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        bool b;
+    } v;
+};
+
+/* ******************** 日志内容流(固定缓冲, 不分配内存) ********************
+ * 代替原来每条日志一个的 std::stringstream:
+ *  (1) 每个线程有一个预先分配好的 LogStream(内置 INLINE_SIZE 字节的缓冲), 日志事件创建时借用, 析构时归还,
+ *      所以几KB以内的日志从头到尾没有堆分配; 超出时才在堆上扩容(扩出来的缓冲会留着复用)。
+ *  (2) 整数/浮点/字符串走自己的快速路径直接拷进缓冲, 不经过 iostream 的 locale/num_put。
+ *  (3) 其他类型(YAML::Node, 枚举, 自定义了 operator<<(std::ostream&) 的类型) 以及 std::endl/std::hex 这类操纵符,
+ *      交给内部的 std::ostream 处理, 它写的也是同一块缓冲, 所以调用处的 << 写法完全不用改。
+ *  (4) 同一线程嵌套打日志(<< 的表达式里又打了日志), 或者协程在一条日志中途切走, 线程局部的缓冲被占用时, 退化为 new 一个。
+ *  (5) kv("user", id) 追加结构化字段, 和消息文本分开保存: MYLOG_INFO(g_logger).kv("user", id).kv("ok", true) << "login";
+ *      字段数组和 arena 跟缓冲一样随 LogStream 复用, 热身之后也不分配内存。
+ */
+class LogStream {
+public:
+    enum { INLINE_SIZE = 4096 };
+
+    LogStream();
+    ~LogStream();
+
+    const char* data() const            { return m_buf.data(); }
+    size_t size() const                 { return m_buf.size(); }
+    std::string str() const             { return std::string(data(), size()); }
+    std::ostream& ostream()             { return m_os; }                // 需要 std::ostream& 参数的地方(比如 dump(std::ostream&))可以用这个
+    void clear();                                                       // 清空内容并恢复默认格式(std::hex 之类不会带到下一条日志)
+
+    LogStream& append(const char* str, size_t len)  { m_buf.append(str, len); return *this; }
+
+    LogStream& operator<<(bool v)                   { return isDefaultFormat() ? append(v ? "1" : "0", 1) : fallback(v); }
+    LogStream& operator<<(char v)                   { return m_os.width() ? fallback(v) : append(&v, 1); }
+    LogStream& operator<<(short v)                  { return appendInteger(v); }
+    LogStream& operator<<(unsigned short v)         { return appendInteger(v); }
+    LogStream& operator<<(int v)                    { return appendInteger(v); }
+    LogStream& operator<<(unsigned int v)           { return appendInteger(v); }
+    LogStream& operator<<(long v)                   { return appendInteger(v); }
+    LogStream& operator<<(unsigned long v)          { return appendInteger(v); }
+    LogStream& operator<<(long long v)              { return appendInteger(v); }
+    LogStream& operator<<(unsigned long long v)     { return appendInteger(v); }
+    LogStream& operator<<(float v)                  { return appendDouble(v); }
+    LogStream& operator<<(double v)                 { return appendDouble(v); }
+    LogStream& operator<<(const char* v)            { return (v && !m_os.width()) ? append(v, strlen(v)) : fallback(v); }
+    LogStream& operator<<(char* v)                  { return *this << (const char*)v; }
+    LogStream& operator<<(const std::string& v)     { return m_os.width() ? fallback(v) : append(v.data(), v.size()); }
+    LogStream& operator<<(std::ostream& (*pf)(std::ostream&))       { pf(m_os); return *this; }    // std::endl, std::flush
+    LogStream& operator<<(std::ios_base& (*pf)(std::ios_base&))     { pf(m_os); return *this; }    // std::hex, std::fixed
+
+    template<class T>
+    LogStream& operator<<(const T& v)               { return fallback(v); }
+
+    /// 结构化字段, key 一般是字面量(会拷贝)
+    LogStream& kv(const char* key, bool v)                  { addField(key, LogField::BOOL).v.b = v; return *this; }
+    LogStream& kv(const char* key, char v)                  { return kv(key, &v, 1); }
+    LogStream& kv(const char* key, short v)                 { return kvInt(key, v); }
+    LogStream& kv(const char* key, unsigned short v)        { return kvInt(key, v); }
+    LogStream& kv(const char* key, int v)                   { return kvInt(key, v); }
+    LogStream& kv(const char* key, unsigned int v)          { return kvInt(key, v); }
+    LogStream& kv(const char* key, long v)                  { return kvInt(key, v); }
+    LogStream& kv(const char* key, unsigned long v)         { return kvInt(key, v); }
+    LogStream& kv(const char* key, long long v)             { return kvInt(key, v); }
+    LogStream& kv(const char* key, unsigned long long v)    { return kvInt(key, v); }
+    LogStream& kv(const char* key, float v)                 { addField(key, LogField::DOUBLE).v.d = v; return *this; }
+    LogStream& kv(const char* key, double v)                { addField(key, LogField::DOUBLE).v.d = v; return *this; }
+    LogStream& kv(const char* key, const char* v)           { return v ? kv(key, v, strlen(v)) : kv(key, "(null)", 6); }
+    LogStream& kv(const char* key, char* v)                 { return kv(key, (const char*)v); }
+    LogStream& kv(const char* key, const std::string& v)    { return kv(key, v.data(), v.size()); }
+    LogStream& kv(const char* key, const char* v, size_t len);
+
+    /// 其他类型在调用时就用 operator<<(std::ostream&) 转成字符串
+    template<class T>
+    LogStream& kv(const char* key, const T& v) {
+        size_t mark = size();
+        m_os << v;
+        return kvFromTail(key, mark);
+    }
+
+    const std::vector<LogField>& fields() const     { return m_fields; }
+    const char* fieldKey(const LogField& f) const   { return m_arena.data() + f.keyOff; }
+    const char* fieldStr(const LogField& f) const   { return m_arena.data() + f.strOff; }
+
+    static LogStream* Acquire();                    // 借用当前线程的缓冲(被占用时 new 一个)
+    static void Release(LogStream* stream);
+
+    /// 作用域内借用一个缓冲 (RAII)
+    struct Scoped {
+        Scoped() : stream(Acquire()) {}
+        ~Scoped() { Release(stream); }
+        LogStream* operator->() const   { return stream; }
+        LogStream& operator*() const    { return *stream; }
+        LogStream* stream;
+    };
+
+private:
+    LogStream(const LogStream&) = delete;
+    LogStream& operator=(const LogStream&) = delete;
+
+    /// 写进 m_inline 的 streambuf, 满了以后换成堆上的缓冲
+    class Buffer : public std::streambuf {
+    public:
+        Buffer();
+        ~Buffer();
+        const char* data() const        { return pbase(); }
+        size_t size() const             { return pptr() - pbase(); }
+        void append(const char* str, size_t len) {
+            if(len <= (size_t)(epptr() - pptr())) {
+                memcpy(pptr(), str, len);
+                pbump((int)len);
+            } else {
+                grow(len);
+                memcpy(pptr(), str, len);
+                pbump((int)len);
+            }
+        }
+        void reset();
+        void truncate(size_t n)         { pbump((int)n - (int)size()); }  // 退回到 n 字节(n <= size())
+    protected:
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+    private:
+        void grow(size_t need);
+    private:
+        char m_inline[INLINE_SIZE];
+        char* m_heap = nullptr;
+        size_t m_heapSize = 0;
+    };
+
+    bool isDefaultFormat() const    { return m_os.flags() == (std::ios_base::skipws | std::ios_base::dec) && m_os.width() == 0; }
+
+    template<class T>
+    LogStream& fallback(const T& v) { m_os << v; return *this; }
+
+    template<class T>
+    LogStream& appendInteger(T v) {
+        if(!isDefaultFormat()) {
+            return fallback(v);
+        }
+        char buf[24];
+        char* end = buf + sizeof(buf);
+        char* p = end;
+        typedef typename std::make_unsigned<T>::type U;
+        U u = v < 0 ? (U)(0 - (U)v) : (U)v;
+        do {
+            *--p = (char)('0' + u % 10);
+            u /= 10;
+        } while(u);
+        if(v < 0) {
+            *--p = '-';
+        }
+        return append(p, end - p);
+    }
+
+    LogStream& appendDouble(double v);
+
+    LogField& addField(const char* key, LogField::Type type);
+    LogStream& kvFromTail(const char* key, size_t mark);   // 把缓冲 mark 之后的内容挪成字符串字段
+
+    template<class T>
+    LogStream& kvInt(const char* key, T v) {
+        if(std::is_signed<T>::value) {
+            addField(key, LogField::INT64).v.i = (int64_t)v;
+        } else {
+            addField(key, LogField::UINT64).v.u = (uint64_t)v;
+        }
+        return *this;
+    }
+
+private:
+    Buffer m_buf;
+    std::ostream m_os;
+    std::vector<LogField> m_fields;                 // kv() 的字段
+    std::string m_arena;                            // 字段的键和字符串值
+    bool m_busy = false;                            // 是否被某个日志事件借用中
+    bool m_heapAllocated = false;                   // Acquire() 时 new 出来的, Release() 时 delete
+};
+
+
 /* ******************** 日志事件(日志的一些配置) ********************
  * 可以理解为产生的一条日志就是一个日志事件，实际产生一条日志，就是一个日志输出。所以要详细包含输出日志的详细信息
  */
 class LogEvent {
+friend class LogEventWrap;
 public:
     typedef std::shared_ptr<LogEvent> ptr;      // [智能指针]
 
@@ -71,7 +309,9 @@ public:
             uint32_t thread_id,                 // 线程id
             uint32_t fiber_id,                  // 协程id
             uint64_t time,                      // 日志事件(秒)
-            const std::string& thread_name);    // 线程名称             
+            const std::string& thread_name,     // 线程名称 (拷贝一份, 可以传临时对象)
+            uint32_t usec = 0);                 // 秒以下的部分(微秒), %e/%E/%Z 用
+    ~LogEvent();
 
     const char* getFile() const                 { return m_file; }
     int32_t getLine() const                     { return m_line; }
@@ -79,9 +319,14 @@ public:
     uint32_t getThreadId() const                { return m_threadId; }
     uint32_t getFiberId() const                 { return m_fiberId; }
     uint64_t getTime() const                    { return m_time; }
-    const std::string& getThreadName() const    { return m_threadName; }
-    const std::string getContent() const        { return m_ss.str(); }
-    std::stringstream& getSS()                  { return m_ss; }        // getStringStream();
+    uint32_t getUsec() const                    { return m_usec; }
+    const std::string& getThreadName() const    { return *m_threadName; }
+    std::string getContent() const              { return m_ss->str(); } // 会拷贝一次, 格式化时直接用 getSS().data()/size()
+    LogStream& getSS()                          { return *m_ss; }       // getStringStream();
+    const LogStream& getSS() const              { return *m_ss; }
+    template<class T>
+    LogEvent& kv(const char* key, const T& v)   { m_ss->kv(key, v); return *this; }    // 结构化字段, 见 LogStream::kv
+    const std::vector<LogField>& getFields() const  { return m_ss->fields(); }
     std::shared_ptr<Logger> getLogger() const   { return m_logger; }    // 查一下这个的目的和 logeventWrap 的用法目的。
     LogLevel::Level getLevel() const            { return m_level; }
 
@@ -92,10 +337,103 @@ private:
     uint32_t m_threadId = 0;                    // 线程ID
     uint32_t m_fiberId = 0;                     // 协程ID
     uint64_t m_time = 0;                        // 时间戳
-    std::string m_threadName;                   // 线程名
-    std::stringstream m_ss;                     // 日志内容流
+    uint32_t m_usec = 0;                        // 时间戳秒以下的微秒数
+    const std::string* m_threadName;            // 线程名: 指向 m_threadNameCopy, 或者宏传进来的线程局部的名字
+    std::string m_threadNameCopy;
+    LogStream* m_ss;                            // 日志内容流(从当前线程借来的缓冲)
     std::shared_ptr<Logger> m_logger;           // 日志器
     LogLevel::Level m_level;                    // 日志等级
+
+private:
+    /// LogEventWrap(MYLOG 宏)用: 只保存线程名的指针, 不拷贝; 调用方保证它比事件活得久(线程局部的名字)
+    LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse,
+             uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string* thread_name, uint32_t usec);
+    LogEvent(const LogEvent&) = delete;
+    LogEvent& operator=(const LogEvent&) = delete;
+};
+
+/// MYLOG 系列宏 for 循环里的状态
+struct LogSiteGate {
+    LogSiteGate(Logger* l) : ptr(l) {}
+    Logger* ptr;                                // 宏参数叫 logger, 这里不能同名
+    uint64_t suppressed = 0;                    // 放行这一条之前被限流掉的条数
+};
+
+/// 被限流掉的条数, 非0时输出 "[suppressed N] "
+struct LogSuppressed {
+    explicit LogSuppressed(uint64_t v) : count(v) {}
+    uint64_t count;
+};
+inline LogStream& operator<<(LogStream& os, const LogSuppressed& v) {
+    if(v.count) {
+        os << "[suppressed " << (unsigned long long)v.count << "] ";
+    }
+    return os;
+}
+
+/// FIRST_N 不再放行时的说明, 非0时输出 "[first N logged, suppressing the rest] "
+struct LogFirstNDone {
+    explicit LogFirstNDone(uint64_t v) : n(v) {}
+    uint64_t n;
+};
+inline LogStream& operator<<(LogStream& os, const LogFirstNDone& v) {
+    if(v.n) {
+        os << "[first " << (unsigned long long)v.n << " logged, suppressing the rest] ";
+    }
+    return os;
+}
+
+/// 每 n 次放行一次; 计数是连续的, 两次放行之间正好限流掉 n - 1 条
+class LogEveryN {
+public:
+    bool admit(uint64_t n, uint64_t& suppressed) {
+        if(n <= 1) {
+            return true;
+        }
+        uint64_t c = m_count.fetch_add(1, std::memory_order_relaxed);
+        if(c % n) {
+            return false;
+        }
+        suppressed = c ? n - 1 : 0;
+        return true;
+    }
+private:
+    std::atomic<uint64_t> m_count{0};
+};
+
+/// 只放行前 n 次; 第 n + 1 次也放行一次, 由 done(= n) 带出说明, 之后全部限流
+class LogFirstN {
+public:
+    bool admit(uint64_t n, uint64_t& done) {
+        if(!n || m_count.load(std::memory_order_relaxed) > n) {     // 快速路径: 已经满了只读不写
+            return false;
+        }
+        uint64_t c = m_count.fetch_add(1, std::memory_order_relaxed);
+        if(c == n) {
+            done = n;
+        }
+        return c <= n;
+    }
+private:
+    std::atomic<uint64_t> m_count{0};
+};
+
+/// 每 ms 毫秒最多放行一次
+class LogEveryMs {
+public:
+    bool admit(uint64_t ms, uint64_t& suppressed);
+private:
+    std::atomic<uint64_t> m_next{0};            // 下一次可以放行的时间(单调时钟, 微秒)
+    std::atomic<uint64_t> m_suppressed{0};
+};
+
+/// 令牌桶(用 GCRA 实现, 只需要一个原子变量): 平均每秒 rate 条, 最多连续 burst 条
+class LogRateLimiter {
+public:
+    bool admit(uint64_t rate, uint64_t burst, uint64_t& suppressed);
+private:
+    std::atomic<uint64_t> m_tat{0};             // 理论到达时间(单调时钟, 微秒)
+    std::atomic<uint64_t> m_suppressed{0};
 };
 
 /*
@@ -103,16 +441,26 @@ private:
  * 这里是实现 LogEvent 可以将自己写进logger吧，所以抽象了一个 Wrap，析构时自动写入
  * 所以这意思是logger是一个缓冲？然后wrap析构后一次性输出？
  * 这里解释一下为什么要用LogWarp 因为单纯的LogEvent无法使用流式调用了，所以用析构的方式将缓存的字符串输出
+ *
+ * 第二个构造函数把事件直接构造在 wrap 自己的存储里(MYLOG 宏用的就是它), 交给 appender 的 LogEvent::ptr 是不持有所有权的,
+ * 所以 appender 只能在 log() 调用期间使用 event, 不能把指针留下来(异步appender都是先格式化成文本再入队的)。
  */
 class LogEventWrap          //  logeventWrap 的用法目的: RAii
 {
 public:
     LogEventWrap(LogEvent::ptr event);
+    LogEventWrap(Logger* logger, LogLevel::Level level, const char* file, int32_t line,
+                 uint32_t elapse, uint32_t thread_id, uint32_t fiber_id, uint64_t time_us, const std::string& thread_name); // time_us: 微秒时间戳; 只引用 thread_name
     ~LogEventWrap();
-    std::stringstream& getSS();         // getStringStream();
+    LogStream& getSS();                 // getStringStream();
     LogEvent::ptr getEvent() const      { return m_event;   }
+private:
+    LogEventWrap(const LogEventWrap&) = delete;
+    LogEventWrap& operator=(const LogEventWrap&) = delete;
 private:
     LogEvent::ptr m_event;
+    bool m_inplace = false;                                                     // 事件是否构造在 m_storage 里
+    typename std::aligned_storage<sizeof(LogEvent), alignof(LogEvent)>::type m_storage;
 };
 
 
@@ -123,6 +471,13 @@ private:
  *      format():
  *          return      : 返回格式化日志文本
  *          param[in]   : ogger 日志器, level 日志级别, event 日志事件
+ *
+ * 编译: 不管是 init() 的字符串模式还是 init2() 的枚举模式, 构造时都把格式"编译"成一个扁平的 Op 数组,
+ *      format() 时按 Op 的 code 用 switch 直接往调用方给的 LogStream 缓冲里追加, 内置项没有虚函数调用, 也没有 stringstream。
+ *      只有通过 registerFormat() 注册的自定义项才走 FormatItem 的虚函数。
+ * 时间: %d{...} 按线程缓存同一秒内渲染好的文本(不用每条都 localtime_r); 秒以下用 %e(毫秒) / %E(微秒) 拼接, %Z 是 UTC 的 ISO-8601。
+ * 结构化: %J 整条日志输出成一个 JSON 对象, %K 输出成 logfmt(key=value ...), 都带上 kv() 的字段; %V 只输出字段(logfmt),
+ *      可以拼在普通的文本格式后面。转义直接写进输出缓冲。JSON 一行一条要自己加 %n: "%J%n"
  */
 class LogFormatter {
 public:
@@ -139,13 +494,21 @@ public:
         LineNumFormat,
         FiberIdFormat,
         TabFormat,
-        ThreadNameFormat
+        ThreadNameFormat,
+        MillisecondFormat,      // 毫秒(3位)
+        MicrosecondFormat,      // 微秒(6位)
+        ISO8601Format,          // UTC 的 ISO-8601 时间, 精确到毫秒: 2024-01-02T03:04:05.678Z
+        JsonFormat,             // 整条日志(含字段)一个 JSON 对象
+        LogfmtFormat,           // 整条日志(含字段) logfmt
+        FieldsFormat,           // 只有字段, logfmt
+        StringFormat            // 原样输出的文本, 内容就是 pair 的第二项
     };
 
     typedef std::shared_ptr<LogFormatter> ptr;
     LogFormatter(const std::string& pattern);
     LogFormatter(const std::vector<std::pair<LogPattern, std::string>>& patterns);
     std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    void format(LogStream& out, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event); // 追加到 out 中, 不分配内存
 public:
     class FormatItem {   // [类中类]
     public:
@@ -157,11 +520,20 @@ public:
     void init2();
     static std::map<LogPattern, std::function<FormatItem::ptr(const std::string&)>> s_c_format_items;
     void registerFormat(LogPattern pattern, std::function<FormatItem::ptr(const std::string&)> creator);
+private:
+    struct Op {
+        LogPattern code;
+        std::string arg;                                                                // StringFormat 的文本 / DateTimeFormat 的时间格式
+        uint64_t id = 0;                                                                // DateTimeFormat: 线程缓存里区分不同时间格式的编号
+        FormatItem::ptr item;                                                           // 自定义项(registerFormat 注册的), 非空时走虚函数
+    };
+    void compile(LogPattern pattern, const std::string& fmt);                           // 把一项格式编译成 Op 追加到 m_ops
+
 private:
     std::string m_pattern;                                                              // 解析格式
 //    std::vector<LogPattern> m_logpatterns;
     std::vector<std::pair<LogPattern, std::string>> m_logpatterns;
-    std::vector<FormatItem::ptr> m_items;                                               // 解析内容
+    std::vector<Op> m_ops;                                                              // 编译后的格式
 };
 
 /* ******************** 日志输出地 ********************
@@ -175,15 +547,36 @@ public:
     typedef std::shared_ptr<LogAppender> ptr;
 virtual ~LogAppender() {}                                                               // (1)为了便于该类的派生类调用，定义为[虚类]，
     virtual void log(std::shared_ptr<Logger> logger,LogLevel::Level level, LogEvent::ptr event) = 0;// [纯虚函数]，子类必须重写； 写入日志; 参数： 日志器，日志级别， 日志时间
+    /// Logger::log 对同一个formatter只格式化一次, 结果(data, len)给所有用这个formatter的appender共用。
+    /// 默认实现退回到 log() 自己再格式化一遍(兼容只重写了 log() 的appender), 内置的appender都直接使用 data
+    virtual void logFormatted(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len);
+    virtual void write(const char* data, size_t len) {}                                 // 直接写入已经格式化好的日志文本(异步appender批量输出时调用)
+    virtual void flush() {}                                                             // 把缓冲的内容刷到输出地
+    /// 不再使用时调用(比如重新加载配置换下来的): 写出缓冲, 停掉后台线程, 关闭文件, 注销崩溃钩子; 之后写进来的日志丢弃。
+    /// 包装类的 appender(异步/分片)连同目标appender一起关闭。默认实现: 注销崩溃钩子 + flush()
+    virtual void close();
 
-    void setLevel(LogLevel::Level level)            { m_level = level; } 
-    LogLevel::Level getLevel()                      { return m_level; }
+    /// 崩溃时(CrashHandler 的钩子里)调用, 不能加锁, 不能分配内存:
+    ///     crashWrite: 写一段已经格式化好的日志;  crashFlush: 写出还在内存里的日志, 最后写崩溃记录 record
+    virtual void crashWrite(const char* data, size_t len) {}
+    virtual void crashFlush(const char* record, size_t len)  { crashWrite(record, len); }
+    void hookCrash();                                                                   // 注册崩溃钩子(AddCrashHook), 有用户态缓冲的appender构造时调用
+    void unhookCrash();
+    bool isCrashHooked() const                      { return m_crashHooked; }
+
+    void setLevel(LogLevel::Level level)            { m_level.store(level, std::memory_order_relaxed); } 
+    LogLevel::Level getLevel() const                { return m_level.load(std::memory_order_relaxed); }
     void setFormatter(LogFormatter::ptr val)        { m_formatter = val; }              // 更改日志格式器
-    LogFormatter::ptr getFormatter() const          { return m_formatter; }             // 获取日志格式器
+    const LogFormatter::ptr& getFormatter() const   { return m_formatter; }             // 获取日志格式器
+
+protected:
+    void formatAndLog(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);  // 用 m_formatter 格式化到线程缓冲, 再调 logFormatted
+    static void OnCrash(void* arg);                                                     // 崩溃钩子: crashFlush(崩溃记录)
 
 protected:
-    LogLevel::Level m_level = LogLevel::DEBUG;                                          // 日志级别,为了便于子类访问该变量，设置在protected下(该日志级别必须初始化。犯过错误)
+    std::atomic<LogLevel::Level> m_level{LogLevel::DEBUG};                              // 日志级别,为了便于子类访问该变量，设置在protected下(该日志级别必须初始化。犯过错误); 运行时可改, 用原子变量
     LogFormatter::ptr m_formatter;                                                      // (2)定义输出格式
+    bool m_crashHooked = false;
 };
 
 /* ******************** 日志器 ********************
@@ -197,11 +590,22 @@ protected:
  *
  * log(level) 就是执行这个输出流程的。 考虑到不想每个输出都指定level, 可以特化出debug(), ... error()
  */
+/* ******************** 日志器 ********************
+ * 名字按 "." 分层: "system.scheduler" 的父日志器是 "system", "system" 的父日志器是 root(由 LoggerManager 建立)。
+ *  (1) 级别: 自己没设置(UNKNOW)就继承父日志器的; 生效的级别算好缓存在 m_effectiveLevel, MYLOG 宏每次只读这一个原子变量。
+ *  (2) appender: 自己的 appender 加上父日志器生效的 appender(additive 为 true 时, 默认), 同样算好缓存成一个快照。
+ *  (3) 改级别/appender/additive 时, 在全局的层级锁下重新计算自己和所有子孙的缓存, 打日志的路径上没有额外开销。
+ * 直接 new 出来的 Logger 没有父日志器, 和以前一样只用自己的级别和 appender。
+ */
 class Logger : public std::enable_shared_from_this<Logger>{ // [?]
+friend class LoggerManager;
 public:
     typedef std::shared_ptr<Logger> ptr;
+    typedef Mutex MutexType;
+    typedef std::vector<LogAppender::ptr> AppenderList;
     
     Logger(const std::string& name = "root");
+    ~Logger();
     void log(LogLevel::Level level, LogEvent::ptr event);
 
     // 不同级别的日志输出函数
@@ -213,21 +617,56 @@ public:
 
     void addAppender(LogAppender::ptr appender);                                        // 添加一个appender
     void delAppender(LogAppender::ptr appender);                                        // 删除一个appender
-    LogLevel::Level getLevel() const    { return m_level; }                             // [const放在函数后]
-    void setLevel(LogLevel::Level val)  { m_level = val; }                              // 设置级别
+    void clearAppenders();
+    void setAppenders(const AppenderList& appenders);                                  // 整个换掉(一次发布, 不会出现中间的空集合)
+    AppenderList getAppenders() const;                                                  // 自己的appender(快照的拷贝)
+    AppenderList getEffectiveAppenders() const;                                         // 实际输出到的(含继承的)
+    LogLevel::Level getLevel() const    { return m_effectiveLevel.load(std::memory_order_relaxed); }   // 生效的级别 [const放在函数后]
+    LogLevel::Level getOwnLevel() const { return m_level.load(std::memory_order_relaxed); }            // 自己设置的级别, UNKNOW 表示继承
+    void setLevel(LogLevel::Level val);                                                 // 设置级别, UNKNOW 改回继承父日志器
+    bool isAdditive() const             { return m_additive; }
+    void setAdditive(bool val);                                                         // false: 不再输出到祖先的appender
+    /// 一次设置级别、additive 和 appender(appenders 为 nullptr 时不换), 只刷新一次缓存, 返回换下来的 appender
+    AppenderList configure(LogLevel::Level level, bool additive, const AppenderList* appenders = nullptr);
+    Logger* getParent() const           { return m_parent; }
     const std::string& getName() const  { return m_name; }
+    void setFormatter(LogFormatter::ptr val);                                           // 之后添加的没有格式器的appender用这个
+    LogFormatter::ptr getFormatter() const;
+    static LogFormatter::ptr DefaultFormatter();                                        // 日志器默认的格式(构造时用, 配置里去掉 formatter 时恢复成它)
+private:
+    typedef std::vector<const AppenderList*> RetiredLists;                              // 换下来的快照, 出了层级锁再交给 Epoch::Retire
+    void publish(AppenderList* list, RetiredLists& retired);                            // 换上自己的新快照并刷新缓存, 需持有层级锁
+    void setParent(Logger* parent, RetiredLists& retired);                              // LoggerManager 建立层级时调用, 需持有层级锁
+    void refresh(RetiredLists& retired);                                                // 重新计算自己和子孙的生效级别/appender, 需持有层级锁
+    static void Retire(const RetiredLists& retired);
+    static MutexType& GetHierarchyMutex();                                              // 所有日志器共用: 改配置时才用, 不在打日志的路径上
 private:
     std::string m_name;                                                                 // 日志名称
-    LogLevel::Level m_level;                                                            // 级别
-    std::list<LogAppender::ptr> m_appender;                                             // Appender集合,引入list
+    std::atomic<LogLevel::Level> m_level;                                               // 自己设置的级别
+    std::atomic<LogLevel::Level> m_effectiveLevel;                                      // 生效的级别(缓存)
+    bool m_additive = true;                                                             // 是否同时输出到祖先的appender
+    Logger* m_parent = nullptr;                                                         // 父日志器, 由 LoggerManager 持有, 一直存活
+    std::vector<Logger*> m_children;                                                    // 子日志器, 刷新缓存时用
+    /// Appender集合: 不可变快照(写时复制)。log() 在 EpochGuard 里无锁读取当前快照; 修改时在层级锁下复制一份修改后发布,
+    /// 旧快照可能还有线程在遍历, 交给 Epoch::Retire, 等这些线程都离开了再释放
+    std::atomic<const AppenderList*> m_appenders;                                       // 自己的
+    std::atomic<const AppenderList*> m_effective;                                       // 生效的: 自己的 + 父日志器生效的(缓存)
     LogFormatter::ptr m_formatter;
 };
 
+/// MYLOG 宏用: 统一取裸指针
+inline Logger* GetLoggerPtr(const Logger::ptr& logger)  { return logger.get(); }
+inline Logger* GetLoggerPtr(Logger* logger)             { return logger; }
+
 /// ******************** 日志输出地（输出方法分类：输出到控制台的LogAppender） ********************
 class StdoutAppender : public LogAppender {
 public:
     typedef std::shared_ptr<StdoutAppender> ptr; 
     void log(Logger::ptr logger,LogLevel::Level level, LogEvent::ptr event) override;
+    void logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len) override;
+    void write(const char* data, size_t len) override;
+    void flush() override;
+    void crashWrite(const char* data, size_t len) override;
 private:
 };
 
@@ -235,25 +674,449 @@ private:
 class FileLogAppender : public LogAppender {
 public:
     typedef std::shared_ptr<FileLogAppender> ptr;
+    typedef Mutex MutexType;
+
+    enum RotateMode {
+        ROTATE_NONE,        // 不按时间滚动
+        ROTATE_HOURLY,      // 每个整点
+        ROTATE_DAILY        // 每天0点
+    };
+    enum FsyncPolicy {
+        FSYNC_NEVER,        // 只写到内核(进程崩溃不丢, 机器掉电可能丢)
+        FSYNC_ON_FLUSH,     // 显式 flush() 和滚动时 fdatasync
+        FSYNC_ALWAYS        // 每次把用户态缓冲写出后都 fdatasync
+    };
+
     FileLogAppender(const std::string& filename);                                       // 输出的文件名
+    ~FileLogAppender();
     void log(Logger::ptr logger,LogLevel::Level level, LogEvent::ptr event) override;   // [override]
+    void logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len) override;
+    void write(const char* data, size_t len) override;
+    void flush() override;                                                              // 写出用户态缓冲, 按 fsync 策略落盘
+    void close() override;                                                              // 写出缓冲并关闭文件, 之后 reopen()/写入都不再打开
     bool reopen();                                                                      // 重新打开文件，成功返回true
+    bool rotate();                                                                      // 立即滚动: 当前文件改名为 filename.1, 旧的依次后移
+    void crashWrite(const char* data, size_t len) override;                             // 放得下就追加到缓冲(保持顺序), 否则直接 write
+    void crashFlush(const char* record, size_t len) override;
+    void flushIdle();                                                                   // 后台刷盘线程调用: 缓冲里是上一秒(或更早)的内容就写出去
+
+    void setMaxSize(uint64_t v)                     { m_maxSize = v; }                  // 单个文件超过这么大就滚动, 0 不限制
+    void setRotateMode(RotateMode v);
+    void setMaxFiles(uint32_t v)                    { m_maxFiles = v; }                 // 保留几个旧文件(filename.1 ~ filename.N), 0 全部保留
+    void setBufferSize(size_t v);                                                       // 用户态缓冲大小, 0 每条直接 write
+                                                                                        // 缓冲的内容最多滞留约1秒(跨秒的写入, 或者后台线程每200ms检查一次时写出), ERROR 及以上立即写出
+    void setFsyncPolicy(FsyncPolicy v)              { m_fsyncPolicy = v; }
+    const std::string& getFilename() const          { return m_filename; }
+    uint64_t getFileSize() const                    { return m_fileSize; }
+    uint64_t getDropCount() const                   { return m_dropCount; }             // 因写文件失败(磁盘满, IO错误, 没打开)丢掉的行数
+    int getLastError() const                        { return m_lastError; }             // 最近一次写失败的 errno
+
+    /// 请求所有 FileLogAppender 在下一次写入时重新打开文件(外部 logrotate 改名之后用)。
+    /// 只改一个原子计数, 可以在信号处理函数里调用
+    static void RequestReopen();
+    static void InstallReopenHandler(int signum);                                        // 收到 signum (一般是 SIGHUP) 时 RequestReopen()
+private:
+    void append(const char* data, size_t len);                                          // 需持有 m_mutex
+    static void RegisterFlush(FileLogAppender* appender);
+    static void UnregisterFlush(FileLogAppender* appender);
+    bool flushBuffer();                                                                 // 需持有 m_mutex
+    bool writeFd(const char* data, size_t len);                                         // write(2) 直到写完(处理 EINTR/部分写入)
+    bool openFile();
+    void closeFile();
+    void shiftFiles();
+    void updateNextRotateTime(time_t now);
+private:
+    std::string m_filename;
+    int m_fd = -1;                                                                      // O_APPEND 打开, 多进程写同一个文件也不会互相覆盖
+    MutexType m_mutex;
+    std::vector<char> m_buffer;                                                         // 用户态写缓冲
+    size_t m_bufferUsed = 0;
+    uint64_t m_fileSize = 0;
+    uint64_t m_maxSize = 0;
+    RotateMode m_rotateMode = ROTATE_NONE;
+    time_t m_nextRotateTime = 0;                                                        // 按时间滚动的下一个时间点
+    time_t m_lastFlushTime = 0;                                                         // 上次写出缓冲的时间(秒)
+    uint32_t m_maxFiles = 0;
+    FsyncPolicy m_fsyncPolicy = FSYNC_NEVER;
+    uint32_t m_reopenGeneration = 0;                                                    // 和全局的重开请求计数比较
+    bool m_closed = false;                                                              // close() 过了
+    std::atomic<uint64_t> m_dropCount {0};
+    std::atomic<int> m_lastError {0};
+    bool m_errorReported = false;                                                       // 这一段连续失败已经报到 stderr 了
+    bool m_crashing = false;                                                            // 崩溃钩子里写: 不能用 iostream
+};
+
+/* ******************** 日志输出地（mmap 文件） ********************
+ * 文件按 chunk 预先扩展, 映射一段窗口(MAP_SHARED), 每条日志直接 memcpy 进映射区, 没有 write(2)。
+ * 写满一个窗口就往后挪一个 chunk。写进映射区的内容在页缓存里, 进程崩溃也不会丢(机器掉电要靠 flush()的 msync)。
+ * 文件尾部预扩展出来的部分是 0, close() 时截断到实际长度; 崩溃时通过 hookCrash() 注册的钩子截断
+ * (需要程序调用过 InstallCrashHandler())。同一个文件新建的 appender 会先关掉还在写的旧 appender 再接着写。
+ */
+class MmapFileLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<MmapFileLogAppender> ptr;
+    typedef Mutex MutexType;
+
+    MmapFileLogAppender(const std::string& filename, size_t chunk_size = 16 * 1024 * 1024);    // chunk_size 会取整到页大小
+    ~MmapFileLogAppender();
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    void logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len) override;
+    void write(const char* data, size_t len) override;
+    void flush() override;                                              // msync 已写的部分
+    void close() override;                                              // 解除映射并把文件截断到实际长度
+    void crashWrite(const char* data, size_t len) override;             // 只写当前窗口剩下的部分(信号处理函数里不能重新映射)
+    void crashFlush(const char* record, size_t len) override;           // 写崩溃记录, 把文件截断到实际长度
+
+    bool isOpen() const                         { return m_base != nullptr; }
+    uint64_t getFileSize() const                { return m_fileSize; }
+    const std::string& getFilename() const      { return m_filename; }
+private:
+    bool open();
+    void release();                                                     // close() 去掉登记以外的部分; 同一个文件新建的 appender 接管时调用
+    bool mapWindow(uint64_t offset);                                    // 扩展文件并映射 [offset, offset + chunk)
 private:
     std::string m_filename;
-    std::ofstream m_filestream;                                                         // stringstream要报错，引入sstream
+    size_t m_chunkSize;
+    int m_fd = -1;
+    char* m_base = nullptr;                                             // 当前窗口的起始地址
+    uint64_t m_mapOffset = 0;                                           // 当前窗口在文件中的偏移
+    size_t m_mapPos = 0;                                                // 窗口内已写到的位置
+    std::atomic<uint64_t> m_fileSize;                                   // 实际内容长度(崩溃钩子里读)
+    MutexType m_mutex;
+};
+
+/* ******************** 有界多生产者单消费者环形队列(无锁) ********************
+ * 异步日志用的队列: 多个业务线程(生产者)并发 push 已格式化的日志, 只有一个刷盘线程(消费者) pop。
+ * 每个槽位带一个序号 seq (Dmitry Vyukov 的 bounded queue 思路):
+ *      seq == pos      : 槽位空闲, 生产者可以抢占 pos
+ *      seq == pos + 1  : 槽位已写好, 消费者可以读取
+ * 生产者之间只在 m_enqueuePos 上做一次 CAS, 没有锁; 槽位里的 std::string 复用容量, 稳定运行后不再分配内存
+ */
+class LogRingBuffer {
+public:
+    LogRingBuffer(size_t capacity);                     // capacity 会向上取整到2的幂
+    ~LogRingBuffer();
+
+    bool tryPush(LogLevel::Level level, std::string& msg);  // 队列满返回false; 成功时 msg 与槽位内容交换(拿回旧的缓冲复用)
+    bool tryPop(std::string& out);                      // (仅消费者线程调用) 追加一条日志到 out, 队列空返回false
+    bool empty() const;                                 // (仅消费者线程调用)
+    /// 崩溃时用: 按顺序访问还没被取走的日志, 不修改队列
+    void visitPending(void (*visit)(void* arg, const char* data, size_t len), void* arg) const;
+    size_t capacity() const         { return m_mask + 1; }
+
+private:
+    LogRingBuffer(const LogRingBuffer&) = delete;
+    LogRingBuffer& operator=(const LogRingBuffer&) = delete;
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        LogLevel::Level level;
+        std::string msg;
+    };
+
+private:
+    Cell* m_cells = nullptr;
+    size_t m_mask = 0;
+    char m_pad0[64];                                    // 生产者和消费者的下标放在不同的cache line, 避免伪共享
+    std::atomic<size_t> m_enqueuePos;
+    char m_pad1[64];
+    size_t m_dequeuePos = 0;
+};
+
+/* ******************** 单生产者单消费者字节环形缓冲(无锁) ********************
+ * 线程私有的日志缓冲用它(ShardedLogAppender 的分片, 二进制日志的 StagingBuffer): 生产者是拥有它的线程, 消费者是后台线程。
+ * 一条记录: [长度 4][填充 4][数据], 按8字节对齐(数据的起始地址也是8字节对齐的);
+ * 尾部放不下一条记录时写一个填充标记, 消费者读到它直接跳回开头。
+ */
+class SpscByteRing {
+public:
+    static const uint32_t PAD_MARKER = 0xFFFFFFFF;
+    static const size_t HEADER_SIZE = 8;
+
+    SpscByteRing(size_t capacity);                      // capacity 会向上取整到2的幂(至少64)
+    ~SpscByteRing();
+
+    /// (生产者) 预留 len 字节, 写完后 commit; 空间不够就让出CPU等消费者, 每等一次 ++*waits。
+    /// 等待期间 *abort 变为 true(消费者不会再来了)就放弃, 返回 nullptr
+    char* reserve(size_t len, const std::atomic<bool>* abort = nullptr, uint64_t* waits = nullptr);
+    void commit()                   { m_head.store(m_reserveHead, std::memory_order_release); }
+
+    /// (消费者) 最早的一条, 没有返回 nullptr; 读完用 pop 丢掉
+    const char* peek(size_t& len);
+    void pop(size_t len);
+    /// (消费者) 按顺序对已提交的每条记录调用 cb(data, len), 最后一次性归还空间, 返回条数
+    template<class CB>
+    size_t drain(CB cb) {
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        size_t count = 0;
+        while(tail < head) {
+            size_t off = tail & m_mask;
+            uint32_t len;
+            memcpy(&len, m_storage + off, 4);
+            if(len == PAD_MARKER) {
+                tail += m_mask + 1 - off;
+                continue;
+            }
+            cb(m_storage + off + HEADER_SIZE, (size_t)len);
+            tail += RecordSize(len);
+            ++count;
+        }
+        m_tail.store(tail, std::memory_order_release);
+        return count;
+    }
+
+    bool empty() const              { return m_tail.load(std::memory_order_relaxed) == m_head.load(std::memory_order_acquire); }
+    size_t capacity() const         { return m_mask + 1; }
+    static size_t RecordSize(size_t len)    { return (HEADER_SIZE + len + 7) & ~(size_t)7; }
+
+private:
+    SpscByteRing(const SpscByteRing&) = delete;
+    SpscByteRing& operator=(const SpscByteRing&) = delete;
+
+private:
+    char* m_storage = nullptr;
+    size_t m_mask = 0;
+    char m_pad0[64];
+    std::atomic<uint64_t> m_head;                       // 生产者写到的位置(单调递增)
+    uint64_t m_reserveHead = 0;                         // reserve 后 commit 要发布的位置
+    char m_pad1[64];
+    std::atomic<uint64_t> m_tail;                       // 消费者读到的位置
+    char m_pad2[64];
+};
+
+/* ******************** 日志输出地（异步: 后台线程批量刷到目标appender） ********************
+ * 业务线程只负责格式化 + 放进无锁队列, 真正的 write 由专门的刷盘线程(sylar::Thread)批量完成,
+ * 这样磁盘卡顿不会拖慢处理请求的线程。 用法:
+ *      logger->addAppender(AsyncLogAppender::ptr(new AsyncLogAppender(FileLogAppender::ptr(new FileLogAppender("a.log")))));
+ *
+ * 队列满时的背压策略(OverflowPolicy):
+ *      BLOCK           : 生产者等待队列腾出空间, 不丢日志
+ *      DROP            : 直接丢弃, 计入 getDropCount()
+ *      DROP_BELOW_LEVEL: 低于 drop_level 的日志丢弃, 不低于它的(比如ERROR)等待
+ */
+class AsyncLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<AsyncLogAppender> ptr;
+    enum OverflowPolicy {
+        BLOCK = 0,
+        DROP = 1,
+        DROP_BELOW_LEVEL = 2
+    };
+
+    AsyncLogAppender(LogAppender::ptr appender,                         // 目标appender(真正写日志的地方)
+                     size_t capacity = 8192,                            // 队列容量(条)
+                     OverflowPolicy policy = BLOCK,
+                     LogLevel::Level drop_level = LogLevel::WARN,       // DROP_BELOW_LEVEL 时的分界级别
+                     size_t batch_size = 256);                          // 刷盘线程一次最多合并多少条
+    ~AsyncLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    void logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len) override;
+    void flush() override;                                              // 等待已入队的日志全部写出, 并flush目标appender
+    void stop();                                                        // 停止刷盘线程(会先写完队列中剩余的日志)
+    void close() override;                                              // stop() 并关闭目标appender
+    void crashWrite(const char* data, size_t len) override;
+    void crashFlush(const char* record, size_t len) override;           // 刷盘线程手里的一批 + 队列里的 + 崩溃记录, 都交给目标appender的 crashWrite
+
+    LogAppender::ptr getAppender() const    { return m_appender; }
+    OverflowPolicy getPolicy() const        { return m_policy; }
+    uint64_t getDropCount() const           { return m_dropCount; }     // 因队列满或已停止被丢弃的条数
+    uint64_t getBlockCount() const          { return m_blockCount; }    // 因队列满而等待过的次数
+    uint64_t getWriteCount() const          { return m_writeCount; }    // 已写到目标appender的条数
+
+private:
+    void run();                                                         // 刷盘线程
+    size_t writeBatch();                                                // 从队列取一批写到目标appender, 返回条数
+    void wakeup();                                                      // 刷盘线程在睡眠时唤醒它
+    void notifyFlushWaiters();                                          // 唤醒在 flush() 里等待的线程
+    static void CrashVisit(void* arg, const char* data, size_t len);
+
+private:
+    LogAppender::ptr m_appender;
+    LogRingBuffer m_queue;
+    OverflowPolicy m_policy;
+    LogLevel::Level m_dropLevel;
+    size_t m_batchSize;
+
+    std::atomic<bool> m_waiting {false};                                // 刷盘线程是否在等信号量
+    std::atomic<bool> m_stopping {false};
+    std::atomic<uint64_t> m_pushCount {0};
+    std::atomic<uint64_t> m_writeCount {0};
+    std::atomic<uint64_t> m_dropCount {0};
+    std::atomic<uint64_t> m_blockCount {0};
+    std::atomic<uint32_t> m_producers {0};                              // 正在 logFormatted 里的生产者数
+    std::atomic<uint32_t> m_flushWaiters {0};                           // 在 m_flushSemaphore 上等写出的 flush() 调用数
+    std::atomic<bool> m_stopped {false};                                // stop() 已写完全部日志
+    Semaphore m_semaphore;
+    Semaphore m_flushSemaphore;
+    Mutex m_writeMutex;                                                 // 刷盘线程写目标appender 与 flush() 互斥
+    Thread::ptr m_thread;
+    std::string m_batch;                                                // 刷盘线程从队列取出来、正在写的一批
+    std::atomic<bool> m_batchBusy {false};                              // m_batch 里有没写完的日志
+    bool m_innerHooked = false;                                         // 目标appender原来注册了崩溃钩子(由本appender接管, 保证顺序)
+};
+
+/* ******************** 日志输出地（按线程分片, 按时间戳归并） ********************
+ * 每个线程一个私有的单生产者单消费者缓冲(LogShard), 业务线程写日志时只碰自己的缓冲:
+ * 没有共享的队列, 锁或原子计数, 几十个核同时打日志也不会在同一条 cache line 上竞争。
+ * 一个归并线程定期取出所有分片里的日志, 按事件时间戳做 k 路归并(小根堆), 合成一批写到目标appender。
+ * 晚提交的分片里可能还有更早时间戳的日志, 所以归并线程只输出早于 "现在 - merge_delay_ms" 的(正在等分片空间的线程也会压低这个界限);
+ * 从打日志到写进分片超过 merge_delay_ms 的(比如线程被切走)可能排在稍晚的日志后面。flush() 时全部输出。
+ * stop() 之后(以及停止时分片已满)的日志直接写到目标appender, 不经过分片。
+ * Scheduler 的工作线程启动时调用 RegisterThread() 预先建好分片; 其他线程第一次写日志时创建, 线程退出后写空释放。
+ *      logger->addAppender(ShardedLogAppender::ptr(new ShardedLogAppender(FileLogAppender::ptr(new FileLogAppender("a.log")))));
+ */
+class LogShard;
+class ShardedLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<ShardedLogAppender> ptr;
+    typedef Mutex MutexType;
+
+    ShardedLogAppender(LogAppender::ptr appender,                       // 目标appender
+                       size_t shard_size = 256 * 1024,                  // 每个线程的缓冲大小(字节)
+                       uint32_t merge_delay_ms = 2);                    // 归并时等待迟到日志的时间
+    ~ShardedLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    void logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len) override;
+    void flush() override;                                              // 归并输出所有分片里的日志, 并flush目标appender
+    void stop();                                                        // 停止归并线程(会先写完剩下的日志)
+    void close() override;                                              // stop() 并关闭目标appender
+    void crashWrite(const char* data, size_t len) override;
+    void crashFlush(const char* record, size_t len) override;
+
+    LogAppender::ptr getAppender() const    { return m_appender; }
+    size_t getShardCount();
+    uint64_t getWriteCount() const          { return m_writeCount; }    // 已写到目标appender的条数
+    uint64_t getWaitCount() const           { return m_waitCount; }     // 分片满了生产者等待的次数
+
+    /// 在所有 ShardedLogAppender 里给当前线程建好分片(Scheduler 工作线程启动时调用)
+    static void RegisterThread();
+
+private:
+    LogShard* getShard();                                               // 当前线程的分片, 没有就创建
+    size_t merge(bool all);                                             // 归并一轮; all=false 时只输出早于 merge_delay 的
+    void run();
+
+private:
+    uint64_t m_id;                                                      // 线程局部的分片表用它区分appender(不会复用)
+    LogAppender::ptr m_appender;
+    size_t m_shardSize;
+    uint64_t m_mergeDelayUs;
+    MutexType m_mutex;                                                  // 只保护 m_shards 的增删(每个线程只在创建分片时拿一次)
+    std::vector<std::shared_ptr<LogShard> > m_shards;
+    MutexType m_mergeMutex;                                             // 归并线程和 flush() 互斥: 每个分片只能有一个消费者
+    std::vector<std::shared_ptr<LogShard> > m_active;                   // 本轮参与归并的分片(归并线程用, 容量复用)
+    std::vector<std::pair<uint64_t, size_t> > m_heap;                   // (时间戳, 分片下标) 小根堆
+    std::string m_batch;
+    std::atomic<bool> m_stopping {false};
+    std::atomic<uint64_t> m_writeCount {0};
+    std::atomic<uint64_t> m_waitCount {0};
+    bool m_innerHooked = false;
+    Thread::ptr m_thread;
+};
+
+/* ******************** 日志输出地（unix 域套接字, 发给本机的日志收集 agent） ********************
+ * 业务线程只把格式化好的日志追加到内存缓冲(加锁拷贝一次), 发送线程把攒下的一批整体换出来再发:
+ *      STREAM: 日志按行拼在一起, 一次 send 发一整批(部分发送接着发剩下的); 发到一条中间断开的, 这条整条写进 spill 文件,
+ *              agent 收到的最后半条没有换行结尾, 应该丢掉;
+ *      DGRAM : 一条日志一个数据报, 用 sendmmsg 一次系统调用发多条。
+ * 连接断开或 agent 没启动时, 发送线程写到 spill_file(一个 FileLogAppender, 没配置就丢弃并计数),
+ * 每隔 reconnect_interval_ms 重连一次; 重连和发送都只在发送线程里做, 业务线程不会被卡住。
+ * 缓冲超过 max_buffer 字节(agent 太慢)时新日志直接丢弃, 计入 getDropCount()。
+ *      logger->addAppender(UnixSocketLogAppender::ptr(new UnixSocketLogAppender("/run/agent/log.sock")));
+ */
+class UnixSocketLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<UnixSocketLogAppender> ptr;
+    typedef Mutex MutexType;
+    enum SocketType {
+        STREAM = 0,
+        DGRAM = 1
+    };
+
+    UnixSocketLogAppender(const std::string& path,                      // agent 监听的套接字路径
+                          SocketType type = STREAM,
+                          const std::string& spill_file = "",           // 连不上时写到的文件, 空: 丢弃
+                          size_t max_buffer = 4 * 1024 * 1024,          // 待发送缓冲的上限(字节)
+                          uint32_t reconnect_interval_ms = 1000);
+    ~UnixSocketLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    void logFormatted(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event, const char* data, size_t len) override;
+    void write(const char* data, size_t len) override;
+    void flush() override;                                              // 等发送线程处理完已经追加的日志
+    void stop();                                                        // 停止发送线程(会先处理完缓冲里的日志)
+    void close() override;                                              // stop(), 断开连接, 关闭 spill 文件
+    void crashWrite(const char* data, size_t len) override;             // STREAM 连着就直接 send, 否则写 spill 文件
+    void crashFlush(const char* record, size_t len) override;           // 发送线程手里的 + 缓冲里的 + 崩溃记录
+
+    const std::string& getPath() const      { return m_path; }
+    bool isConnected() const                { return m_fd >= 0; }
+    uint64_t getSendCount() const           { return m_sendCount; }     // 发给 agent 的条数
+    uint64_t getSpillCount() const          { return m_spillCount; }    // 写到 spill 文件的条数
+    uint64_t getDropCount() const           { return m_dropCount; }     // 丢弃的条数(缓冲满/连不上又没有 spill 文件)
+    uint64_t getConnectCount() const        { return m_connectCount; }  // 连接成功的次数(含重连)
+
+private:
+    void run();                                                         // 发送线程
+    void deliver();                                                     // 发送 m_sending 里的一批, 发不出去的 spill
+    bool connect();
+    void disconnect();
+    size_t sendStream();                                                // 返回发出去的条数, 出错断开连接
+    size_t sendDgram();
+    void spill();                                                       // 这一批从 m_sendingOffset(出错时退回到记录开头)开始没发出去的, 写到 spill 文件(或丢弃)
+    bool crashSend(const char* data, size_t len);
+
+private:
+    std::string m_path;
+    SocketType m_type;
+    size_t m_maxBuffer;
+    uint64_t m_reconnectIntervalUs;
+    FileLogAppender::ptr m_spill;
+    std::atomic<int> m_fd {-1};
+    uint64_t m_nextConnectTime = 0;                                     // 单调时钟(微秒), 早于它不重连
+
+    MutexType m_mutex;                                                  // 保护 m_pending 这一组
+    std::string m_pending;                                              // 业务线程追加
+    std::vector<uint32_t> m_pendingLens;                                // 每条的长度(DGRAM 按它切分, 也用来计条数)
+    bool m_waiting = false;                                             // 发送线程在等信号量
+    bool m_stopping = false;
+    uint64_t m_pushCount = 0;
+
+    std::string m_sending;                                              // 发送线程换出来的一批(和 m_pending 交换, 容量复用)
+    std::vector<uint32_t> m_sendingLens;
+    std::atomic<size_t> m_sendingOffset {0};                            // 这一批已经处理到的字节(崩溃时从这里写)
+    std::atomic<bool> m_sendingBusy {false};
+    std::atomic<uint64_t> m_doneCount {0};
+    std::atomic<uint64_t> m_sendCount {0};
+    std::atomic<uint64_t> m_spillCount {0};
+    std::atomic<uint64_t> m_dropCount {0};
+    std::atomic<uint64_t> m_connectCount {0};
+    Semaphore m_semaphore;
+    Thread::ptr m_thread;
 };
 
 /// ******************** 日志管理器类 ********************
+/// 名字到日志器的表是写时复制的快照: getLogger 命中时无锁查找; 没有才加锁创建(连同缺的上级, "a.b.c" 会建出 "a" 和 "a.b"),
+/// 复制一份表发布出去。旧的表可能还有线程在查, 留到析构时再释放(日志器一般在静态初始化时创建, 数量很少)
 class LoggerManager 
 {
 public:
+    typedef Mutex MutexType;
+    typedef std::unordered_map<std::string, Logger::ptr> LoggerMap;
+
     LoggerManager();                                // 构造函数
-    Logger::ptr getLogger(const std::string& name); // 获取日志器(日志器名称)
-    Logger::ptr getRoot()       { return m_root; }  // 返回主日志器
+    ~LoggerManager();
+    Logger::ptr getLogger(const std::string& name); // 获取日志器(日志器名称), 没有就创建; "" 和 "root" 返回主日志器
+    Logger::ptr findLogger(const std::string& name) const;  // 只查找, 没有返回 nullptr
+    const Logger::ptr& getRoot() const  { return m_root; }  // 返回主日志器(返回引用, 宏里每次取不用增减引用计数)
     // std::string toYamlString();                  // 将所有的日志器配置转成YAML String
 
 private:
-    std::map<std::string, Logger::ptr> m_loggers;   // 日志容器
+    std::atomic<const LoggerMap*> m_loggers;        // 日志容器(快照), 在 EpochGuard 里读, 换下来的交给 Epoch::Retire
+    MutexType m_mutex;                              // 只在创建日志器时使用
     Logger::ptr m_root;                             // 主日志器
 };
 
@@ -210,6 +210,7 @@ void Scheduler::waitForWorkerThreads()
  */
 void Scheduler::run()   // 实际在run 函数中运行的都是各自的线程中，所以setCurrentScheduler() 都是设置的各自线程的参数
 {
+    ShardedLogAppender::RegisterThread();            // 工作线程的日志分片在这里建好, 不用等第一条日志
     MYLOG_INFO(g_logger) << m_name << " run";
 //    set_hook_enable(true);
     setCurrentScheduler();                          /*1. 设置当前线程的scheduler, 就是运行任务线程的线程局部变量都有t_scheduler参数，都把每个线程的t_scheduler设置为 调度器实例*/
@@ -342,7 +343,7 @@ void Scheduler::run()   // 实际在run 函数中运行的都是各自的线程
             }
             if(idle_fiber->getState() == Fiber::TERM)
              {
-                MYLOG_INFO(g_logger) << "idle fiber term";
+                MYLOG_DEBUG(g_logger) << "idle fiber term";
                 break;
             }
 
@@ -357,7 +358,7 @@ void Scheduler::run()   // 实际在run 函数中运行的都是各自的线程
     }
 }
 
-void Scheduler::tickle() { MYLOG_INFO(g_logger) << "tickle"; }
+void Scheduler::tickle() { MYLOG_DEBUG(g_logger) << "tickle"; }
 
 bool Scheduler::stopping()
 {
@@ -367,7 +368,7 @@ bool Scheduler::stopping()
 
 void Scheduler::idle()
 {
-    MYLOG_INFO(g_logger) << "idle";
+    MYLOG_DEBUG(g_logger) << "idle";
     while(!stopping())
         sylar::Fiber::YieldToHold();
 }
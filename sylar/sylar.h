@@ -3,6 +3,7 @@
 
 #include "thread.h"
 #include "log.h"
+#include "binlog.h"
 #include "util.h"
 #include "singleton.h"
 #include "config.h"
@@ -1,6 +1,11 @@
 #include "thread.h"
 #include "log.h"
 #include "util.h"
+#include <algorithm>
+#include <vector>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
 
 namespace sylar {
 
@@ -53,6 +58,7 @@ void* Thread::run(void *args)                           // 参数就是 pthread_
     t_thread_name = thread->m_name;                     // (2). t_thread_name = thread->m_name; 不放在构造函数中，为什么？
     thread->m_id = sylar::GetThreadId();
     pthread_setname_np(pthread_self(), thread->m_name.substr(0,15).c_str());    // 给这个线程pthread_t的线程命名，修改完了线程名以后。top命令中显示的名就变了
+    InstallAltStack();                                  // 崩溃处理函数在备用信号栈上运行, 协程栈溢出也能打印出来
 
     std::function<void()> cb;
     cb.swap(thread->m_callback);
@@ -60,8 +66,7 @@ void* Thread::run(void *args)                           // 参数就是 pthread_
     thread->m_semaphore.notify();
 
     cb();
-    MYLOG_INFO(SYLAR_LOG_ROOT()) << "name=" << sylar::GetThreadId() << "; = " << pthread_self();
-    return 0;
+    return 0;                                           // 这里不再打日志: 日志系统自己的后台线程(异步刷盘)退出时, 日志器可能正在析构
 }
 
 Semaphore::Semaphore(uint32_t count)
@@ -81,12 +86,214 @@ void Semaphore::wait()
         throw std::logic_error("sem_wait error");
 }
 
+bool Semaphore::waitFor(uint32_t ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);                 // sem_timedwait 只认 CLOCK_REALTIME 的绝对时间
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000l;
+    if(ts.tv_nsec >= 1000000000l) {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000l;
+    }
+    if(sem_timedwait(&m_semaphore, &ts)) {
+        if(errno != ETIMEDOUT && errno != EINTR)
+            throw std::logic_error("sem_timedwait error");
+        return false;
+    }
+    return true;
+}
+
 void Semaphore::notify()
 {
     if(sem_post(&m_semaphore))
         throw std::logic_error("sem_post error");
 }
 
+/* ******************** Epoch ******************** */
+namespace {
+
+struct alignas(64) EpochSlot                            // 一个读者线程一个, 独占缓存行, 读者之间不抢同一行
+{
+    std::atomic<uint64_t> epoch;                        // 0: 不在读; 否则是进来时看到的全局纪元
+    std::atomic<bool> used;
+};
+
+EpochSlot s_epochSlots[Epoch::kMaxSlots];               // 全是原子量, 静态初始化为 0: 别的静态对象构造时也能用
+std::atomic<uint64_t> s_globalEpoch{1};
+std::atomic<uint64_t> s_overflowReaders{0};             // 没抢到槽位还在读的线程数, 不为 0 时什么都不释放
+
+struct EpochRetired
+{
+    void* ptr;
+    void (*deleter)(void*);
+    uint64_t epoch;                                     // 换下来之后的纪元: 所有读者的纪元都比它大才能释放
+};
+
+struct EpochRetiredList
+{
+    Mutex mutex;
+    std::vector<EpochRetired> items;
+};
+
+EpochRetiredList& GetRetiredList()                      // 故意不析构: 进程退出时别的静态对象析构还会 Retire
+{
+    static EpochRetiredList* s_list = new EpochRetiredList;
+    return *s_list;
+}
+
+struct EpochLocal
+{
+    int slot = -1;                                      // -1: 还没分配; -2: 没有槽位或者线程正在退出, 用共享计数
+    int depth = 0;
+    ~EpochLocal()
+    {
+        if(slot >= 0) {
+            s_epochSlots[slot].epoch.store(0, std::memory_order_release);
+            s_epochSlots[slot].used.store(false, std::memory_order_release);
+        }
+        slot = -2;                                      // 之后析构的 thread_local 对象里再打日志, 走共享计数
+    }
+};
+
+thread_local EpochLocal t_epoch;
+
+int AllocEpochSlot()
+{
+    static int s_atfork = pthread_atfork(                 // 子进程里只剩 fork 的线程: 别的线程的槽位全部作废
+        []() { GetRetiredList().mutex.lock(); },
+        []() { GetRetiredList().mutex.unlock(); },
+        []() {
+            GetRetiredList().mutex.unlock();
+            for(size_t i = 0; i < Epoch::kMaxSlots; ++i) {
+                if((int)i != t_epoch.slot) {
+                    s_epochSlots[i].epoch.store(0, std::memory_order_relaxed);
+                    s_epochSlots[i].used.store(false, std::memory_order_relaxed);
+                }
+            }
+            s_overflowReaders.store(t_epoch.slot < 0 && t_epoch.depth > 0 ? 1 : 0);
+        });
+    (void)s_atfork;
+    for(size_t i = 0; i < Epoch::kMaxSlots; ++i) {
+        bool expect = false;
+        if(!s_epochSlots[i].used.load(std::memory_order_relaxed)
+                && s_epochSlots[i].used.compare_exchange_strong(expect, true)) {
+            return i;
+        }
+    }
+    return -2;
+}
+
+/// 所有正在读的读者里最小的纪元; 没有读者返回 UINT64_MAX
+uint64_t MinActiveEpoch(int skip_slot)
+{
+    if(s_overflowReaders.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    uint64_t rt = UINT64_MAX;
+    for(size_t i = 0; i < Epoch::kMaxSlots; ++i) {
+        if((int)i == skip_slot) {
+            continue;
+        }
+        uint64_t e = s_epochSlots[i].epoch.load(std::memory_order_acquire);
+        if(e && e < rt) {
+            rt = e;
+        }
+    }
+    return rt;
+}
+
+/// 释放所有读者都已经离开的对象; item 不为空时先把它加进去
+void ReclaimEpoch(const EpochRetired* item)
+{
+    std::vector<EpochRetired> frees;
+    {
+        EpochRetiredList& list = GetRetiredList();
+        Mutex::Lock lock(list.mutex);
+        if(item) {
+            list.items.push_back(*item);
+        }
+        uint64_t min_epoch = MinActiveEpoch(-1);
+        auto it = std::partition(list.items.begin(), list.items.end(),
+                                 [min_epoch](const EpochRetired& r) { return r.epoch >= min_epoch; });
+        frees.assign(it, list.items.end());
+        list.items.erase(it, list.items.end());
+    }
+    for(auto& i : frees) {                                  // 锁外释放: 析构函数里可能还会 Retire
+        i.deleter(i.ptr);
+    }
+}
+
+}
+
+void Epoch::Enter()
+{
+    EpochLocal& local = t_epoch;
+    if(local.depth++) {
+        return;
+    }
+    if(local.slot == -1) {
+        local.slot = AllocEpochSlot();
+    }
+    if(local.slot >= 0) {
+        s_epochSlots[local.slot].epoch.store(s_globalEpoch.load(std::memory_order_relaxed), std::memory_order_release);
+    } else {
+        s_overflowReaders.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);    // 先登记纪元, 再读共享指针; 和 Retire 里的 fence 配对
+}
+
+void Epoch::Leave()
+{
+    EpochLocal& local = t_epoch;
+    if(--local.depth) {
+        return;
+    }
+    if(local.slot >= 0) {
+        s_epochSlots[local.slot].epoch.store(0, std::memory_order_release);
+    } else {
+        s_overflowReaders.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void Epoch::Retire(void* p, void (*deleter)(void*))
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);    // 调用方已经换掉了指针; 之后进来的读者看不到 p
+    EpochRetired item{p, deleter, s_globalEpoch.fetch_add(1)};
+    ReclaimEpoch(&item);
+}
+
+void Epoch::Synchronize()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t epoch = s_globalEpoch.fetch_add(1);
+    int self = t_epoch.slot;
+    uint64_t self_overflow = self < 0 && t_epoch.depth > 0 ? 1 : 0;
+    for(size_t i = 0; i < kMaxSlots; ++i) {
+        if((int)i == self) {
+            continue;
+        }
+        while(true) {
+            uint64_t e = s_epochSlots[i].epoch.load(std::memory_order_acquire);
+            if(e == 0 || e > epoch) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    while(s_overflowReaders.load(std::memory_order_acquire) > self_overflow) {
+        sched_yield();
+    }
+    ReclaimEpoch(nullptr);                                  // 顺便释放等到的这些读者还占着的对象
+}
+
+size_t Epoch::Pending()
+{
+    EpochRetiredList& list = GetRetiredList();
+    Mutex::Lock lock(list.mutex);
+    return list.items.size();
+}
+
 //#include "sylar/sylar.h"
 
 //void func1(){
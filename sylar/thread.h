@@ -12,6 +12,7 @@
 #include <string>
 #include <semaphore.h>
 #include <stdint.h>
+#include <atomic>
 
 
 namespace sylar {
@@ -23,6 +24,7 @@ public:
     ~Semaphore();
 
     void wait();
+    bool waitFor(uint32_t ms);                                  // 最多等 ms 毫秒, 超时(或被信号打断)返回false
     void notify();
 private:
     Semaphore(const Semaphore&) = delete;
@@ -159,6 +161,41 @@ private:
     pthread_rwlock_t m_lock;
 };
 
+// --------------------- Epoch ---------------------
+/* 基于纪元(epoch)的延迟释放: 给"读多写少、读者不能加锁"的快照指针用(日志器的 appender 列表, 配置项的值)
+ *  读者: EpochGuard 保护期间 load 出来的指针一直有效, 代价是两次写自己线程的槽位 + 一个 fence, 不碰共享计数
+ *  写者: 先换掉指针, 再把旧对象交给 Retire; 等换指针之前就进来的读者都离开了才真正释放
+ *  Synchronize 阻塞到调用时已经在读的读者都离开, 用来在关闭资源(文件、线程)之前确认没人还在用
+ *  读者槽位固定 kMaxSlots 个, 线程第一次 Enter 时占一个, 线程退出时归还; 占满了的线程退化成共享计数
+ */
+class Epoch
+{
+public:
+    static const size_t kMaxSlots = 256;
+
+    static void Enter();                                        // 可以嵌套
+    static void Leave();
+    static void Retire(void* p, void (*deleter)(void*));        // 延迟释放, 可能顺手释放掉之前已经安全的对象
+    template<class T>
+    static void Retire(const T* p)                              { if(p) Retire((void*)p, &Delete<T>); }
+    static void Synchronize();                                  // 等已经在读的读者离开(不等自己), 再释放能释放的
+    static size_t Pending();                                    // 还没释放的对象个数(测试用)
+
+private:
+    template<class T>
+    static void Delete(void* p)                                 { delete (const T*)p; }
+};
+
+class EpochGuard
+{
+public:
+    EpochGuard()                                                { Epoch::Enter(); }
+    ~EpochGuard()                                               { Epoch::Leave(); }
+private:
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
 // --------------------- Thread ---------------------
 class Thread
 {
@@ -2,13 +2,39 @@
 #include "log.h"
 #include <iostream>
 #include <execinfo.h>
+#include <signal.h>
+#include <atomic>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 #include "fiber.h"
+#include "thread.h"
 
 namespace sylar {
 
+static thread_local pid_t t_thread_id = 0;
+
+namespace {
+/// fork 之后子进程里只剩调用 fork 的线程, 它缓存的还是父进程里的线程id, 清掉重新取
+struct ThreadIdForkReset {
+    ThreadIdForkReset() {
+        pthread_atfork(nullptr, nullptr, []() { t_thread_id = 0; });
+    }
+};
+static ThreadIdForkReset s_thread_id_fork_reset;
+}
+
 pid_t GetThreadId()
 {
-    return syscall(SYS_gettid); // linux 获取thread id的方式，收集下. 搞懂了pthread_self和syscall是不一样的 syscall返回的是linux下的线程ID  pthread_self获取的是pthread库的线程id 不同进程间这个线程id可能会相同?
+    if(t_thread_id) {
+        return t_thread_id;
+    }
+    return t_thread_id = syscall(SYS_gettid); // linux 获取thread id的方式，收集下. 搞懂了pthread_self和syscall是不一样的 syscall返回的是linux下的线程ID  pthread_self获取的是pthread库的线程id 不同进程间这个线程id可能会相同?
 }
 
 uint32_t GetFiberId()
@@ -18,6 +44,123 @@ uint32_t GetFiberId()
     return sylar::Fiber::GetFiberId();
 }
 
+uint64_t GetCurrentUS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);     // vdso 实现, 不陷入内核
+    return (uint64_t)ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
+uint64_t GetMonotonicUS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
+namespace {
+inline uint64_t ReadTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+bool HasInvariantTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int a = 0, b = 0, c = 0, d = 0;
+    if(!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007) {
+        return false;
+    }
+    __get_cpuid(0x80000007, &a, &b, &c, &d);
+    return d & (1u << 8);                       // EDX bit 8: invariant TSC
+#else
+    return false;
+#endif
+}
+
+/// 全局只校准一次; 函数内静态变量, 别的静态对象构造时打日志也安全
+struct TscClock {
+    bool enabled = false;
+    double usPerTick = 0;
+    uint64_t resyncTicks = 0;                   // 锚点超过这么多 tick(1秒) 重新对齐
+    uint64_t startTsc = 0;
+    uint64_t startMonoUS = 0;
+
+    TscClock() {
+        startMonoUS = GetMonotonicUS();
+        if(!HasInvariantTsc()) {
+            return;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t t0 = (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+        uint64_t c0 = ReadTsc();
+        uint64_t t1 = t0;
+        uint64_t c1 = c0;
+        while(t1 - t0 < 2000000) {              // 忙等 2ms, clock_gettime 的精度下误差在万分之一以内
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            t1 = (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+            c1 = ReadTsc();
+        }
+        if(c1 <= c0) {
+            return;
+        }
+        usPerTick = (t1 - t0) / 1000.0 / (c1 - c0);
+        resyncTicks = (uint64_t)(1000000 / usPerTick);
+        startTsc = c0;
+        startMonoUS = t0 / 1000;
+        enabled = true;
+    }
+};
+
+TscClock& GetTscClock()
+{
+    static TscClock s_clock;
+    return s_clock;
+}
+static TscClock& s_tsc_clock_init = GetTscClock();      // 静态初始化时就校准, 进程运行时间从这里算起
+
+struct TscAnchor {
+    uint64_t tsc = 0;
+    uint64_t us = 0;
+};
+static thread_local TscAnchor t_tsc_anchor;
+}
+
+uint64_t GetFastUS()
+{
+    const TscClock& clock = GetTscClock();
+    if(!clock.enabled) {
+        return GetCurrentUS();
+    }
+    TscAnchor& anchor = t_tsc_anchor;
+    uint64_t delta = ReadTsc() - anchor.tsc;    // 换到了 tsc 更小的核上(不应该发生)时 delta 回绕成很大的数, 也会重新对齐
+    if(!anchor.tsc || delta > clock.resyncTicks) {
+        anchor.tsc = ReadTsc();
+        anchor.us = GetCurrentUS();
+        return anchor.us;
+    }
+    return anchor.us + (uint64_t)(delta * clock.usPerTick);
+}
+
+uint32_t GetUptimeMS()
+{
+    const TscClock& clock = GetTscClock();
+    if(clock.enabled) {
+        return (uint32_t)((ReadTsc() - clock.startTsc) * clock.usPerTick / 1000);
+    }
+    return (uint32_t)((GetMonotonicUS() - clock.startMonoUS) / 1000);
+}
+
+bool IsTscClock()
+{
+    return GetTscClock().enabled;
+}
+
 
 
 void Backtrace(std::vector<std::string>& bt, int size, int skip) {
@@ -51,46 +194,237 @@ std::string BacktraceToString(int size, int skip, const std::string& prefix) {
     return ss.str();
 }
 
+namespace {
+/// 固定大小的钩子表: 信号处理函数里不能加锁也不能分配内存, 只读这个数组
+struct CrashHookSlot {
+    std::atomic<CrashHook> hook;
+    std::atomic<void*> arg;
+};
+static const int MAX_CRASH_HOOKS = 64;
+static CrashHookSlot s_crash_hooks[MAX_CRASH_HOOKS];
+static Mutex& GetCrashHookMutex()               // 只在注册/注销之间互斥; 函数内静态变量, 别的静态对象构造时注册也安全
+{
+    static Mutex s_mutex;
+    return s_mutex;
+}
+
+/// 崩溃时用的缓冲都预先分配好(静态区), 信号处理函数里不能 malloc
+static char s_crash_record[512];
+static std::atomic<size_t> s_crash_record_len(0);
+static std::atomic<bool> s_crashing(false);
+static const int MAX_CRASH_FRAMES = 128;
+static void* s_crash_frames[MAX_CRASH_FRAMES];
+
+/// 往定长缓冲里拼文本, 只用 memcpy, 放不下的截断
+struct CrashWriter {
+    char* buf;
+    size_t cap;
+    size_t len;
+
+    CrashWriter& str(const char* s) {
+        size_t n = strlen(s);
+        if(n > cap - len) {
+            n = cap - len;
+        }
+        memcpy(buf + len, s, n);
+        len += n;
+        return *this;
+    }
+    CrashWriter& num(uint64_t v, int base = 10) {
+        char tmp[24];
+        int i = sizeof(tmp);
+        do {
+            tmp[--i] = "0123456789abcdef"[v % base];
+            v /= base;
+        } while(v);
+        size_t n = sizeof(tmp) - i;
+        if(n > cap - len) {
+            n = cap - len;
+        }
+        memcpy(buf + len, tmp + i, n);
+        len += n;
+        return *this;
+    }
+};
+
+static void WriteAll(int fd, const char* data, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static const char* SignalName(int signal)
+{
+    switch(signal) {
+    case SIGSEGV: return "SIGSEGV (Segmentation Fault)";
+    case SIGBUS:  return "SIGBUS (Bus Error)";
+    case SIGILL:  return "SIGILL (Illegal Instruction)";
+    case SIGFPE:  return "SIGFPE (Floating-point Exception)";
+    case SIGABRT: return "SIGABRT (Abort)";
+    default:      return "Unknown";
+    }
+}
+
+/// 备用信号栈, 线程退出时释放
+struct AltStack {
+    void* stack = nullptr;
+    size_t size = 0;
+    ~AltStack() {
+        if(stack) {
+            stack_t ss;
+            memset(&ss, 0, sizeof(ss));
+            ss.ss_flags = SS_DISABLE;
+            sigaltstack(&ss, nullptr);
+            munmap(stack, size);
+        }
+    }
+};
+static thread_local AltStack t_alt_stack;
+
+static void HandleCrash(int signal, const void* addr);
+
+static void CrashAction(int signal, siginfo_t* info, void* ucontext)
+{
+    HandleCrash(signal, info ? info->si_addr : nullptr);
+}
+}
+
+bool AddCrashHook(CrashHook hook, void* arg)
+{
+    Mutex::Lock lock(GetCrashHookMutex());
+    for(auto& i : s_crash_hooks) {
+        if(!i.hook.load(std::memory_order_relaxed)) {
+            i.arg.store(arg, std::memory_order_relaxed);
+            i.hook.store(hook, std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+void DelCrashHook(CrashHook hook, void* arg)
+{
+    Mutex::Lock lock(GetCrashHookMutex());
+    for(auto& i : s_crash_hooks) {
+        if(i.hook.load(std::memory_order_relaxed) == hook && i.arg.load(std::memory_order_relaxed) == arg) {
+            i.hook.store(nullptr, std::memory_order_release);
+            break;
+        }
+    }
+}
+
+const char* GetCrashRecord(size_t& len)
+{
+    len = s_crash_record_len.load(std::memory_order_acquire);
+    return s_crash_record;
+}
+
 // 信号处理函数
 void CrashHandler(int signal) {
-    // 获取并打印信号描述
-    const char* signal_name = "Unknown";
-    switch(signal)
-    {
-        case SIGSEGV: signal_name = "SIGSEGV (Segmentation Fault)"; break;
-        case SIGILL:  signal_name = "SIGILL (Illegal Instruction)"; break;
-        case SIGFPE:  signal_name = "SIGFPE (Floating-point Exception)"; break;
-        case SIGABRT: signal_name = "SIGABRT (Abort)"; break;
+    HandleCrash(signal, nullptr);
+}
+
+namespace {
+static void HandleCrash(int signal, const void* addr)
+{
+    if(s_crashing.exchange(true)) {             // 别的线程也崩了: 等第一个线程处理完退出进程
+        for(;;) {
+            pause();
+        }
+    }
+
+    // 1. 崩溃记录, 带上出错的线程和协程。Thread::GetName() 是线程局部变量, 只读不分配; 时间用 clock_gettime(异步信号安全)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    CrashWriter rec = {s_crash_record, sizeof(s_crash_record) - 1, 0};
+    rec.str("time=").num(ts.tv_sec).str(".");
+    uint64_t usec = ts.tv_nsec / 1000;
+    for(uint64_t d = 100000; d > 1 && usec < d; d /= 10) {
+        rec.str("0");
+    }
+    rec.num(usec).str(" level=FATAL crash signal=").num(signal).str(" (").str(SignalName(signal)).str(")");
+    if(addr) {
+        rec.str(" addr=0x").num((uint64_t)(uintptr_t)addr, 16);
+    }
+    rec.str(" thread=").num(GetThreadId()).str(" thread_name=").str(Thread::GetName().c_str())
+       .str(" fiber=").num(Fiber::GetFiberId());
+    if(addr && Fiber::InStackGuard(addr)) {
+        rec.str(" fiber_stack_overflow=true");
     }
+    rec.str("\n");
+    s_crash_record_len.store(rec.len, std::memory_order_release);
 
-    std::cerr << "\n!!! Program received fatal signal: " << signal_name << " (" << signal << ") !!!" << std::endl;
-    std::cerr << "=== Stack trace ===" << std::endl;
+    // 2. 崩溃钩子: 把还在内存里的日志(文件缓冲, 异步队列, mmap 长度, 二进制日志)写到各自的文件, 最后写崩溃记录
+    for(auto& i : s_crash_hooks) {
+        CrashHook hook = i.hook.load(std::memory_order_acquire);
+        if(hook) {
+            hook(i.arg.load(std::memory_order_relaxed));
+        }
+    }
 
-    // 调用你已有的函数打印堆栈
-    std::string stack_trace = BacktraceToString(100, 0, "    ");    // skip=2 跳过本函数和信号处理框架
-    std::cerr << stack_trace << std::endl;
+    // 3. stderr: 崩溃记录 + 堆栈。backtrace_symbols_fd 直接写 fd, 不像 backtrace_symbols 那样 malloc
+    const char* head = "\n!!! Program received fatal signal !!!\n";
+    WriteAll(STDERR_FILENO, head, strlen(head));
+    WriteAll(STDERR_FILENO, s_crash_record, rec.len);
+    const char* title = "=== Stack trace ===\n";
+    WriteAll(STDERR_FILENO, title, strlen(title));
+    int n = ::backtrace(s_crash_frames, MAX_CRASH_FRAMES);
+    backtrace_symbols_fd(s_crash_frames, n, STDERR_FILENO);
 
-    // 立即刷新输出缓冲区，确保信息被打印出来
-    std::cerr.flush();
+    // 如果希望生成core文件进行更深入的分析，可以把 _exit 换成恢复默认动作后 raise(signal)
+    _exit(128 + signal);                        // _exit 不跑 atexit 和静态析构(它们会加锁/分配内存)
+}
+}
 
-    // 可选：执行默认的信号处理动作（例如产生core dump）
-    // 如果希望生成core文件进行更深入的分析，可以注释掉exit()，并移除信号注册时的SA_RESETHAND
-    std::_Exit(signal); // 使用 _Exit 避免再次调用atexit等处理程序
+void InstallAltStack()
+{
+    if(t_alt_stack.stack) {
+        return;
+    }
+    size_t size = 64 * 1024;                    // backtrace 和钩子要用一些栈, SIGSTKSZ(8K) 不够
+    void* stack = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(stack == MAP_FAILED) {
+        return;
+    }
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_sp = stack;
+    ss.ss_size = size;
+    if(sigaltstack(&ss, nullptr)) {
+        munmap(stack, size);
+        return;
+    }
+    t_alt_stack.stack = stack;
+    t_alt_stack.size = size;
 }
 
 // 初始化函数，应在main函数开始处调用
 void InstallCrashHandler() {
+    // backtrace 第一次调用时会加载 libgcc_s(要 malloc), 先在这里调一次, 崩溃时就不用了
+    ::backtrace(s_crash_frames, 1);
+    InstallAltStack();
+
     struct sigaction sa;
-    sa.sa_handler = CrashHandler;               // 设置信号处理函数
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = CrashAction;              // 设置信号处理函数(带 siginfo, 拿出错地址)
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_RESETHAND;    // SA_RESETHAND 表示在处理一次后恢复为默认动作
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;  // SA_ONSTACK: 在备用信号栈上运行; SA_RESETHAND 表示在处理一次后恢复为默认动作
 
     // 注册需要捕获的信号
-    sigaction(SIGSEGV, &sa, nullptr);           // 非法内存访问
+    sigaction(SIGSEGV, &sa, nullptr);           // 非法内存访问(包括协程栈溢出碰到保护页)
+    sigaction(SIGBUS,  &sa, nullptr);           // 总线错误(比如 mmap 的文件被截断)
     sigaction(SIGILL,  &sa, nullptr);           // 非法指令
     sigaction(SIGFPE,  &sa, nullptr);           // 算术运算异常
     sigaction(SIGABRT, &sa, nullptr);           // 中止信号（如assert失败）
-    // 可以根据需要添加更多信号，如SIGBUS
 }
 
 
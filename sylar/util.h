@@ -9,22 +9,60 @@
 
 #include <vector>
 #include <string>
+#include <typeinfo>
+#include <cxxabi.h>
 
 namespace sylar{
 
-// 获取线程ID
+// 获取线程ID: 第一次调用时 syscall(SYS_gettid), 之后读线程局部的缓存(fork 出来的子进程里会重新取)
 pid_t GetThreadId();
 
 // 或者协程ID
 uint32_t GetFiberId();
 
+// 当前时间(CLOCK_REALTIME), 微秒时间戳
+uint64_t GetCurrentUS();
+
+// 单调时钟(CLOCK_MONOTONIC), 微秒; 只用来算时间间隔, 不受改系统时间影响
+uint64_t GetMonotonicUS();
+
+/* ******************** 低开销时钟(日志时间戳用) ********************
+ * x86 上 CPU 支持 invariant TSC(频率恒定, 各核同步)时用 rdtsc: 第一次使用时对着 CLOCK_MONOTONIC 校准出每个 tick 多少微秒,
+ * 每个线程记一个 (tsc, 墙上时间) 锚点, 时间 = 锚点时间 + (rdtsc - 锚点tsc) * 每tick微秒; 锚点每秒对着 clock_gettime 重新对齐,
+ * 校准误差和 NTP 的调整不会累积(对齐时可能回退几微秒)。不支持 invariant TSC 的机器退回 vDSO 的 clock_gettime。
+ */
+uint64_t GetFastUS();       // 墙上时间, 微秒, 和 GetCurrentUS 同一个基准
+uint32_t GetUptimeMS();     // 进程启动(时钟初始化)到现在的毫秒数, 单调
+bool IsTscClock();          // 是否在用 rdtsc
+
 void Backtrace(std::vector<std::string>& bt, int size, int skip);
 
 std::string BacktraceToString(int size, int skip, const std::string& prefix);
 
+// 致命信号的处理函数: 只用异步信号安全的调用(预先分配的缓冲, write, backtrace_symbols_fd), 运行在备用信号栈上
 void CrashHandler(int signal);
 
+// 安装 SIGSEGV/SIGBUS/SIGILL/SIGFPE/SIGABRT 的处理函数, 并给调用线程装上备用信号栈; 应在main函数开始处调用
 void InstallCrashHandler();
+
+// 给当前线程装备用信号栈(协程栈溢出时原来的栈已经不能用了), 线程退出时释放。sylar::Thread 的线程会自动调用
+void InstallAltStack();
+
+// 崩溃钩子: CrashHandler 打印堆栈之前依次调用(在信号处理函数里执行, 钩子里只能做异步信号安全的事, 比如 ftruncate/write)
+typedef void (*CrashHook)(void* arg);
+bool AddCrashHook(CrashHook hook, void* arg);   // 最多64个, 满了返回false
+void DelCrashHook(CrashHook hook, void* arg);
+
+// 崩溃记录: 一行文本, 带信号, 出错地址, 线程id/名称, 协程id。钩子里可以取来写进自己的日志文件; 没有崩溃时 len 为0
+const char* GetCrashRecord(size_t& len);
+
+// 类型名(去掉编译器的名字修饰), 比如 std::vector<int, std::allocator<int> >; 每个类型只解析一次
+template<class T>
+const char* TypeToName()
+{
+    static const char* s_name = abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr, nullptr);
+    return s_name ? s_name : typeid(T).name();
+}
 }
 
 #endif
@@ -0,0 +1,241 @@
+/* ******************** 配置加载性能测试 ********************
+ * 用法: bench_config [配置项个数=10000] [轮数=5] [读线程数=4]
+ * 注册 N 个配置项(int, double, std::string, std::vector<int>, std::map<std::string, int> 各占 1/5),
+ * 生成一份把它们都改掉的 YAML, 比较每轮的加载耗时:
+ *      1. yaml   : YAML::LoadFile + Config::LoadFromYaml
+ *      2. rebuild: Config::LoadFromFile 缓存失效(解析 YAML + 写缓存)
+ *      3. cache  : Config::LoadFromFile 命中缓存(mmap + 二进制转换)
+ * 每轮开始前把配置项恢复成默认值(不计时), 保证每轮都真的要改所有的值。
+ * 再测单独一项 setValue(一次提交)的耗时, 和注册的配置项总数关系不大才对。
+ * 然后比较多个线程同时读配置项的开销(每次读的平均耗时):
+ *      4. atomic_load : std::atomic_load(shared_ptr) (libstdc++ 里是全局的一组互斥锁), 作对照
+ *      5. snapshot    : ConfigVar::getSnapshot()
+ *      6. snap+write  : 同上, 另有一个线程不停地提交修改
+ */
+#include "sylar/sylar.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+
+namespace {
+
+uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+std::vector<sylar::ConfigVar<int>::ptr> s_ints;
+std::vector<sylar::ConfigVar<double>::ptr> s_doubles;
+std::vector<sylar::ConfigVar<std::string>::ptr> s_strings;
+std::vector<sylar::ConfigVar<std::vector<int> >::ptr> s_vectors;
+std::vector<sylar::ConfigVar<std::map<std::string, int> >::ptr> s_maps;
+std::vector<sylar::ConfigVarBase::ptr> s_all;
+
+/// 注册配置项, 同时生成 YAML: bench.g<组>.k<序号>, 每组 100 个
+std::string Register(int count)
+{
+    std::stringstream ss;
+    ss << "bench:\n";
+    for(int i = 0; i < count; ++i) {
+        if(i % 100 == 0) {
+            ss << "  g" << i / 100 << ":\n";
+        }
+        std::string name = "bench.g" + std::to_string(i / 100) + ".k" + std::to_string(i);
+        ss << "    k" << i << ": ";
+        switch(i % 5) {
+            case 0:
+                s_ints.push_back(sylar::Config::Lookup(name, 0, "int"));
+                s_all.push_back(s_ints.back());
+                ss << i * 7;
+                break;
+            case 1:
+                s_doubles.push_back(sylar::Config::Lookup(name, 0.0, "double"));
+                s_all.push_back(s_doubles.back());
+                ss << i * 0.5;
+                break;
+            case 2:
+                s_strings.push_back(sylar::Config::Lookup(name, std::string(), "string"));
+                s_all.push_back(s_strings.back());
+                ss << "value_" << i;
+                break;
+            case 3:
+                s_vectors.push_back(sylar::Config::Lookup(name, std::vector<int>(), "vector"));
+                s_all.push_back(s_vectors.back());
+                ss << "[" << i << ", " << i + 1 << ", " << i + 2 << ", " << i + 3 << "]";
+                break;
+            default:
+                s_maps.push_back(sylar::Config::Lookup(name, std::map<std::string, int>(), "map"));
+                s_all.push_back(s_maps.back());
+                ss << "{a: " << i << ", b: " << i + 1 << "}";
+                break;
+        }
+        ss << "\n";
+    }
+    return ss.str();
+}
+
+/// 恢复默认值(一次提交)
+void Reset()
+{
+    sylar::ConfigTransaction tx;
+    for(auto& i : s_ints)       tx.set(i, *i->getDefault());
+    for(auto& i : s_doubles)    tx.set(i, *i->getDefault());
+    for(auto& i : s_strings)    tx.set(i, *i->getDefault());
+    for(auto& i : s_vectors)    tx.set(i, *i->getDefault());
+    for(auto& i : s_maps)       tx.set(i, *i->getDefault());
+    tx.commit();
+}
+
+std::vector<std::string> Dump()
+{
+    std::vector<std::string> rt;
+    rt.reserve(s_all.size());
+    for(auto& i : s_all) {
+        rt.push_back(i->toString());
+    }
+    return rt;
+}
+
+void Print(const char* name, int count, int rounds, uint64_t total_ns)
+{
+    double ms = total_ns / 1e6 / rounds;
+    printf("%-8s %8d %6d %10.3f %10.1f\n", name, count, rounds, ms, ms * 1e6 / count);
+    fflush(stdout);
+}
+
+/// threads 个线程各读 reads 次, 返回平均每次读的耗时(纳秒)
+template<class F>
+double ConcurrentRead(int threads, int reads, F read)
+{
+    std::atomic<int> ready{0};
+    std::atomic<uint64_t> total{0};
+    std::vector<sylar::Thread::ptr> ths;
+    for(int t = 0; t < threads; ++t) {
+        ths.push_back(sylar::Thread::ptr(new sylar::Thread([&, t]() {
+            ++ready;
+            while(ready < threads);                     // 一起开始
+            uint64_t sum = 0;
+            uint64_t begin = NowNs();
+            for(int i = 0; i < reads; ++i) {
+                sum += read(t + i);
+            }
+            total += NowNs() - begin;
+            if(sum == 42) {                             // 防止被优化掉
+                printf(" ");
+            }
+        }, "bench_read_" + std::to_string(t))));
+    }
+    for(auto& i : ths) {
+        i->join();
+    }
+    return (double)total / threads / reads;
+}
+
+void PrintRead(const char* name, int threads, double ns)
+{
+    printf("%-12s %8d %10.1f\n", name, threads, ns);
+    fflush(stdout);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    const std::string file = "./bench_config.yml";
+    const std::string cache = "./bench_config.yml.cache";
+
+    SYLAR_LOG_ROOT()->setLevel(sylar::LogLevel::ERROR);
+    std::ofstream(file) << Register(count);
+    printf("%-8s %8s %6s %10s %10s\n", "load", "keys", "rounds", "ms/round", "ns/key");
+
+    // 1. YAML
+    uint64_t total = 0;
+    for(int r = 0; r < rounds; ++r) {
+        Reset();
+        uint64_t begin = NowNs();
+        YAML::Node root = YAML::LoadFile(file);
+        sylar::Config::LoadFromYaml(root);
+        total += NowNs() - begin;
+    }
+    Print("yaml", count, rounds, total);
+    std::vector<std::string> expect = Dump();
+
+    // 2. 缓存失效: 解析 YAML + 写缓存
+    total = 0;
+    bool from_cache = false;
+    for(int r = 0; r < rounds; ++r) {
+        Reset();
+        unlink(cache.c_str());
+        uint64_t begin = NowNs();
+        sylar::Config::LoadFromFile(file, cache, &from_cache);
+        total += NowNs() - begin;
+    }
+    Print("rebuild", count, rounds, total);
+
+    // 3. 命中缓存
+    total = 0;
+    int hits = 0;
+    for(int r = 0; r < rounds; ++r) {
+        Reset();
+        uint64_t begin = NowNs();
+        sylar::Config::LoadFromFile(file, cache, &from_cache);
+        total += NowNs() - begin;
+        hits += from_cache;
+    }
+    Print("cache", count, rounds, total);
+
+    struct stat st;
+    stat(cache.c_str(), &st);
+    printf("cache hits=%d/%d size=%lld bytes, values %s\n", hits, rounds, (long long)st.st_size,
+           Dump() == expect ? "match yaml" : "MISMATCH");
+
+    // 单项提交
+    if(!s_ints.empty()) {
+        const int sets = 10000;
+        uint64_t begin = NowNs();
+        for(int i = 0; i < sets; ++i) {
+            s_ints[i % s_ints.size()]->setValue(-i - 1);
+        }
+        printf("setValue with %d keys: %.1f ns/commit\n", count, (double)(NowNs() - begin) / sets);
+    }
+
+    // 4~6. 并发读
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    const int reads = 1000000;
+    size_t nints = s_ints.size() < 64 ? s_ints.size() : 64;
+    if(!nints) {
+        return 0;
+    }
+    printf("\n%-12s %8s %10s\n", "read", "threads", "ns/read");
+    std::vector<std::shared_ptr<const int> > plain;
+    for(size_t i = 0; i < nints; ++i) {
+        plain.push_back(s_ints[i]->getSnapshot());
+    }
+    PrintRead("atomic_load", threads, ConcurrentRead(threads, reads, [&](int i) {
+        return (uint64_t)*std::atomic_load(&plain[i % nints]);
+    }));
+    PrintRead("snapshot", threads, ConcurrentRead(threads, reads, [&](int i) {
+        return (uint64_t)*s_ints[i % nints]->getSnapshot();
+    }));
+    std::atomic<bool> stop{false};
+    sylar::Thread writer([&]() {
+        for(int v = 0; !stop; ++v) {
+            s_ints[v % nints]->setValue(v);
+        }
+    }, "bench_write");
+    PrintRead("snap+write", threads, ConcurrentRead(threads, reads, [&](int i) {
+        return (uint64_t)*s_ints[i % nints]->getSnapshot();
+    }));
+    stop = true;
+    writer.join();
+    return 0;
+}
@@ -0,0 +1,272 @@
+/* ******************** 日志性能测试 ********************
+ * 用法: bench_log [每个线程的条数=100000] [最多线程数=4] [-s 也测 stdout]
+ * 输出每种组合的 ns/条, 条/秒, 单条耗时分位数(p50/p99/p999/max) 和每条日志的内存分配次数:
+ *      1. 不同 LogFormatter 格式 (null appender, 1线程)
+ *      2. 不同 appender, 线程数 1, 2, 4 ... 最多线程数 (unix: 发给本地的 DGRAM 收集端, 另外输出发送/丢弃条数)
+ */
+#include "sylar/sylar.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+static std::atomic<uint64_t> s_alloc_count(0);
+
+void* operator new(size_t size)
+{
+    ++s_alloc_count;
+    void* p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void* operator new[](size_t size)           { return operator new(size); }
+void operator delete(void* p) noexcept      { free(p); }
+void operator delete[](void* p) noexcept    { free(p); }
+
+namespace {
+
+uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/// 只统计字节数的 appender, 用来单独测格式化的开销
+class NullAppender : public sylar::LogAppender {
+public:
+    typedef std::shared_ptr<NullAppender> ptr;
+    void log(sylar::Logger::ptr logger, sylar::LogLevel::Level level, sylar::LogEvent::ptr event) override {
+        if(level >= m_level) {
+            formatAndLog(logger, level, event);
+        }
+    }
+    void logFormatted(sylar::Logger::ptr logger, sylar::LogLevel::Level level, sylar::LogEvent::ptr event, const char* data, size_t len) override {
+        m_bytes += len;
+    }
+    void write(const char* data, size_t len) override { m_bytes += len; }
+private:
+    std::atomic<uint64_t> m_bytes{0};
+};
+
+/// 本地的 DGRAM 收集端, 当作 UnixSocketLogAppender 的 agent: 后台线程一直收, 只计数
+class DgramSink {
+public:
+    DgramSink(const std::string& path)
+        :m_path(path)
+    {
+        unlink(path.c_str());
+        m_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        bind(m_fd, (struct sockaddr*)&addr, sizeof(addr));
+        struct timeval tv = {0, 100 * 1000};           // recv 最多等 100ms, 好检查停止标志
+        setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        m_thread.reset(new sylar::Thread([this]() {
+            std::vector<char> buf(64 * 1024);
+            while(!m_stop) {
+                if(recv(m_fd, buf.data(), buf.size(), 0) > 0) {
+                    ++m_count;
+                }
+            }
+        }, "bench_sink"));
+    }
+    ~DgramSink() {
+        m_stop = true;
+        m_thread->join();
+        close(m_fd);
+        unlink(m_path.c_str());
+    }
+    uint64_t getCount() const   { return m_count; }
+private:
+    std::string m_path;
+    int m_fd = -1;
+    std::atomic<bool> m_stop{false};
+    std::atomic<uint64_t> m_count{0};
+    sylar::Thread::ptr m_thread;
+};
+
+struct Result {
+    uint64_t records = 0;
+    uint64_t total_ns = 0;
+    uint64_t allocs = 0;
+    std::vector<uint64_t> latency;      // 每条的耗时(ns)
+};
+
+/// threads 个线程各写 count 条, 统计总耗时, 单条耗时和内存分配
+Result Run(sylar::Logger::ptr logger, sylar::LogAppender::ptr appender, int threads, int count, bool binlog)
+{
+    std::vector<std::vector<uint64_t> > latency(threads);
+    for(auto& i : latency) {
+        i.resize(count);                                // 先分配好, 不计入被测的分配次数
+    }
+    std::vector<sylar::Thread::ptr> workers;
+    workers.reserve(threads);
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+
+    uint64_t alloc_begin = 0;
+    uint64_t begin = 0;
+    for(int t = 0; t < threads; ++t) {
+        std::vector<uint64_t>* lat = &latency[t];
+        workers.push_back(sylar::Thread::ptr(new sylar::Thread([=, &ready, &go]() {
+            if(binlog) {                                // 线程局部缓冲等第一次的分配不算
+                MYLOG_BIN_INFO(logger, "warm up");
+            } else {
+                MYLOG_INFO(logger) << "warm up";
+            }
+            ++ready;
+            while(!go) {
+                sched_yield();
+            }
+            uint64_t* out = lat->data();
+            for(int i = 0; i < count; ++i) {
+                uint64_t s = NowNs();
+                if(binlog) {
+                    MYLOG_BIN_INFO(logger, "bench record {} value={} name={}", i, 3.14159, "sylar");
+                } else {
+                    MYLOG_INFO(logger) << "bench record " << i << " value=" << 3.14159 << " name=" << "sylar";
+                }
+                out[i] = NowNs() - s;
+            }
+        }, "bench_" + std::to_string(t))));
+    }
+    while(ready < threads) {
+        sched_yield();
+    }
+    alloc_begin = s_alloc_count;
+    begin = NowNs();
+    go = true;
+    for(auto& i : workers) {
+        i->join();
+    }
+    if(binlog) {
+        sylar::BinLogMgr::GetInstance()->flush();
+    } else if(appender) {
+        appender->flush();                              // 异步/缓冲的 appender 写完才算结束
+    }
+
+    Result rt;
+    rt.total_ns = NowNs() - begin;
+    rt.allocs = s_alloc_count - alloc_begin;
+    rt.records = (uint64_t)threads * count;
+    for(auto& i : latency) {
+        rt.latency.insert(rt.latency.end(), i.begin(), i.end());
+    }
+    return rt;
+}
+
+void Print(const std::string& name, const std::string& pattern, int threads, Result& rt)
+{
+    std::sort(rt.latency.begin(), rt.latency.end());
+    auto pct = [&rt](double p) -> unsigned long long {
+        if(rt.latency.empty()) {
+            return 0;
+        }
+        size_t idx = std::min(rt.latency.size() - 1, (size_t)(p * rt.latency.size()));
+        return rt.latency[idx];
+    };
+    double ns = (double)rt.total_ns / rt.records;
+    printf("%-10s %-10s %3d %10.1f %12.0f %8llu %8llu %8llu %10llu %8.3f\n",
+           name.c_str(), pattern.c_str(), threads, ns, rt.records * 1e9 / rt.total_ns,
+           pct(0.5), pct(0.99), pct(0.999), (unsigned long long)rt.latency.back(),
+           (double)rt.allocs / rt.records);
+    fflush(stdout);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    int count = 100000;
+    int max_threads = 4;
+    bool with_stdout = false;
+    int pos = 0;
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-s")) {
+            with_stdout = true;
+        } else if(pos++ == 0) {
+            count = atoi(argv[i]);
+        } else {
+            max_threads = atoi(argv[i]);
+        }
+    }
+
+    printf("%-10s %-10s %3s %10s %12s %8s %8s %8s %10s %8s\n",
+           "appender", "pattern", "thr", "ns/rec", "rec/s", "p50", "p99", "p999", "max(ns)", "alloc/rec");
+
+    // 1. 格式化的开销
+    std::vector<std::pair<std::string, std::string> > patterns = {
+        {"message", "%m%n"},
+        {"default", ""},                                // Logger 构造时给的默认格式
+        {"full", "%d{%Y-%m-%d %H:%M:%S}.%e%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"},
+        {"iso8601", "%Z %p %c %f:%l %m%n"},
+    };
+    for(auto& p : patterns) {
+        sylar::Logger::ptr logger(new sylar::Logger("bench"));
+        NullAppender::ptr appender(new NullAppender);
+        if(!p.second.empty()) {
+            appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter(p.second)));
+        }
+        logger->addAppender(appender);
+        Result rt = Run(logger, appender, 1, count, false);
+        Print("null", p.first, 1, rt);
+    }
+
+    // 2. 不同的 appender 和线程数
+    DgramSink sink("./bench_log_agent.sock");
+    typedef std::function<sylar::LogAppender::ptr()> Factory;
+    std::vector<std::pair<std::string, Factory> > appenders = {
+        {"null",  []() { return sylar::LogAppender::ptr(new NullAppender); }},
+        {"file",  []() { return sylar::LogAppender::ptr(new sylar::FileLogAppender("./bench_log.txt")); }},
+        {"mmap",  []() { return sylar::LogAppender::ptr(new sylar::MmapFileLogAppender("./bench_log_mmap.txt")); }},
+        {"async", []() { return sylar::LogAppender::ptr(new sylar::AsyncLogAppender(
+                                        sylar::LogAppender::ptr(new sylar::FileLogAppender("./bench_log_async.txt")), 65536)); }},
+        {"sharded", []() { return sylar::LogAppender::ptr(new sylar::ShardedLogAppender(
+                                        sylar::LogAppender::ptr(new sylar::FileLogAppender("./bench_log_sharded.txt")))); }},
+        {"unix",  []() { return sylar::LogAppender::ptr(new sylar::UnixSocketLogAppender(
+                                        "./bench_log_agent.sock", sylar::UnixSocketLogAppender::DGRAM)); }},
+        {"binlog", Factory()},                          // MYLOG_BIN_INFO, 不经过 appender
+    };
+    if(with_stdout) {
+        appenders.push_back({"stdout", []() { return sylar::LogAppender::ptr(new sylar::StdoutAppender); }});
+    }
+    for(auto& a : appenders) {
+        for(int threads = 1; threads <= max_threads; threads *= 2) {
+            sylar::Logger::ptr logger(new sylar::Logger("bench"));
+            sylar::LogAppender::ptr appender;
+            uint64_t sink_begin = sink.getCount();
+            if(a.second) {
+                appender = a.second();
+                logger->addAppender(appender);
+            } else {
+                sylar::BinLogMgr::GetInstance()->open("./bench_log.bin");
+            }
+            Result rt = Run(logger, appender, threads, count, !a.second);
+            Print(a.first, "default", threads, rt);
+            if(auto u = std::dynamic_pointer_cast<sylar::UnixSocketLogAppender>(appender)) {
+                u->close();
+                for(int i = 0; i < 100 && sink.getCount() - sink_begin < u->getSendCount(); ++i) {
+                    usleep(1000);                       // 等收集端收完已经发出的
+                }
+                printf("%-10s send=%llu spill=%llu drop=%llu sink_recv=%llu\n", "", (unsigned long long)u->getSendCount(),
+                       (unsigned long long)u->getSpillCount(), (unsigned long long)u->getDropCount(),
+                       (unsigned long long)(sink.getCount() - sink_begin));
+            }
+            if(!a.second) {
+                sylar::BinLogMgr::GetInstance()->close();
+            }
+        }
+    }
+    return 0;
+}
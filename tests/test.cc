@@ -1,6 +1,10 @@
 #include <iostream>
 #include "../sylar/log.h"
 #include "../sylar/util.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 int main(int argc, char** argv) {
     sylar::Logger::ptr logger(new sylar::Logger);
@@ -16,6 +20,9 @@ int main(int argc, char** argv) {
 
     // file_appender->setFormatter(fmt);
     file_appender->setLevel(sylar::LogLevel::FATAL);
+    file_appender->setMaxSize(10 * 1024 * 1024);                   // 超过10M滚动, 保留 log.txt.1 ~ log.txt.5
+    file_appender->setMaxFiles(5);
+    file_appender->setRotateMode(sylar::FileLogAppender::ROTATE_DAILY);
     logger->addAppender(file_appender);
 
     MYLOG_DEBUG(logger) << "my log";
@@ -23,6 +30,152 @@ int main(int argc, char** argv) {
     auto l = sylar::LoggerMgr::GetInstance()->getLogger("xx");
     MYLOG_INFO(l) << "XX";
 
+    // 分层日志器: "system.scheduler" 继承 "system" 和 root 的级别/appender, 调整 "system" 影响整棵子树
+    auto sys = SYLAR_LOG_NAME("system");
+    auto sched = SYLAR_LOG_NAME("system.scheduler");
+    MYLOG_INFO(sched) << "scheduler info, parent=" << sched->getParent()->getName();
+    sys->setLevel(sylar::LogLevel::WARN);
+    MYLOG_INFO(sched) << "hidden: system set to WARN";
+    MYLOG_WARN(sched) << "scheduler warn level=" << sylar::LogLevel::ToString(sched->getLevel());
+    sys->setLevel(sylar::LogLevel::UNKNOW);                         // 改回继承 root
+
+    // 按调用点限流: 错误风暴时每秒最多10条, 被抑制的条数在下一条放行的日志前面输出
+    for(int i = 0; i < 1000; ++i) {
+        MYLOG_RATELIMITED(logger, sylar::LogLevel::ERROR, 10, 3) << "downstream failed " << i;
+        MYLOG_EVERY_N(logger, sylar::LogLevel::INFO, 500) << "every 500: " << i;
+        MYLOG_FIRST_N(logger, sylar::LogLevel::WARN, 2) << "first 2: " << i;   // 第3次输出一条说明, 之后不再输出
+    }
+
+    // 异步输出: 业务线程只入队, 后台线程批量写
+    sylar::Logger::ptr async_logger(new sylar::Logger("async"));
+    sylar::AsyncLogAppender::ptr async_appender(new sylar::AsyncLogAppender(
+                sylar::LogAppender::ptr(new sylar::StdoutAppender), 1024, sylar::AsyncLogAppender::DROP));
+    async_logger->addAppender(async_appender);
+    for(int i = 0; i < 10; ++i) {
+        MYLOG_INFO(async_logger) << "async log " << i;
+    }
+    async_appender->flush();
+    std::cout << "async write=" << async_appender->getWriteCount()
+              << " drop=" << async_appender->getDropCount() << std::endl;
+
+    // mmap 文件: 日志直接拷贝进文件映射, close 时截断到实际长度
+    sylar::Logger::ptr mmap_logger(new sylar::Logger("mmap"));
+    sylar::MmapFileLogAppender::ptr mmap_appender(new sylar::MmapFileLogAppender("./log_mmap.txt", 1024 * 1024));
+    mmap_logger->addAppender(mmap_appender);
+    for(int i = 0; i < 10; ++i) {
+        MYLOG_INFO(mmap_logger) << "mmap log " << i;
+    }
+    mmap_appender->close();
+    std::cout << "mmap file size=" << mmap_appender->getFileSize() << std::endl;
+
+    // unix 域套接字: 本地起一个 DGRAM 监听当作 agent, 收到的就是一条条格式化好的日志; agent 关掉后写 spill 文件
+    {
+        const char* path = "./log_agent.sock";
+        unlink(path);
+        int agent = socket(AF_UNIX, SOCK_DGRAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        bind(agent, (struct sockaddr*)&addr, sizeof(addr));
+
+        sylar::Logger::ptr unix_logger(new sylar::Logger("unix"));
+        sylar::UnixSocketLogAppender::ptr unix_appender(new sylar::UnixSocketLogAppender(
+                    path, sylar::UnixSocketLogAppender::DGRAM, "./log_spill.txt", 1024 * 1024, 0));
+        unix_logger->addAppender(unix_appender);
+        for(int i = 0; i < 5; ++i) {
+            MYLOG_INFO(unix_logger) << "unix log " << i;
+        }
+        unix_appender->flush();
+        char buf[1024];
+        ssize_t n = 0;
+        while((n = recv(agent, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            std::cout << "agent recv: " << std::string(buf, n);
+        }
+        close(agent);                                               // agent 退出
+        unlink(path);
+        for(int i = 5; i < 8; ++i) {
+            MYLOG_INFO(unix_logger) << "unix log " << i;
+        }
+        unix_appender->flush();
+        std::cout << "unix send=" << unix_appender->getSendCount() << " spill=" << unix_appender->getSpillCount()
+                  << " drop=" << unix_appender->getDropCount() << std::endl;
+    }
+
+    // STREAM: 本地起一个监听当作 agent; agent 退出后的日志写 spill 文件, agent 重新起来后发送线程自己重连
+    {
+        const char* path = "./log_agent_stream.sock";
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        auto start_agent = [&]() {
+            unlink(path);
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+            listen(fd, 4);
+            return fd;
+        };
+        auto drain_agent = [](int listen_fd) {                      // 接受连接, 读出已经发过来的日志
+            int conn = accept(listen_fd, nullptr, nullptr);
+            char buf[4096];
+            ssize_t n = 0;
+            while((n = recv(conn, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+                std::cout << "stream agent recv: " << std::string(buf, n);
+            }
+            return conn;
+        };
+
+        int agent = start_agent();
+        sylar::Logger::ptr stream_logger(new sylar::Logger("unix_stream"));
+        sylar::UnixSocketLogAppender::ptr stream_appender(new sylar::UnixSocketLogAppender(
+                    path, sylar::UnixSocketLogAppender::STREAM, "./log_spill_stream.txt", 1024 * 1024, 0));
+        stream_logger->addAppender(stream_appender);
+        for(int i = 0; i < 3; ++i) {
+            MYLOG_INFO(stream_logger) << "stream log " << i;
+        }
+        stream_appender->flush();
+        int conn = drain_agent(agent);
+        std::cout << "stream connected=" << stream_appender->isConnected() << std::endl;
+
+        close(conn);                                                // agent 退出
+        close(agent);
+        unlink(path);
+        for(int i = 3; i < 6; ++i) {
+            MYLOG_INFO(stream_logger) << "stream log " << i;
+            stream_appender->flush();
+        }
+        std::cout << "stream after agent exit: send=" << stream_appender->getSendCount()
+                  << " spill=" << stream_appender->getSpillCount() << std::endl;
+
+        agent = start_agent();                                      // agent 重新起来
+        for(int i = 6; i < 8; ++i) {
+            MYLOG_INFO(stream_logger) << "stream log " << i;
+            stream_appender->flush();
+        }
+        conn = drain_agent(agent);
+        std::cout << "stream send=" << stream_appender->getSendCount() << " spill=" << stream_appender->getSpillCount()
+                  << " drop=" << stream_appender->getDropCount() << " connect=" << stream_appender->getConnectCount() << std::endl;
+        stream_appender->close();
+        close(conn);
+        close(agent);
+        unlink(path);
+    }
+
+    // 结构化字段: %J 输出 JSON, %K 输出 logfmt, %V 只输出字段
+    sylar::Logger::ptr kv_logger(new sylar::Logger("kv"));
+    sylar::StdoutAppender::ptr json_appender(new sylar::StdoutAppender);
+    json_appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("%J%n")));
+    sylar::StdoutAppender::ptr logfmt_appender(new sylar::StdoutAppender);
+    logfmt_appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("%K%n")));
+    sylar::StdoutAppender::ptr text_appender(new sylar::StdoutAppender);
+    text_appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("%d{%H:%M:%S}.%e%T[%p]%T%m%T%V%n")));
+    kv_logger->addAppender(json_appender);
+    kv_logger->addAppender(logfmt_appender);
+    kv_logger->addAppender(text_appender);
+    MYLOG_INFO(kv_logger).kv("user", 10086).kv("ok", true).kv("cost", 1.25).kv("path", "/a b/\"c\"\n")
+        << "login";
+
 
     return 0;
 }
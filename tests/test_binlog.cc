@@ -0,0 +1,33 @@
+#include "sylar/sylar.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+void func()
+{
+    std::string name = sylar::Thread::GetName();
+    for(int i = 0; i < 100000; i++)
+    {
+        MYLOG_BIN_INFO(g_logger, "thread {} i={} half={} ok={}", name, i, i / 2.0, i % 2 == 0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string file = argc > 1 ? argv[1] : "test_binlog.bin";
+    sylar::BinLogMgr::GetInstance()->open(file);
+
+    MYLOG_BIN_WARN(g_logger, "binlog begin");
+    std::vector<sylar::Thread::ptr> threads;
+    for(int i = 0; i < 4; i++) {
+        threads.push_back(sylar::Thread::ptr(new sylar::Thread(&func, "binlog_" + std::to_string(i))));
+    }
+    for(auto& i : threads) {
+        i->join();
+    }
+    MYLOG_BIN_ERROR(g_logger, "char={} str={} neg={}", 'x', "literal", -42);
+
+    sylar::BinLogMgr::GetInstance()->close();
+    MYLOG_INFO(g_logger) << "binlog records=" << sylar::BinLogMgr::GetInstance()->getWriteCount()
+                         << ", decode with: sylar_logdecode " << file;
+    return 0;
+}
@@ -5,6 +5,8 @@
 
 
 #include "yaml-cpp/yaml.h"
+#include <fstream>
+#include <unistd.h>
 
 
 sylar::ConfigVar<int>::ptr g_int_value_config = sylar::Config::Lookup("system.port", (int)8080, "system port");
@@ -12,6 +14,28 @@ sylar::ConfigVar<int>::ptr g_int_value_config = sylar::Config::Lookup("system.po
 sylar::ConfigVar<std::vector<int> >::ptr g_vector_int_value_config = sylar::Config::Lookup("system.int_vector", std::vector<int>{1,2}, "system int vector");  //ListAllMember() 解析完以后就是 system.port 这种key
 
 
+sylar::ConfigVar<std::unordered_set<std::string> >::ptr g_allow_list_config =
+    sylar::Config::Lookup("system.allow_list", std::unordered_set<std::string>{"127.0.0.1"}, "allow list");
+sylar::ConfigVar<std::unordered_map<std::string, std::vector<int> > >::ptr g_route_config =
+    sylar::Config::Lookup("system.routes", std::unordered_map<std::string, std::vector<int> >(), "route -> ports");
+
+/// 自定义结构体: 用 SYLAR_CONFIG_STRUCT 生成转换
+struct Person {
+    std::string name;
+    int age = 0;
+    bool sex = false;
+    std::map<std::string, std::string> tags;
+
+    bool operator==(const Person& o) const {
+        return name == o.name && age == o.age && sex == o.sex && tags == o.tags;
+    }
+};
+#define PERSON_FIELDS(X) X(name) X(age) X(sex) X(tags)
+SYLAR_CONFIG_STRUCT(Person, PERSON_FIELDS)
+
+sylar::ConfigVar<std::map<std::string, Person> >::ptr g_person_map_config =
+    sylar::Config::Lookup("class.map", std::map<std::string, Person>(), "person map");
+
 void print_yaml(const YAML::Node& node, int level)  // 该函数
 {
     // MYLOG_INFO(SYLAR_LOG_ROOT()) << "node.Type() : " << node.Type();
@@ -100,11 +124,128 @@ void test_config()
 //    MYLOG_INFO(SYLAR_LOG_ROOT()) << "after int_vector to str: " << g_vector_int_value_config->toString();
 }
 
+/// 日志配置热更新: 改 "logs" 的级别只改级别, 不重建 appender
+void test_log()
+{
+    static sylar::Logger::ptr system_log = SYLAR_LOG_NAME("system.scheduler");
+    MYLOG_INFO(system_log) << "hello system.scheduler" << std::endl;
+
+    YAML::Node root = YAML::Load(
+        "logs:\n"
+        "  - name: system\n"
+        "    level: warn\n"
+        "    formatter: '%d%T[%c]%T%p%T%m%n'\n"
+        "    appenders:\n"
+        "      - type: StdoutLogAppender\n"
+        "      - type: FileLogAppender\n"
+        "        file: ./system_log.txt\n"
+        "        async: true\n");
+    sylar::Config::LoadFromYaml(root);
+    std::cout << sylar::Config::LookupBase("logs")->toString() << std::endl;
+    MYLOG_INFO(system_log) << "hidden: system level is warn";
+    MYLOG_ERROR(system_log) << "error to system appenders and root";
+
+    root["logs"][0]["level"] = "debug";             // 只改级别
+    sylar::Config::LoadFromYaml(root);
+    MYLOG_INFO(system_log) << "shown: system level is debug";
+
+    root["logs"] = YAML::Load("[]");                // 删掉配置: system 恢复继承 root
+    sylar::Config::LoadFromYaml(root);
+    MYLOG_INFO(system_log) << "back to root";
+}
+
+/// 监视配置文件: 改了 system.port 以后只有它的回调触发, system.int_vector 没变不会重新设置
+void test_watcher()
+{
+    const char* path = "./test_watch.yml";
+    std::ofstream("./test_watch.yml") << "system:\n  port: 9000\n  int_vector: [1, 2, 3]\n";
+
+    int vec_changed = 0;
+    g_vector_int_value_config->addListener(0xA1, [&vec_changed](const std::vector<int>&, const std::vector<int>&) {
+        ++vec_changed;
+    });
+    sylar::ConfigWatcher::ptr watcher(new sylar::ConfigWatcher(50));
+    watcher->addPath(path);
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "watch port=" << g_int_value_config->getValue() << " vec_changed=" << vec_changed;
+
+    std::ofstream("./test_watch.yml.tmp") << "system:\n  port: 9100\n  int_vector: [1, 2, 3]\n";
+    rename("./test_watch.yml.tmp", path);                   // 和编辑器一样 写临时文件再 rename
+    usleep(300 * 1000);
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "watch port=" << g_int_value_config->getValue() << " vec_changed=" << vec_changed
+                                 << " reload=" << watcher->getReloadCount() << " apply=" << watcher->getApplyCount();
+    watcher->stop();
+    g_vector_int_value_config->deleteListener(0xA1);
+    g_int_value_config->setValue(8080);                     // 后面的测试还用默认值
+    unlink(path);
+}
+
+/// 事务: 端口和 int_vector 一起改, 固定住的旧快照读到的还是旧版本, 提交回调只调一次
+void test_transaction()
+{
+    int commits = 0;
+    sylar::Config::AddCommitListener(0xB1, [&commits](const sylar::ConfigCommit& c) {
+        ++commits;
+        MYLOG_INFO(SYLAR_LOG_ROOT()) << "commit version=" << c.version << " vars=" << c.vars.size();
+    });
+    sylar::ConfigSnapshot before;
+    sylar::ConfigTransaction tx;
+    tx.set(g_int_value_config, 9200).set(g_vector_int_value_config, {7, 8, 9});
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "staged port=" << g_int_value_config->getValue();
+    uint64_t version = tx.commit();
+    sylar::ConfigSnapshot after;
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "before v" << before.getVersion() << " port=" << *before.get(g_int_value_config)
+                                 << " vec.size=" << before.get(g_vector_int_value_config)->size();
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "after v" << after.getVersion() << "(" << version << ") port=" << *after.get(g_int_value_config)
+                                 << " vec.size=" << after.get(g_vector_int_value_config)->size() << " commits=" << commits;
+    sylar::Config::DeleteCommitListener(0xB1);
+
+    tx.set(g_int_value_config, 8080).set(g_vector_int_value_config, {1, 2});
+    tx.commit();                                            // 后面的测试还用默认值
+}
+
+/// 容器和自定义结构体(可以嵌套)
+void test_class()
+{
+    YAML::Node root = YAML::Load(
+        "system:\n"
+        "  allow_list: [10.0.0.1, 10.0.0.2]\n"
+        "  routes: {/api: [8080, 8081], /static: [80]}\n"
+        "class:\n"
+        "  map:\n"
+        "    sylar: {name: sylar, age: 30, sex: true, tags: {lang: cpp}}\n"
+        "    tom: {name: tom, age: 20}\n");
+    sylar::Config::LoadFromYaml(root);
+    for(auto& i : g_allow_list_config->getValue()) {
+        MYLOG_INFO(SYLAR_LOG_ROOT()) << "allow: " << i;
+    }
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "routes: " << g_route_config->toString();
+    for(auto& i : g_person_map_config->getValue()) {
+        MYLOG_INFO(SYLAR_LOG_ROOT()) << i.first << " - name=" << i.second.name << " age=" << i.second.age
+                                     << " sex=" << i.second.sex << " tags=" << i.second.tags.size();
+    }
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "class.map:\n" << g_person_map_config->toString();
+}
+
 int main(int argc, char* argv[])
 {
+    test_log();
+    test_class();
+    test_watcher();
+    test_transaction();
+
     MYLOG_INFO(SYLAR_LOG_ROOT()) << g_int_value_config->getValue();
     MYLOG_INFO(SYLAR_LOG_ROOT()) << g_int_value_config->toString();
 
+    // 句柄: 重复注册拿到的是同一个配置项; 同名不同类型注册会抛异常, 查找返回 nullptr
+    sylar::ConfigVar<int>* port = sylar::Config::Handle("system.port", 9090, "system port");
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "handle same=" << (port == g_int_value_config.get()) << " value=" << port->getValue();
+    try {
+        sylar::Config::Lookup("system.port", std::string("8080"), "system port");
+    } catch(const std::invalid_argument& e) {
+        MYLOG_INFO(SYLAR_LOG_ROOT()) << "type mismatch: " << e.what();
+    }
+    MYLOG_INFO(SYLAR_LOG_ROOT()) << "lookup as float: " << (sylar::Config::Lookup<float>("system.port") == nullptr);
+
     // test_yaml();
 
     test_config();
@@ -52,11 +52,40 @@ void test_many_threads_fiber()
     }
 }
 
+// 协程栈溢出: 碰到栈底的保护页 SIGSEGV, CrashHandler 在备用信号栈上运行,
+// 把文件缓冲和异步队列里的日志连同崩溃记录写到 crash_log.txt
+int overflow(int depth) {
+    volatile char buf[1024];
+    buf[0] = (char)depth;
+    if(depth < 0) {                     // 不会成立, 只是让编译器不报无限递归
+        return 0;
+    }
+    return overflow(depth + 1) + buf[0];
+}
+
+void test_crash()
+{
+    sylar::InstallCrashHandler();
+    sylar::Logger::ptr logger(new sylar::Logger("crash"));
+    logger->addAppender(sylar::LogAppender::ptr(new sylar::AsyncLogAppender(
+                sylar::LogAppender::ptr(new sylar::FileLogAppender("./crash_log.txt")))));
+    for(int i = 0; i < 100; ++i) {
+        MYLOG_INFO(logger) << "before crash " << i;
+    }
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber([]() { overflow(0); }));
+    fiber->swapIn();
+}
 
 int main(int argc, char** argv)
 {
     sylar::Thread::SetName("main"); // 修改主线程的 名称 （之前为UNKNOWN）
 
+    if(argc > 1 && std::string(argv[1]) == "crash") {
+        test_crash();
+        return 0;
+    }
+
     test_many_threads_fiber();
 
 //    test_one_fiber();
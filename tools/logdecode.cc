@@ -0,0 +1,183 @@
+/* ******************** 二进制日志解码工具 ********************
+ * 把 MYLOG_BIN_* 写出的二进制日志文件(见 sylar/binlog.h)还原成文本, 格式用 LogFormatter 的模式串
+ *
+ * 用法: sylar_logdecode <binlog文件> [格式]
+ *      默认格式: %d{%Y-%m-%d %H:%M:%S}.%E%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n
+ */
+#include "sylar/binlog.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+namespace {
+
+struct Site {
+    sylar::LogLevel::Level level;
+    uint32_t line;
+    std::string file;
+    std::string fmt;
+    sylar::Logger::ptr logger;
+    std::vector<uint8_t> types;
+};
+
+/// 按顺序读取文件内容, 越界时 ok() 变成 false
+class Reader {
+public:
+    Reader(const std::string& data)
+        :m_data(data) {}
+
+    bool ok() const         { return m_ok; }
+    bool eof() const        { return m_pos >= m_data.size(); }
+
+    template<class T>
+    T read() {
+        T v = T();
+        if(m_pos + sizeof(T) > m_data.size()) {
+            m_ok = false;
+            m_pos = m_data.size();
+            return v;
+        }
+        memcpy(&v, m_data.data() + m_pos, sizeof(T));
+        m_pos += sizeof(T);
+        return v;
+    }
+
+    std::string readStr() {
+        uint32_t n = read<uint32_t>();
+        if(!m_ok || m_pos + n > m_data.size()) {
+            m_ok = false;
+            m_pos = m_data.size();
+            return std::string();
+        }
+        std::string v = m_data.substr(m_pos, n);
+        m_pos += n;
+        return v;
+    }
+private:
+    const std::string& m_data;
+    size_t m_pos = 0;
+    bool m_ok = true;
+};
+
+/// 格式串里的 {} 依次替换成参数
+void RenderMessage(Reader& r, const Site& site, sylar::LogStream& out)
+{
+    size_t arg = 0;
+    const std::string& fmt = site.fmt;
+    for(size_t i = 0; i < fmt.size(); ++i) {
+        if(fmt[i] == '{' && i + 1 < fmt.size() && fmt[i + 1] == '}' && arg < site.types.size()) {
+            switch(site.types[arg++]) {
+            case sylar::binlog::INT64:      out << (long long)r.read<int64_t>();              break;
+            case sylar::binlog::UINT64:     out << (unsigned long long)r.read<uint64_t>();    break;
+            case sylar::binlog::DOUBLE:     out << r.read<double>();                          break;
+            case sylar::binlog::CHAR:       out << (char)r.read<int64_t>();                   break;
+            case sylar::binlog::STRING:     out << r.readStr();                               break;
+            default:                        out << "<bad_arg>";                               break;
+            }
+            ++i;
+            continue;
+        }
+        out << fmt[i];
+    }
+    for(; arg < site.types.size(); ++arg) {             // 格式串里 {} 不够的参数也要读掉
+        if(site.types[arg] == sylar::binlog::STRING) {
+            r.readStr();
+        } else {
+            r.read<uint64_t>();
+        }
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <binlog file> [pattern]" << std::endl;
+        return 1;
+    }
+    std::string pattern = argc > 2 ? argv[2] : "%d{%Y-%m-%d %H:%M:%S}.%E%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
+
+    std::ifstream ifs(argv[1], std::ios::binary);
+    if(!ifs) {
+        std::cerr << "open " << argv[1] << " failed" << std::endl;
+        return 1;
+    }
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    std::string data = ss.str();
+
+    Reader r(data);
+    char magic[8];
+    for(auto& c : magic) {
+        c = r.read<char>();
+    }
+    uint32_t version = r.read<uint32_t>();
+    if(!r.ok() || memcmp(magic, sylar::binlog::FILE_MAGIC, sizeof(magic)) || version != sylar::binlog::FILE_VERSION) {
+        std::cerr << argv[1] << " is not a sylar binlog file" << std::endl;
+        return 1;
+    }
+
+    sylar::LogFormatter::ptr formatter(new sylar::LogFormatter(pattern));
+    std::map<uint32_t, Site> sites;
+    std::map<std::string, sylar::Logger::ptr> loggers;
+    std::map<uint32_t, std::string> threads;
+    static const std::string s_unknown_thread = "UNKNOW";
+    uint64_t count = 0;
+
+    while(!r.eof() && r.ok()) {
+        uint8_t type = r.read<uint8_t>();
+        if(type == sylar::binlog::SITE) {
+            uint32_t id = r.read<uint32_t>();
+            Site& site = sites[id];
+            site.level = (sylar::LogLevel::Level)r.read<uint8_t>();
+            site.line = r.read<uint32_t>();
+            site.file = r.readStr();
+            site.fmt = r.readStr();
+            std::string name = r.readStr();
+            sylar::Logger::ptr& logger = loggers[name];
+            if(!logger) {
+                logger.reset(new sylar::Logger(name));
+            }
+            site.logger = logger;
+            uint8_t n = r.read<uint8_t>();
+            site.types.resize(n);
+            for(auto& t : site.types) {
+                t = r.read<uint8_t>();
+            }
+        } else if(type == sylar::binlog::THREAD) {
+            uint32_t tid = r.read<uint32_t>();
+            threads[tid] = r.readStr();
+        } else if(type == sylar::binlog::LOG) {
+            uint32_t id = r.read<uint32_t>();
+            uint32_t tid = r.read<uint32_t>();
+            uint32_t fiber = r.read<uint32_t>();
+            uint64_t time_us = r.read<uint64_t>();
+            auto it = sites.find(id);
+            if(it == sites.end()) {
+                std::cerr << "unknown site " << id << ", stop" << std::endl;
+                return 1;
+            }
+            const Site& site = it->second;
+            auto tit = threads.find(tid);
+            sylar::LogEvent::ptr event(new sylar::LogEvent(site.logger, site.level, site.file.c_str(), site.line, 0,
+                                                           tid, fiber, time_us / 1000000,
+                                                           tit == threads.end() ? s_unknown_thread : tit->second,
+                                                           time_us % 1000000));
+            RenderMessage(r, site, event->getSS());
+            sylar::LogStream::Scoped out;
+            formatter->format(*out, site.logger, site.level, event);
+            std::cout.write(out->data(), out->size());
+            ++count;
+        } else {
+            std::cerr << "bad record type " << (int)type << ", stop" << std::endl;
+            return 1;
+        }
+    }
+    if(!r.ok()) {
+        std::cerr << "truncated file after " << count << " records" << std::endl;   // 进程还在写或者崩溃时最后一批没写完整
+        return 1;
+    }
+    return 0;
+}